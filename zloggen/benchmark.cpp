@@ -0,0 +1,84 @@
+//
+// Writer benchmark: entries appended to one pair, as writers used to and using the writer library
+//
+//   zloggen --bench-writer [--entries=200000] <directory>
+//
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "writer.h"
+
+namespace fs = boost::filesystem;
+
+
+static const std::string inputString = "InputInputInputInputInputInputInputInputInputInputInput";
+static const std::string outputString = "OutputOutputOutputOutputOutputOutputOutputOutputOutputOutputOutputOutputOutputOutput";
+static const std::string fields = "Apple,Banana,Potato,,Carrot,Cherry,Date";
+
+static void report(const std::string& what, unsigned long entries, std::chrono::steady_clock::time_point since, unsigned long long writes) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+    std::cout << what << static_cast<unsigned long>(entries / seconds) << " entries/s";
+    if (writes > 0) {
+        std::cout << " (" << writes << " writes)";
+    }
+    std::cout << std::endl;
+}
+
+// As writers used to: two streams, flushed (header first) after each entry so that readers see it
+static void stream_pair(const std::string& dirPath, unsigned long entries) {
+    std::ofstream header(dirPath + "/streams.header", std::ios::out | std::ios::trunc);
+    std::ofstream payload(dirPath + "/streams.payload", std::ios::out | std::ios::trunc);
+    std::streamoff offset = 0;
+    for (unsigned long i = 0; i < entries; ++i) {
+        header << fields << "," << inputString.size() << "," << outputString.size() << "," << offset << "\n";
+        payload << inputString << outputString;
+        offset += static_cast<std::streamoff>(inputString.size() + outputString.size());
+        header.flush();
+        payload.flush();
+    }
+}
+
+static unsigned long long writer_pair(const std::string& dirPath, const std::string& stem, unsigned long entries, const writer_options& options) {
+    pair_writer writer(dirPath, stem, options);
+    for (unsigned long i = 0; i < entries; ++i) {
+        writer.append(fields, inputString, outputString);
+    }
+    writer.close();
+    return writer.writes();
+}
+
+int benchmark_writer(const std::string& directory, unsigned long entries) {
+    fs::create_directories(directory);
+    for (const char* stem : { "streams", "single", "grouped", "appended" }) {
+        for (const char* extension : { ".header", ".payload", ".sealed" }) {
+            fs::remove(fs::path(directory) / (std::string(stem) + extension));
+        }
+    }
+    std::cout << "Writing " << entries << " entries to a pair in " << directory << std::endl;
+
+    auto since = std::chrono::steady_clock::now();
+    stream_pair(directory, entries);
+    report("two streams, flushed per entry:  ", entries, since, 0);
+
+    writer_options single;
+    single.groupCommitEntries = 1;
+    since = std::chrono::steady_clock::now();
+    unsigned long long writes = writer_pair(directory, "single", entries, single);
+    report("writer, entry by entry (writev): ", entries, since, writes);
+
+    writer_options grouped;
+    since = std::chrono::steady_clock::now();
+    writes = writer_pair(directory, "grouped", entries, grouped);
+    report("writer, group commit:            ", entries, since, writes);
+
+    writer_options appended;
+    appended.appendMode = true;
+    since = std::chrono::steady_clock::now();
+    writes = writer_pair(directory, "appended", entries, appended);
+    report("writer, group commit, O_APPEND:  ", entries, since, writes);
+    return 0;
+}
@@ -7,6 +7,11 @@
 #include <thread>
 #include <random>
 #include <ctime>
+#include <map>
+#include <memory>
+
+#include "writer.h"
+#include "trace.h"
 
 
 namespace fs = boost::filesystem;
@@ -18,18 +23,81 @@ std::tm today();
 bool differs_from_today(const std::tm& then);
 std::string get_date_path(const std::tm& today);
 void proceed_to_next_day(std::tm& date);
+int benchmark_writer(const std::string& directory, unsigned long entries);
+
+
+// Drives choice of pairs and delays, seeded with --seed for repeatable runs
+static std::mt19937 generator;
 
+// Records what is written, with --record
+static std::unique_ptr<trace_recorder> recorder;
 
 // Generate a random delay between min and max milliseconds
 void random_delay(int minMs, int maxMs) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
     std::uniform_int_distribution<> dis(minMs, maxMs);
-    std::this_thread::sleep_for(std::chrono::milliseconds(dis(gen)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(dis(generator)));
+}
+
+// Header fields of an entry, before sizes and offset (which are added by the writer)
+static std::string header_fields(const std::vector<std::string>& fruits, unsigned long counter) {
+    std::string fields;
+    fields += fruits[counter % fruits.size()] + ",";
+    fields += fruits[(counter + 1) % fruits.size()] + ",";
+    fields += "Potato,,Carrot,";
+    fields += fruits[(counter + 2) % fruits.size()] + ",";
+    fields += fruits[(counter + 3) % fruits.size()];
+    return fields;
+}
+
+// Open writers for all file pairs in directory
+static std::vector<std::unique_ptr<pair_writer>> open_writers(const std::string& dirPath, unsigned int day, unsigned int numFilePairs, const writer_options& options) {
+    std::vector<std::unique_ptr<pair_writer>> writers;
+    for (unsigned int i = 0; i < numFilePairs; ++i) {
+        writers.push_back(std::make_unique<pair_writer>(dirPath, "file" + std::to_string(i), options));
+    }
+    if (recorder) {
+        recorder->open_day(day, numFilePairs);
+    }
+    return writers;
+}
+
+// Append entry to one of the pairs, noting whether that made it write
+static void append_entry(std::vector<std::unique_ptr<pair_writer>>& writers, unsigned int fileIndex, const std::string& fields,
+                         const std::string& input, const std::string& output) {
+    pair_writer& writer = *writers[fileIndex];
+    const unsigned long long writes = writer.writes();
+    writer.append(fields, input, output);
+    if (recorder) {
+        recorder->append(fileIndex, fields, input.size(), output.size());
+        if (writer.writes() != writes) {
+            recorder->flush(fileIndex);
+        }
+    }
+}
+
+// Write what has waited long enough in any of the pairs
+static void flush_writers(std::vector<std::unique_ptr<pair_writer>>& writers) {
+    for (unsigned int i = 0; i < writers.size(); ++i) {
+        const unsigned long long writes = writers[i]->writes();
+        writers[i]->flush_if_due();
+        if (recorder && writers[i]->writes() != writes) {
+            recorder->flush(i);
+        }
+    }
+}
+
+// Close and seal all files
+static void close_writers(std::vector<std::unique_ptr<pair_writer>>& writers) {
+    for (auto& writer : writers) {
+        writer->close();
+    }
+    if (recorder) {
+        recorder->close_day();
+    }
 }
 
 // Simulate writing entries into header/payload paired files for a given date
-void generate_test_data_for_day(const std::string& basePath, const std::tm& date, const unsigned int numFilePairs, const unsigned int numberEntries) {
+void generate_test_data_for_day(const std::string& basePath, const std::tm& date, unsigned int day, const unsigned int numFilePairs, const unsigned int numberEntries, const writer_options& options) {
     std::cout << "Generating test data for " << (1900 + date.tm_year)
               << "-" << (date.tm_mon + 1) << "-" << date.tm_mday << " " << std::flush;
 
@@ -45,81 +113,22 @@ void generate_test_data_for_day(const std::string& basePath, const std::tm& date
     }
 
     // Open header and payload file pairs
-    std::vector<std::ofstream> headerFiles(numFilePairs);
-    std::vector<std::ofstream> payloadFiles(numFilePairs);
-    for (int i = 0; i < numFilePairs; ++i) {
-        std::string headerFilename = dirPath + "/file" + std::to_string(i) + ".header";
-        std::string payloadFilename = dirPath + "/file" + std::to_string(i) + ".payload";
-
-        headerFiles[i].open(headerFilename, std::ios::out | std::ios::app);
-        payloadFiles[i].open(payloadFilename, std::ios::out | std::ios::app);
-    }
+    std::vector<std::unique_ptr<pair_writer>> writers = open_writers(dirPath, day, numFilePairs, options);
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
     std::uniform_int_distribution<> fileSelector(0, static_cast<signed>(numFilePairs) - 1);
 
-    std::uniform_int_distribution<> delayedHeaderWrite(0, 100);
-
-
     // Write entries into the files
-    std::vector<std::streamoff> currentOffset(numFilePairs, 0);
-
     for (int entryIndex = 0; entryIndex < numberEntries; ++entryIndex) {
-        int fileIndex = fileSelector(gen);  // Randomly select one of the file pairs
-
-        // Generate header entry
-        std::string headerLine;
-        headerLine += fruits[entryIndex % fruits.size()] + ",";
-        headerLine += fruits[(entryIndex + 1) % fruits.size()] + ",";
-        headerLine += "Potato,,Carrot,";
-        headerLine += fruits[(entryIndex + 2) % fruits.size()] + ",";
-
-        if (delayedHeaderWrite(gen) > 10) {
-            // No flush
-            headerLine += fruits[(entryIndex + 3) % fruits.size()] + ",";
-
-        } else {
-            // Simulate (on the client side) reading half written headers
-            // partial write of header entry
-            headerFiles[fileIndex] << headerLine << std::flush;
-            random_delay(1, 100);
-
-            headerLine = fruits[(entryIndex + 3) % fruits.size()] + ",";
-        }
-
-        headerLine += std::to_string(inputString.size()) + ",";
-        headerLine += std::to_string(outputString.size()) + ",";
-        headerLine += std::to_string(currentOffset[fileIndex]) + "\n";
-        headerFiles[fileIndex] << headerLine;
-
-        // Generate payload data
-        payloadFiles[fileIndex] << inputString << outputString;
-
-        // Update the current offset for the next entry
-        currentOffset[fileIndex] += static_cast<std::streamoff>(inputString.size() + outputString.size());
-
-        // Stochastically flush buffers
-        random_delay(10, 50);
-        if (entryIndex % 5 == 0) {
-            headerFiles[fileIndex].flush();   // Flush header file first
-            random_delay(10, 50);  // Delay between flushing header and payload
-            payloadFiles[fileIndex].flush();  // Then flush payload file
-        } else if (entryIndex % 7 == 0) {
-            payloadFiles[fileIndex].flush();  // Flush payload file first
-            random_delay(10, 50);  // Delay between flushing payload and header
-            headerFiles[fileIndex].flush();   // Then flush header file
-        }
+        int fileIndex = fileSelector(generator);  // Randomly select one of the file pairs
+        append_entry(writers, fileIndex, header_fields(fruits, entryIndex), inputString, outputString);
 
         // Random delay between entries to simulate realistic file writing
         random_delay(1, 10);
+        flush_writers(writers);
     }
 
-    // Close all files
-    for (int i = 0; i < numFilePairs; ++i) {
-        headerFiles[i].close();
-        payloadFiles[i].close();
-    }
+    // Close and seal all files
+    close_writers(writers);
 
     std::cout << "-- completed" << std::endl;
 }
@@ -131,7 +140,7 @@ void increment_date(std::tm& dateTm) {
     dateTm = *std::localtime(&timeSinceEpoch);
 }
 
-[[noreturn]] void generate_continuous_test_data(const std::string& basePath) {
+[[noreturn]] void generate_continuous_test_data(const std::string& basePath, const writer_options& options) {
     constexpr unsigned int numFilePairs = 10;
     std::tm date = today();
 
@@ -150,98 +159,28 @@ void increment_date(std::tm& dateTm) {
     }
 
     // Open header and payload file pairs
-    std::vector<std::ofstream> headerFiles(numFilePairs);
-    std::vector<std::ofstream> payloadFiles(numFilePairs);
-    // Open new files
-    for (int i = 0; i < numFilePairs; ++i) {
-        std::string headerPath = dirPath + "/file" + std::to_string(i) + ".header";
-        std::string payloadPath = dirPath + "/file" + std::to_string(i) + ".payload";
-
-        headerFiles[i].open(headerPath, std::ios::out | std::ios::app);
-        if (!headerFiles[i].is_open()) {
-            std::cerr << "Error opening header file: " << headerPath << std::endl;
-        }
+    unsigned int day = 0;
+    std::vector<std::unique_ptr<pair_writer>> writers = open_writers(dirPath, day, numFilePairs, options);
 
-        payloadFiles[i].open(payloadPath, std::ios::out | std::ios::app);
-        if (!payloadFiles[i].is_open()) {
-            std::cerr << "Error opening payload file: " << payloadPath << std::endl;
-        }
-    }
-
-    std::random_device rd;
-    std::mt19937 gen(rd());
     std::uniform_int_distribution<> fileSelector(0, numFilePairs - 1);
 
-    std::uniform_int_distribution<> delayedHeaderWrite(0, 100);
-
-    //
-    std::vector<std::streamoff> currentPayloadOffset(numFilePairs, 0);
-
     //
     unsigned long counter = 0L;
     while (true) {
-        int fileIndex = fileSelector(gen);  // Randomly select one of the file pairs
-
-        // Generate header entry
-        std::string headerLine;
-        headerLine += fruits[counter % fruits.size()] + ",";
-        headerLine += fruits[(counter + 1) % fruits.size()] + ",";
-        headerLine += "Potato,,Carrot,";
-        headerLine += fruits[(counter + 2) % fruits.size()] + ",";
-
-        if (delayedHeaderWrite(gen) > 10) {
-            // No flush
-            headerLine += fruits[(counter + 3) % fruits.size()] + ",";
-
-        } else {
-            // Simulate (on the client side) reading half written headers
-            // partial write of header entry
-            headerFiles[fileIndex] << headerLine << std::flush;
-            random_delay(1, 100);
-
-            headerLine = fruits[(counter + 3) % fruits.size()] + ",";
-        }
-
-        headerLine += std::to_string(inputString.size()) + ",";
-        headerLine += std::to_string(outputString.size()) + ",";
-        headerLine += std::to_string(currentPayloadOffset[fileIndex]) + "\n";
-        headerFiles[fileIndex] << headerLine;
-
-        // Generate payload data
-        payloadFiles[fileIndex] << inputString << outputString;
-
-        // Update the current offset for the next entry
-        currentPayloadOffset[fileIndex] += static_cast<std::streamoff>(inputString.size() + outputString.size());
-
-        // Stochastically flush buffers
-        random_delay(0, 5);
-        if (counter % 5 == 0) {
-            headerFiles[fileIndex].flush();   // Flush header file first
-            random_delay(1, 50);  // Delay between flushing header and payload
-            payloadFiles[fileIndex].flush();  // Then flush payload file
-        } else if (counter % 7 == 0) {
-            payloadFiles[fileIndex].flush();  // Flush payload file first
-            random_delay(1, 50);  // Delay between flushing payload and header
-            headerFiles[fileIndex].flush();   // Then flush header file
-        }
+        int fileIndex = fileSelector(generator);  // Randomly select one of the file pairs
+        append_entry(writers, fileIndex, header_fields(fruits, counter), inputString, outputString);
         ++counter;
 
         // Random delay between entries to simulate realistic file writing
-        random_delay(0, 5);
+        random_delay(0, 10);
+        flush_writers(writers);
 
         // Check if we have passed into a new day
         if (differs_from_today(date)) {
             std::cout << std::flush << std::endl << "Detected day rollover" << std::endl;
 
-            // Close all open files
-            for (int i = 0; i < numFilePairs; ++i) {
-                if (headerFiles[i].is_open()) {
-                    headerFiles[i].close();
-                }
-                if (payloadFiles[i].is_open()) {
-                    payloadFiles[i].close();
-                }
-            }
+            // Close and seal all open files
+            close_writers(writers);
 
             date = today();
             dirPath = basePath + "/" + get_date_path(date);
@@ -253,23 +192,8 @@ void increment_date(std::tm& dateTm) {
             std::cout << "Generating test data for " << (1900 + date.tm_year)
                      << "-" << (date.tm_mon + 1) << "-" << date.tm_mday << " " << std::endl << std::flush;
 
-            // Re-open new files and reset payload offset
-            for (int i = 0; i < numFilePairs; ++i) {
-                currentPayloadOffset[i] = 0;
-
-                std::string headerPath = dirPath + "/file" + std::to_string(i) + ".header";
-                std::string payloadPath = dirPath + "/file" + std::to_string(i) + ".payload";
-
-                headerFiles[i].open(headerPath, std::ios::out | std::ios::app);
-                if (!headerFiles[i].is_open()) {
-                    std::cerr << "Error opening header file: " << headerPath << std::endl;
-                }
-
-                payloadFiles[i].open(payloadPath, std::ios::out | std::ios::app);
-                if (!payloadFiles[i].is_open()) {
-                    std::cerr << "Error opening payload file: " << payloadPath << std::endl;
-                }
-            }
+            // Open new files
+            writers = open_writers(dirPath, ++day, numFilePairs, options);
         } else {
             std::cout << "." << std::flush;
         }
@@ -278,11 +202,54 @@ void increment_date(std::tm& dateTm) {
 
 int main(int argc, char* argv[]) {
     try {
+        // Options (--name or --name=value) may go anywhere on command line
+        std::map<std::string, std::string> options;
+        std::vector<char*> positional;
+        for (int i = 0; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.starts_with("--")) {
+                std::string::size_type eq = arg.find('=');
+                options[arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2)] = eq == std::string::npos ? "" : arg.substr(eq + 1);
+            } else {
+                positional.push_back(argv[i]);
+            }
+        }
+        argc = static_cast<int>(positional.size());
+        argv = positional.data();
+
         if (argc < 2) {
-            std::cerr << "Usage: " << argv[0] << " <base-directory> <number_of_days> <number_of_file_pairs> <number_of_entries>" << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--live] [--group-commit=N] [--append] [--seed=N] [--record=<trace>] <base-directory> <number_of_days> <number_of_file_pairs> <number_of_entries>" << std::endl;
+            std::cerr << "       " << argv[0] << " --replay=<trace> [--speed=N] <base-directory>" << std::endl;
+            std::cerr << "       " << argv[0] << " --bench-writer [--entries=N] <directory>" << std::endl;
             return 1;
         }
 
+        if (options.contains("bench-writer")) {
+            return benchmark_writer(argv[1], options.contains("entries") ? std::stoul(options["entries"]) : 200000);
+        }
+
+        if (options.contains("replay")) {
+            return replay_trace(options["replay"], argv[1], options.contains("speed") ? std::stod(options["speed"]) : 1.0);
+        }
+
+        // Same seed, same pairs chosen and same delays
+        if (options.contains("seed")) {
+            generator.seed(std::stoul(options["seed"]));
+        } else {
+            generator.seed(std::random_device()());
+        }
+
+        // How entries are written (and published to co-located readers, with --live)
+        writer_options writerOptions;
+        writerOptions.live = options.contains("live");
+        writerOptions.appendMode = options.contains("append");
+        if (options.contains("group-commit")) {
+            writerOptions.groupCommitEntries = std::stoul(options["group-commit"]);
+        }
+        if (options.contains("record")) {
+            recorder = std::make_unique<trace_recorder>(options["record"], writerOptions);
+        }
+
         unsigned int numberOfDays = 0;
         unsigned int numberOfFilePairs = 0;
         unsigned int numberOfEntries = 0;
@@ -318,11 +285,11 @@ int main(int argc, char* argv[]) {
         // Simulate writing data for the specified number of days
         if (argc == 5) {
             for (int day = 0; day < numberOfDays; ++day) {
-                generate_test_data_for_day(basePath, date, numberOfFilePairs, numberOfEntries);
+                generate_test_data_for_day(basePath, date, day, numberOfFilePairs, numberOfEntries, writerOptions);
                 increment_date(date);  // Move to the next day
             }
         } else {
-            generate_continuous_test_data(basePath);
+            generate_continuous_test_data(basePath, writerOptions);
         }
     }
     catch (const std::invalid_argument& ia) {
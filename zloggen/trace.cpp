@@ -0,0 +1,209 @@
+//
+// Recording and replay of writer traces (see trace.h)
+//
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "trace.h"
+
+namespace fs = boost::filesystem;
+
+// Forward declarations
+std::tm today();
+void increment_date(std::tm& dateTm);
+std::string get_date_path(const std::tm& today);
+
+
+trace_recorder::trace_recorder(const std::string& path, const writer_options& options)
+    : stream(path, std::ios::out | std::ios::trunc), start(std::chrono::steady_clock::now()) {
+    if (!stream) {
+        throw std::runtime_error("Could not create trace " + path);
+    }
+    stream << "zlogtrace 1\n"
+           << "options," << options.groupCommitEntries << "," << options.live << "," << options.appendMode << "\n";
+}
+
+trace_recorder::~trace_recorder() {
+    stream.flush();
+}
+
+long long trace_recorder::now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void trace_recorder::open_day(unsigned int day, unsigned int pairs) {
+    stream << "day," << now() << "," << day << "," << pairs << "\n";
+}
+
+void trace_recorder::append(unsigned int pair, std::string_view fields, std::size_t inputSize, std::size_t outputSize) {
+    stream << "append," << now() << "," << pair << "," << inputSize << "," << outputSize << "," << fields << "\n";
+}
+
+void trace_recorder::flush(unsigned int pair) {
+    stream << "flush," << now() << "," << pair << "\n";
+}
+
+void trace_recorder::close_day() {
+    stream << "close," << now() << "\n";
+    stream.flush(); // a continuous run ends when interrupted, so keep what is done
+}
+
+
+// Splits off up to 'count' leading comma separated values, leaving the rest of 'line' in 'rest'
+static std::vector<std::string> leading_values(const std::string& line, std::size_t count, std::string& rest) {
+    std::vector<std::string> values;
+    std::string::size_type from = 0;
+    while (values.size() < count) {
+        std::string::size_type comma = line.find(',', from);
+        if (comma == std::string::npos) {
+            values.push_back(line.substr(from));
+            from = line.size();
+            break;
+        }
+        values.push_back(line.substr(from, comma - from));
+        from = comma + 1;
+    }
+    rest = from < line.size() ? line.substr(from) : "";
+    return values;
+}
+
+// 'size' bytes of 'pattern' repeated, as zloggen writes them
+static std::string_view filled(std::string& cache, std::string_view pattern, std::size_t size) {
+    while (cache.size() < size) {
+        cache += pattern;
+    }
+    return std::string_view(cache).substr(0, size);
+}
+
+int replay_trace(const std::string& tracePath, const std::string& basePath, double speed) {
+    std::ifstream trace(tracePath);
+    std::string line;
+    if (!trace || !std::getline(trace, line) || line != "zlogtrace 1") {
+        throw std::runtime_error("Not a trace: " + tracePath);
+    }
+
+    // Writes happen where recorded, rather than when group commit thresholds are reached
+    writer_options options;
+    std::string rest;
+    if (std::getline(trace, line)) {
+        std::vector<std::string> values = leading_values(line, 4, rest);
+        if (values.size() != 4 || values[0] != "options") {
+            throw std::runtime_error("Corrupt trace (no options): " + tracePath);
+        }
+        options.groupCommitEntries = std::stoul(values[1]);
+        options.live = values[2] == "1";
+        options.appendMode = values[3] == "1";
+        if (options.groupCommitEntries > 1) {
+            options.groupCommitEntries = std::numeric_limits<std::size_t>::max();
+            options.groupCommitBytes = std::numeric_limits<std::size_t>::max();
+        }
+    }
+
+    std::cout << "Replaying " << tracePath << " into " << basePath;
+    if (speed > 0) {
+        std::cout << " at " << speed << "x original speed" << std::endl;
+    } else {
+        std::cout << " as fast as possible" << std::endl;
+    }
+
+    std::vector<std::unique_ptr<pair_writer>> writers;
+    std::string inputCache;
+    std::string outputCache;
+    unsigned long long entries = 0;
+    unsigned long long flushes = 0;
+    unsigned int days = 0;
+    long long recordedMicros = 0;
+    std::chrono::steady_clock::duration behind{};
+
+    const auto start = std::chrono::steady_clock::now();
+    unsigned long lineNumber = 2;
+    while (std::getline(trace, line)) {
+        ++lineNumber;
+        if (line.empty()) {
+            continue;
+        }
+        const std::string where = " at line " + std::to_string(lineNumber) + " of " + tracePath;
+        std::vector<std::string> values = leading_values(line, line.starts_with("append,") ? 5 : 4, rest);
+        if (values.size() < 2) {
+            throw std::runtime_error("Corrupt trace" + where);
+        }
+        const std::string& event = values[0];
+        recordedMicros = std::stoll(values[1]);
+
+        // Keep to schedule, noting how far behind we fall
+        if (speed > 0) {
+            const auto due = start + std::chrono::microseconds(static_cast<long long>(recordedMicros / speed));
+            const auto now = std::chrono::steady_clock::now();
+            if (now < due) {
+                std::this_thread::sleep_until(due);
+            } else {
+                behind = std::max(behind, now - due);
+            }
+        }
+
+        auto writer_of = [&](const std::string& value) -> pair_writer& {
+            const unsigned long pair = std::stoul(value);
+            if (pair >= writers.size()) {
+                throw std::runtime_error("No pair " + value + where);
+            }
+            return *writers[pair];
+        };
+
+        if (event == "day" && values.size() == 4) {
+            std::tm date = today();
+            for (unsigned long day = std::stoul(values[2]); day > 0; --day) {
+                increment_date(date);
+            }
+            const std::string dirPath = basePath + "/" + get_date_path(date);
+            fs::create_directories(dirPath);
+            std::cout << "Replaying day " << get_date_path(date) << std::endl;
+
+            writers.clear();
+            for (unsigned long i = 0; i < std::stoul(values[3]); ++i) {
+                // Appending to pairs of an earlier run would leave them with the data twice
+                const std::string stem = dirPath + "/file" + std::to_string(i);
+                if (fs::exists(stem + ".header") || fs::exists(stem + ".payload")) {
+                    throw std::runtime_error("Pairs already in " + dirPath + ", replay to a fresh base directory");
+                }
+                writers.push_back(std::make_unique<pair_writer>(dirPath, "file" + std::to_string(i), options));
+            }
+            ++days;
+        } else if (event == "append" && values.size() == 5) {
+            writer_of(values[2]).append(rest,
+                                        filled(inputCache, "Input", std::stoul(values[3])),
+                                        filled(outputCache, "Output", std::stoul(values[4])));
+            ++entries;
+        } else if (event == "flush" && values.size() == 3) {
+            writer_of(values[2]).flush();
+            ++flushes;
+        } else if (event == "close") {
+            for (auto& writer : writers) {
+                writer->close();
+            }
+            writers.clear();
+        } else {
+            throw std::runtime_error("Corrupt trace" + where);
+        }
+    }
+
+    // An interrupted recording leaves pairs open, and so does replay
+    for (auto& writer : writers) {
+        writer->close(false);
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Replayed " << entries << " entries (" << flushes << " flushes) over " << days << " days in "
+              << seconds << " s, recorded in " << recordedMicros / 1e6 << " s";
+    if (speed > 0) {
+        std::cout << " -- at most " << std::chrono::duration_cast<std::chrono::milliseconds>(behind).count() << " ms behind schedule";
+    }
+    std::cout << std::endl;
+    return 0;
+}
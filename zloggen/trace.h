@@ -0,0 +1,50 @@
+//
+// Writer traces, for reproducible runs: what zloggen appended and flushed, to which pair and
+// when, recorded during a run and replayed later (at original speed or faster).
+//
+// Traces are text, one event per line, with times in microseconds since start of run:
+//
+//   zlogtrace 1
+//   options,<group commit entries>,<live>,<append mode>
+//   day,<time>,<day>,<pairs>            pairs file0 .. fileN-1 opened in directory of day (0 = first)
+//   append,<time>,<pair>,<input size>,<output size>,<header fields>
+//   flush,<time>,<pair>                 buffered entries written
+//   close,<time>                        all pairs of day closed and sealed
+//
+// Payloads are not recorded, only their sizes.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+#include "writer.h"
+
+class trace_recorder {
+public:
+    // Throws std::runtime_error if trace could not be created
+    trace_recorder(const std::string& path, const writer_options& options);
+    ~trace_recorder();
+
+    void open_day(unsigned int day, unsigned int pairs);
+    void append(unsigned int pair, std::string_view fields, std::size_t inputSize, std::size_t outputSize);
+    void flush(unsigned int pair);
+    void close_day();
+
+private:
+    long long now() const;
+
+    std::ofstream stream;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Replays trace into 'basePath', with first day of trace being today. 'speed' is relative to
+// original speed, or 0 for as fast as possible. Throws std::runtime_error on corrupt traces
+int replay_trace(const std::string& tracePath, const std::string& basePath, double speed);
+
+#endif // TRACE_H
@@ -0,0 +1,531 @@
+//
+// Offline query tool for historical day directories. Scans header/payload pairs
+// for a range of days in parallel (one file pair at a time per worker thread),
+// applies header filters and optionally picks up matching payload slices.
+// Pairs of compacted days are scanned in their segments, mapped once per segment.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+#include "zlog.h"
+#include "options.h"
+#include "filter.h"
+#include "segment.h"
+
+namespace fs = boost::filesystem;
+
+// Forward declarations
+std::string tm_to_string(const std::tm& timeStruct, const std::string& format);
+std::tm string_to_tm(const std::string& timeString, const std::string& format);
+std::string get_date_path(const std::tm& today);
+void proceed_to_next_day(std::tm& date);
+
+#define DEFAULT_SAMPLE_LIMIT 10UL
+#define OUTPUT_FLUSH_SIZE (1024 * 1024)
+
+enum class output_mode { COUNT, SAMPLE, NDJSON };
+
+class mapped_file;
+
+struct query_unit {
+    std::string date;
+    fs::path headerPath;
+    fs::path payloadPath;
+
+    // Compacted pairs are found in a segment, rather than in files of their own
+    std::shared_ptr<mapped_file> segment;
+    std::uint64_t headerOffset = 0;
+    std::uint64_t headerLength = 0;
+    std::uint64_t payloadOffset = 0;
+    std::uint64_t payloadLength = 0;
+};
+
+// Read-only memory mapping of a whole file
+class mapped_file {
+public:
+    explicit mapped_file(const fs::path& path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat stat_buf;
+        if (fstat(fd, &stat_buf) == 0 && stat_buf.st_size > 0) {
+            void* addr = mmap(nullptr, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                data = static_cast<const char*>(addr);
+                length = static_cast<std::size_t>(stat_buf.st_size);
+                madvise(addr, length, MADV_SEQUENTIAL);
+            }
+        }
+    }
+
+    ~mapped_file() {
+        if (data) {
+            munmap(const_cast<char*>(data), length);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    bool is_open() const { return fd >= 0; }
+    const char* begin() const { return data; }
+    const char* end() const { return data + length; }
+    std::size_t size() const { return length; }
+
+private:
+    int fd = -1;
+    const char* data = nullptr;
+    std::size_t length = 0;
+};
+
+// Splits the next complete line in [pos, end) into fields, advancing 'pos' past the newline.
+// Returns false if there is no complete line left (i.e. a torn tail). Delimiters are located
+// 16 bytes at a time using SSE2, where available.
+static bool next_line(const char*& pos, const char* end, std::string_view* fields, std::size_t& count) {
+    const char* fieldStart = pos;
+    const char* p = pos;
+    count = 0;
+
+    auto delimiter = [&](const char* d) -> bool {
+        if (count < NUMBER_HEADER_FIELDS) {
+            fields[count] = std::string_view(fieldStart, d - fieldStart);
+        }
+        ++count;
+        fieldStart = d + 1;
+        if (*d == '\n') {
+            pos = d + 1;
+            return true;
+        }
+        return false;
+    };
+
+#ifdef __SSE2__
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(block, comma), _mm_cmpeq_epi8(block, newline))));
+        while (mask) {
+            if (delimiter(p + __builtin_ctz(mask))) {
+                return true;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    for (; p < end; ++p) {
+        if ((*p == ',' || *p == '\n') && delimiter(p)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_number(std::string_view text, unsigned long long& value) {
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return ec == std::errc() && ptr == text.data() + text.size();
+}
+
+// Length of the UTF-8 sequence starting at 'p' if it is well-formed, or else 0
+static std::size_t utf8_sequence_length(const unsigned char* p, std::size_t remaining) {
+    std::size_t length;
+    unsigned char low = 0x80, high = 0xbf; // bounds of second byte
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        length = 2;
+    } else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+        length = 3;
+        if (p[0] == 0xe0) low = 0xa0;      // overlong
+        else if (p[0] == 0xed) high = 0x9f; // surrogates
+    } else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        length = 4;
+        if (p[0] == 0xf0) low = 0x90;       // overlong
+        else if (p[0] == 0xf4) high = 0x8f; // beyond U+10FFFF
+    } else {
+        return 0;
+    }
+    if (remaining < length || p[1] < low || p[1] > high) {
+        return 0;
+    }
+    for (std::size_t i = 2; i < length; ++i) {
+        if (p[i] < 0x80 || p[i] > 0xbf) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+// UTF-8 is passed through as is. Control characters are escaped, and so are bytes that are not
+// UTF-8 (as the code point of the same value, i.e. as if Latin-1)
+static void append_json_string(std::string& out, std::string_view value) {
+    static const char* hex = "0123456789abcdef";
+    out += '"';
+    for (std::size_t i = 0; i < value.size(); ++i) {
+        const char ch = value[i];
+        auto c = static_cast<unsigned char>(ch);
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c >= 0x80) {
+                    const std::size_t length = utf8_sequence_length(reinterpret_cast<const unsigned char*>(value.data() + i), value.size() - i);
+                    if (length > 0) {
+                        out.append(value.data() + i, length);
+                        i += length - 1;
+                        break;
+                    }
+                }
+                if (c < 0x20 || c >= 0x7f) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+                } else {
+                    out += ch;
+                }
+        }
+    }
+    out += '"';
+}
+
+// For payloads that are not text
+static void append_json_base64(std::string& out, std::string_view value) {
+    static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    out += '"';
+    std::size_t i = 0;
+    for (; i + 2 < value.size(); i += 3) {
+        const auto bits = static_cast<std::uint32_t>(static_cast<unsigned char>(value[i])) << 16
+                        | static_cast<std::uint32_t>(static_cast<unsigned char>(value[i + 1])) << 8
+                        | static_cast<unsigned char>(value[i + 2]);
+        out += alphabet[bits >> 18];
+        out += alphabet[(bits >> 12) & 0x3f];
+        out += alphabet[(bits >> 6) & 0x3f];
+        out += alphabet[bits & 0x3f];
+    }
+    if (i < value.size()) {
+        const bool two = i + 1 < value.size();
+        const auto bits = static_cast<std::uint32_t>(static_cast<unsigned char>(value[i])) << 16
+                        | (two ? static_cast<std::uint32_t>(static_cast<unsigned char>(value[i + 1])) << 8 : 0);
+        out += alphabet[bits >> 18];
+        out += alphabet[(bits >> 12) & 0x3f];
+        out += two ? alphabet[(bits >> 6) & 0x3f] : '=';
+        out += '=';
+    }
+    out += '"';
+}
+
+struct query {
+    header_filter filter;
+    output_mode mode = output_mode::COUNT;
+    unsigned long limit = 0; // 0 means no limit
+    bool withPayload = false;
+    bool payloadBase64 = false; // rather than as text
+
+    std::atomic<unsigned long> totalEntries = 0;
+    std::atomic<unsigned long> matchingEntries = 0;
+    std::atomic<unsigned long> emittedEntries = 0;
+    std::atomic<unsigned long> tornEntries = 0;
+    std::atomic<unsigned long> failedUnits = 0;
+    std::atomic<unsigned long long> bytesScanned = 0;
+
+    std::mutex outputMutex;
+
+    // Reserve room for one more emitted record, honouring the limit
+    bool reserve() {
+        if (limit == 0) {
+            return true;
+        }
+        return emittedEntries.fetch_add(1) < limit;
+    }
+
+    void flush(std::string& buffer) {
+        if (!buffer.empty()) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cout.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+        }
+    }
+};
+
+static void scan_unit(const query_unit& unit, query& q) {
+    // Header and payload, either mapped on their own or as parts of a segment
+    std::unique_ptr<mapped_file> headerFile;
+    std::unique_ptr<mapped_file> payloadFile;
+    std::string_view header;
+    std::string_view payload;
+    if (unit.segment) {
+        if (unit.segment->begin() == nullptr) {
+            return;
+        }
+        header = std::string_view(unit.segment->begin() + unit.headerOffset, unit.headerLength);
+        payload = std::string_view(unit.segment->begin() + unit.payloadOffset, unit.payloadLength);
+    } else {
+        headerFile = std::make_unique<mapped_file>(unit.headerPath);
+        if (!headerFile->is_open()) {
+            std::cerr << "Could not open " << unit.headerPath.string() << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        if (headerFile->size() == 0) {
+            return;
+        }
+        header = std::string_view(headerFile->begin(), headerFile->size());
+
+        if (q.withPayload) {
+            payloadFile = std::make_unique<mapped_file>(unit.payloadPath);
+            if (payloadFile->begin()) {
+                payload = std::string_view(payloadFile->begin(), payloadFile->size());
+            }
+        }
+    }
+    if (header.empty()) {
+        return;
+    }
+    const char* const headerEnd = header.data() + header.size();
+
+    const std::string fileName = unit.headerPath.filename().string();
+    std::string buffer;
+    unsigned long entries = 0;
+    unsigned long matches = 0;
+
+    std::string_view fields[NUMBER_HEADER_FIELDS];
+    std::size_t count;
+    const char* pos = header.data();
+    while (true) {
+        const char* lineStart = pos;
+        if (!next_line(pos, headerEnd, fields, count)) {
+            if (lineStart != headerEnd) {
+                q.tornEntries++;
+            }
+            break;
+        }
+        if (count != NUMBER_HEADER_FIELDS) {
+            q.tornEntries++;
+            continue;
+        }
+        ++entries;
+
+        if (!q.filter.matches(fields, count)) {
+            continue;
+        }
+        ++matches;
+
+        if (q.mode == output_mode::COUNT || !q.reserve()) {
+            continue;
+        }
+
+        const std::streamoff headerOffset = lineStart - header.data();
+        if (q.mode == output_mode::SAMPLE) {
+            buffer += unit.date + "/" + fileName + ":" + std::to_string(headerOffset) + ": ";
+            buffer.append(lineStart, pos - lineStart);
+
+        } else { // NDJSON
+            buffer += "{\"date\":\"" + unit.date + "\",\"file\":";
+            append_json_string(buffer, fileName);
+            buffer += ",\"offset\":" + std::to_string(headerOffset) + ",\"fields\":[";
+            for (std::size_t i = 0; i < NUMBER_HEADER_FIELDS; ++i) {
+                if (i > 0) {
+                    buffer += ',';
+                }
+                append_json_string(buffer, fields[i]);
+            }
+            buffer += ']';
+
+            if (q.withPayload) {
+                unsigned long long inputSize = 0, outputSize = 0, offset = 0;
+                bool valid = parse_number(fields[7], inputSize)
+                          && parse_number(fields[8], outputSize)
+                          && parse_number(fields[9], offset);
+                if (valid && !payload.empty() && offset <= payload.size() && inputSize <= payload.size() - offset
+                    && outputSize <= payload.size() - offset - inputSize) {
+                    const char* slice = payload.data() + offset;
+                    auto append_slice = q.payloadBase64 ? append_json_base64 : append_json_string;
+                    buffer += ",\"input\":";
+                    append_slice(buffer, std::string_view(slice, inputSize));
+                    buffer += ",\"output\":";
+                    append_slice(buffer, std::string_view(slice + inputSize, outputSize));
+                } else {
+                    buffer += ",\"payload\":null";
+                }
+            }
+            buffer += "}\n";
+        }
+
+        if (buffer.size() > OUTPUT_FLUSH_SIZE) {
+            q.flush(buffer);
+        }
+    }
+    q.flush(buffer);
+
+    q.totalEntries += entries;
+    q.matchingEntries += matches;
+    q.bytesScanned += header.size();
+}
+
+// Collect header/payload pairs in all day directories of the date range -- in files of their own,
+// or in segments. While a day is being compacted, pairs may be in both, in which case segments win
+static std::vector<query_unit> find_units(const std::string& basePath, std::tm from, const std::tm& to) {
+    std::vector<query_unit> units;
+
+    const std::string last = tm_to_string(to, DATE_FORMAT);
+    while (true) {
+        const std::string date = tm_to_string(from, DATE_FORMAT);
+        if (date > last) {
+            break;
+        }
+
+        fs::path dirPath = basePath;
+        dirPath /= get_date_path(from);
+        if (fs::is_directory(dirPath)) {
+            std::set<std::string> compacted;
+            for (const fs::path& segmentPath : find_segments(dirPath)) {
+                segment_index index(segmentPath);
+                auto segment = std::make_shared<mapped_file>(segmentPath);
+                for (const segment_pair& pair : index.pairs()) {
+                    query_unit unit { date, dirPath / (pair.stem + ".header"), dirPath / (pair.stem + ".payload"), segment,
+                                      pair.headerOffset, pair.headerLength, pair.payloadOffset, pair.payloadLength };
+                    units.push_back(std::move(unit));
+                    compacted.insert(pair.stem);
+                }
+            }
+            for (const auto& entry : fs::directory_iterator(dirPath)) {
+                if (entry.path().extension() != ".header" || compacted.count(entry.path().stem().string()) > 0) {
+                    continue;
+                }
+                fs::path payloadPath = entry.path();
+                payloadPath.replace_extension(".payload");
+                if (!fs::exists(payloadPath)) {
+                    std::cerr << ".header and .payload files do not match for " << entry.path().string() << std::endl;
+                    continue;
+                }
+                units.push_back({ date, entry.path(), payloadPath, nullptr });
+            }
+        }
+        proceed_to_next_day(from);
+    }
+    return units;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        option_map options;
+        std::vector<std::string> args = parse_options(argc, argv, options);
+
+        if (args.size() < 3) {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--filter=<expression>] [--output=count|sample|ndjson] [--limit=<n>] [--payload[=base64]] [--threads=<n>]"
+                      << " <base-directory> <from-date> [<to-date>]" << std::endl;
+            return STATUS_ARGUMENTS_MISSING;
+        }
+
+        query q;
+        q.filter = header_filter(get_option(options, "filter"));
+        q.withPayload = has_option(options, "payload");
+        const std::string payloadEncoding = get_option(options, "payload");
+        if (payloadEncoding == "base64") {
+            q.payloadBase64 = true;
+        } else if (!payloadEncoding.empty()) {
+            throw std::invalid_argument("Unknown payload encoding \"" + payloadEncoding + "\". Use --payload or --payload=base64");
+        }
+
+        std::string output = get_option(options, "output", "count");
+        if (output == "count") {
+            q.mode = output_mode::COUNT;
+        } else if (output == "sample") {
+            q.mode = output_mode::SAMPLE;
+            q.limit = get_numeric_option(options, "limit", DEFAULT_SAMPLE_LIMIT);
+        } else if (output == "ndjson") {
+            q.mode = output_mode::NDJSON;
+            q.limit = get_numeric_option(options, "limit", 0);
+        } else {
+            throw std::invalid_argument("Unknown output \"" + output + "\". Use count, sample or ndjson");
+        }
+
+        std::tm from = string_to_tm(args[2], DATE_FORMAT);
+        std::tm to = args.size() > 3 ? string_to_tm(args[3], DATE_FORMAT) : from;
+        std::vector<query_unit> units = find_units(args[1], from, to);
+
+        auto startTime = std::chrono::steady_clock::now();
+
+        // Workers pick file pairs off a shared index until all are scanned
+        unsigned long numberOfThreads = get_numeric_option(options, "threads", std::max(1U, std::thread::hardware_concurrency()));
+        numberOfThreads = std::max(1UL, std::min<unsigned long>(numberOfThreads, units.size()));
+
+        std::atomic<std::size_t> nextUnit = 0;
+        std::vector<std::thread> workers;
+        for (unsigned long t = 0; t < numberOfThreads; ++t) {
+            workers.emplace_back([&units, &nextUnit, &q]() {
+                std::size_t idx;
+                while ((idx = nextUnit++) < units.size()) {
+                    // A pair that can not be scanned is reported, rather than thrown out of thread (terminating us)
+                    try {
+                        scan_unit(units[idx], q);
+                    } catch (const std::exception& e) {
+                        std::cerr << "Could not scan " << units[idx].headerPath.string() << ": " << e.what() << std::endl;
+                        ++q.failedUnits;
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        double megabytes = static_cast<double>(q.bytesScanned) / (1024.0 * 1024.0);
+
+        if (q.mode == output_mode::COUNT) {
+            std::cout << q.matchingEntries << std::endl;
+        }
+        std::cerr << q.matchingEntries << " of " << q.totalEntries << " entries matched in "
+                  << units.size() << " header files";
+        if (q.tornEntries > 0) {
+            std::cerr << " (" << q.tornEntries << " incomplete entries ignored)";
+        }
+        if (q.failedUnits > 0) {
+            std::cerr << " (" << q.failedUnits << " header files could not be scanned)";
+        }
+        std::cerr << ". Scanned " << megabytes << " MB in " << seconds << " s using "
+                  << numberOfThreads << " threads" << std::endl;
+
+        return STATUS_ENDED_SUCCESSFULLY;
+    }
+    catch (const std::invalid_argument& ia) {
+        std::cerr << "Invalid argument: " << ia.what() << std::endl;
+        return STATUS_INVALID_ARGUMENT;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Failed to query logs: " << e.what() << std::endl;
+        return STATUS_GENERAL_FAILURE;
+    }
+}
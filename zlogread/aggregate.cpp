@@ -0,0 +1,334 @@
+//
+// Streaming group-by aggregation over header fields
+//
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <boost/log/trivial.hpp>
+
+#include "zlog.h"
+#include "logging.h"
+#include "aggregate.h"
+
+namespace fs = boost::filesystem;
+
+static const std::vector<std::string> AGGREGATE_NAMES = {
+    "count", "sum_input", "sum_output", "min_input", "max_input", "min_output", "max_output"
+};
+
+static std::vector<std::string> split(const std::string& line, char delimiter) {
+    std::vector<std::string> result;
+    std::stringstream ss(line);
+    std::string item;
+
+    while (std::getline(ss, item, delimiter)) {
+        result.push_back(item);
+    }
+    // Trailing empty field (e.g. "a,b,") is significant for keys
+    if (!line.empty() && line.back() == delimiter) {
+        result.emplace_back();
+    }
+    return result;
+}
+
+void aggregate_values::add(std::uint64_t inputSize, std::uint64_t outputSize) {
+    ++count;
+    sumInput += inputSize;
+    sumOutput += outputSize;
+    minInput = std::min(minInput, inputSize);
+    maxInput = std::max(maxInput, inputSize);
+    minOutput = std::min(minOutput, outputSize);
+    maxOutput = std::max(maxOutput, outputSize);
+}
+
+void aggregate_values::merge(const aggregate_values& other) {
+    count += other.count;
+    sumInput += other.sumInput;
+    sumOutput += other.sumOutput;
+    minInput = std::min(minInput, other.minInput);
+    maxInput = std::max(maxInput, other.maxInput);
+    minOutput = std::min(minOutput, other.minOutput);
+    maxOutput = std::max(maxOutput, other.maxOutput);
+}
+
+aggregate_table::aggregate_table(const std::string& groupBy) : groupBySpec(groupBy), slots(64) {
+    for (const std::string& field : split(groupBy, ',')) {
+        std::size_t idx;
+        try {
+            idx = std::stoul(field);
+        } catch (const std::exception&) {
+            throw std::invalid_argument("Group-by expects comma separated field numbers, got: " + groupBy);
+        }
+        if (idx >= NUMBER_HEADER_FIELDS) {
+            throw std::invalid_argument("Group-by refers to non-existing header field " + field);
+        }
+        fields.push_back(idx);
+    }
+    if (fields.empty()) {
+        throw std::invalid_argument("Group-by needs at least one header field");
+    }
+}
+
+aggregate_values& aggregate_table::find_or_insert(std::string_view key) {
+    if ((used + 1) * 10 > slots.size() * 7) { // keep load factor below 0.7
+        grow();
+    }
+
+    const std::size_t mask = slots.size() - 1;
+    std::size_t idx = std::hash<std::string_view>{}(key) & mask;
+    while (slots[idx].occupied) {
+        if (slots[idx].key == key) {
+            return slots[idx].values;
+        }
+        idx = (idx + 1) & mask;
+    }
+    slots[idx].occupied = true;
+    slots[idx].key = key;
+    ++used;
+    return slots[idx].values;
+}
+
+void aggregate_table::grow() {
+    std::vector<slot> old;
+    old.swap(slots);
+    slots.resize(old.empty() ? 64 : old.size() * 2);
+    used = 0;
+
+    for (slot& s : old) {
+        if (s.occupied) {
+            find_or_insert(s.key) = s.values;
+        }
+    }
+}
+
+void aggregate_table::add(const std::vector<std::string>& headerData, std::uint64_t inputSize, std::uint64_t outputSize) {
+    std::string key;
+    for (std::size_t i = 0; i < fields.size(); ++i) {
+        if (i > 0) {
+            key += ',';
+        }
+        if (fields[i] < headerData.size()) {
+            key += headerData[fields[i]];
+        }
+    }
+    find_or_insert(key).add(inputSize, outputSize);
+}
+
+void aggregate_table::merge(const aggregate_table& other) {
+    for (const slot& s : other.slots) {
+        if (s.occupied) {
+            find_or_insert(s.key).merge(s.values);
+        }
+    }
+}
+
+void aggregate_table::save(const fs::path& path, std::streamoff headerOffset) const {
+    fs::path tmpPath = path;
+    tmpPath += ".tmp";
+
+    std::ofstream out(tmpPath.string(), std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!out) {
+        ZLOG(error) << "Could not save aggregates to " << tmpPath << std::endl;
+        return;
+    }
+
+    out << "#" << headerOffset << ";" << groupBySpec << "\n";
+    for (const slot& s : slots) {
+        if (s.occupied) {
+            const aggregate_values& v = s.values;
+            out << s.key << ","
+                << v.count << "," << v.sumInput << "," << v.sumOutput << ","
+                << v.minInput << "," << v.maxInput << "," << v.minOutput << "," << v.maxOutput << "\n";
+        }
+    }
+    out.close();
+
+    // Replace atomically, so that a reader never sees a half written table
+    fs::rename(tmpPath, path);
+}
+
+bool aggregate_table::load(const fs::path& path, std::streamoff& headerOffset) {
+    std::ifstream in(path.string(), std::ios::binary | std::ios::in);
+    if (!in) {
+        return false;
+    }
+
+    std::string line;
+    if (!std::getline(in, line) || !line.starts_with("#")) {
+        ZLOG(error) << "Corrupt aggregates: " << path << std::endl;
+        return false;
+    }
+
+    std::string::size_type sep = line.find(';');
+    std::string spec = sep == std::string::npos ? "" : line.substr(sep + 1);
+    if (groupBySpec.empty()) {
+        *this = aggregate_table(spec);
+    } else if (spec != groupBySpec) {
+        ZLOG(error) << "Aggregates in " << path << " are grouped by " << spec << ", expected " << groupBySpec << std::endl;
+        return false;
+    }
+    headerOffset = static_cast<std::streamoff>(std::stoll(line.substr(1, sep - 1)));
+
+    const std::size_t numberOfValues = AGGREGATE_NAMES.size();
+    while (std::getline(in, line)) {
+        std::vector<std::string> data = split(line, ',');
+        if (data.size() != fields.size() + numberOfValues) {
+            ZLOG(error) << "Corrupt aggregate: " << line << " (" << path << ")" << std::endl;
+            continue;
+        }
+
+        std::string key;
+        for (std::size_t i = 0; i < fields.size(); ++i) {
+            if (i > 0) {
+                key += ',';
+            }
+            key += data[i];
+        }
+
+        aggregate_values v;
+        std::size_t i = fields.size();
+        v.count = std::stoull(data[i++]);
+        v.sumInput = std::stoull(data[i++]);
+        v.sumOutput = std::stoull(data[i++]);
+        v.minInput = std::stoull(data[i++]);
+        v.maxInput = std::stoull(data[i++]);
+        v.minOutput = std::stoull(data[i++]);
+        v.maxOutput = std::stoull(data[i++]);
+        find_or_insert(key).merge(v);
+    }
+    return true;
+}
+
+std::vector<std::string> parse_aggregate_names(const std::string& aggregates) {
+    if (aggregates.empty()) {
+        return AGGREGATE_NAMES;
+    }
+
+    std::vector<std::string> names = split(aggregates, ',');
+    for (const std::string& name : names) {
+        if (std::find(AGGREGATE_NAMES.begin(), AGGREGATE_NAMES.end(), name) == AGGREGATE_NAMES.end()) {
+            throw std::invalid_argument("Unknown aggregate \"" + name + "\". Valid aggregates are count, sum_input, sum_output, min_input, max_input, min_output and max_output");
+        }
+    }
+    return names;
+}
+
+void aggregate_table::write_result(const fs::path& path, const std::vector<std::string>& aggregates) const {
+    std::vector<std::size_t> columns;
+    for (const std::string& name : aggregates) {
+        auto it = std::find(AGGREGATE_NAMES.begin(), AGGREGATE_NAMES.end(), name);
+        columns.push_back(it - AGGREGATE_NAMES.begin());
+    }
+
+    fs::path tmpPath = path;
+    tmpPath += ".tmp";
+
+    std::ofstream out(tmpPath.string(), std::ios::binary | std::ios::out | std::ios::trunc);
+    for (std::size_t i = 0; i < fields.size(); ++i) {
+        out << "field" << fields[i] << ",";
+    }
+    for (std::size_t i = 0; i < columns.size(); ++i) {
+        out << AGGREGATE_NAMES[columns[i]] << (i + 1 < columns.size() ? "," : "\n");
+    }
+
+    for (const slot& s : slots) {
+        if (!s.occupied) {
+            continue;
+        }
+        const aggregate_values& v = s.values;
+        const std::uint64_t values[] = {
+            v.count, v.sumInput, v.sumOutput, v.minInput, v.maxInput, v.minOutput, v.maxOutput
+        };
+        out << s.key << ",";
+        for (std::size_t i = 0; i < columns.size(); ++i) {
+            out << values[columns[i]] << (i + 1 < columns.size() ? "," : "\n");
+        }
+    }
+    out.close();
+    fs::rename(tmpPath, path);
+}
+
+bool merge_aggregates(const fs::path& dayDir, const std::string& aggregates) {
+    std::vector<fs::path> files;
+    if (fs::is_directory(dayDir)) {
+        for (const auto& entry : fs::directory_iterator(dayDir)) {
+            if (entry.path().extension() == ".agg") {
+                files.push_back(entry.path());
+            }
+        }
+    }
+    if (files.empty()) {
+        return false;
+    }
+
+    // Load shards in parallel, each thread folding its share of files into its own table...
+    std::size_t numberOfThreads = std::min<std::size_t>(files.size(), std::max(1U, std::thread::hardware_concurrency()));
+    std::vector<aggregate_table> partials(numberOfThreads);
+    {
+        std::vector<std::thread> workers;
+        for (std::size_t t = 0; t < numberOfThreads; ++t) {
+            workers.emplace_back([&files, &partials, numberOfThreads, t]() {
+                for (std::size_t i = t; i < files.size(); i += numberOfThreads) {
+                    aggregate_table shard;
+                    std::streamoff offset;
+                    try {
+                        if (!shard.load(files[i], offset)) {
+                            continue;
+                        }
+                    } catch (const std::exception& e) {
+                        // Not to be thrown out of thread, which would terminate us
+                        ZLOG(error) << "Ignoring " << files[i] << ", since it is corrupt: " << e.what() << std::endl;
+                        continue;
+                    }
+                    if (partials[t].group_by().empty()) {
+                        partials[t] = std::move(shard);
+                    } else if (partials[t].group_by() == shard.group_by()) {
+                        partials[t].merge(shard);
+                    } else {
+                        ZLOG(error) << "Ignoring " << files[i] << ", since it is grouped by " << shard.group_by() << std::endl;
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // ...and then reduce the partial tables pairwise, also in parallel
+    while (partials.size() > 1) {
+        std::size_t half = (partials.size() + 1) / 2;
+        std::vector<std::thread> workers;
+        for (std::size_t i = 0; i + half < partials.size(); ++i) {
+            workers.emplace_back([&partials, i, half]() {
+                if (partials[i].group_by().empty()) {
+                    partials[i] = std::move(partials[i + half]);
+                } else if (!partials[i + half].group_by().empty()) {
+                    partials[i].merge(partials[i + half]);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        partials.resize(half);
+    }
+
+    if (partials.front().group_by().empty()) {
+        return false;
+    }
+
+    std::vector<std::string> columns = parse_aggregate_names(aggregates);
+    fs::path resultPath = dayDir;
+    resultPath /= AGGREGATE_RESULT_FILE;
+    partials.front().write_result(resultPath, columns);
+
+    ZLOG(info) << "Merged aggregates from " << files.size() << " processors ("
+                            << partials.front().size() << " keys) into " << resultPath << std::endl;
+    return true;
+}
@@ -0,0 +1,77 @@
+//
+// Streaming group-by aggregation over header fields. Each processor keeps its
+// own table (one slot per distinct key) that is checkpointed next to its state
+// file, and the monitor merges all tables of a day into one result file.
+//
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+struct aggregate_values {
+    std::uint64_t count = 0;
+    std::uint64_t sumInput = 0;
+    std::uint64_t sumOutput = 0;
+    std::uint64_t minInput = std::numeric_limits<std::uint64_t>::max();
+    std::uint64_t maxInput = 0;
+    std::uint64_t minOutput = std::numeric_limits<std::uint64_t>::max();
+    std::uint64_t maxOutput = 0;
+
+    void add(std::uint64_t inputSize, std::uint64_t outputSize);
+    void merge(const aggregate_values& other);
+};
+
+// Open addressing (linear probing) hash table keyed by the group-by fields
+class aggregate_table {
+public:
+    aggregate_table() = default;
+
+    // 'groupBy' is a comma separated list of header field numbers, e.g. "0,1".
+    // Throws std::invalid_argument if malformed.
+    explicit aggregate_table(const std::string& groupBy);
+
+    void add(const std::vector<std::string>& headerData, std::uint64_t inputSize, std::uint64_t outputSize);
+    void merge(const aggregate_table& other);
+
+    std::size_t size() const { return used; }
+    const std::string& group_by() const { return groupBySpec; }
+
+    // Per-processor checkpoint, tagged with the header offset it is consistent with
+    void save(const boost::filesystem::path& path, std::streamoff headerOffset) const;
+    bool load(const boost::filesystem::path& path, std::streamoff& headerOffset);
+
+    // Final result, with only the requested aggregates as columns
+    void write_result(const boost::filesystem::path& path, const std::vector<std::string>& aggregates) const;
+
+private:
+    struct slot {
+        std::string key;
+        aggregate_values values;
+        bool occupied = false;
+    };
+
+    aggregate_values& find_or_insert(std::string_view key);
+    void grow();
+
+    std::string groupBySpec;
+    std::vector<std::size_t> fields;
+    std::vector<slot> slots;
+    std::size_t used = 0;
+};
+
+// Validates a comma separated list of aggregate names (empty means all).
+// Throws std::invalid_argument on unknown names.
+std::vector<std::string> parse_aggregate_names(const std::string& aggregates);
+
+// Merges all processor-N.agg files in a day directory (in parallel) into
+// one result file. Returns false if there was nothing to merge.
+bool merge_aggregates(const boost::filesystem::path& dayDir, const std::string& aggregates);
+
+#endif // AGGREGATE_H
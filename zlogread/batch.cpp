@@ -0,0 +1,626 @@
+//
+// Batches of entries, as shipped to object store
+//
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "zlog.h"
+#include "options.h"
+#include "batch.h"
+
+namespace fs = boost::filesystem;
+
+#define BATCH_VERSION         2 // version 1 has no references
+#define ENCODING_BITPACKED    1 // frame of reference: minimum, bit width, packed differences
+#define ENCODING_DICTIONARY   2 // dictionary, followed by codes (as runs, or bit-packed if smaller)
+
+#define CODES_AS_RUNS         0
+#define CODES_BITPACKED       1
+
+
+batch_format parse_batch_format(const std::string& name) {
+    if (name.empty() || name == "columnar") {
+        return batch_format::COLUMNAR;
+    }
+    if (name == "rows") {
+        return batch_format::ROWS;
+    }
+    throw std::invalid_argument("Unknown batch format: " + name + " (expected rows or columnar)");
+}
+
+std::string batch_format_name(batch_format format) {
+    return format == batch_format::ROWS ? "rows" : "columnar";
+}
+
+static void put_u8(std::string& out, std::uint8_t value) {
+    out += static_cast<char>(value);
+}
+
+static void put_le(std::string& out, std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+static void put_varint(std::string& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+// Reads from an encoded section, checking bounds
+class decoder {
+public:
+    explicit decoder(std::string_view data) : data(data) {}
+
+    std::uint64_t le(int bytes) {
+        need(bytes);
+        std::uint64_t value = 0;
+        for (int i = 0; i < bytes; ++i) {
+            value |= static_cast<std::uint64_t>(static_cast<unsigned char>(data[pos++])) << (8 * i);
+        }
+        return value;
+    }
+
+    std::uint64_t varint() {
+        std::uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            need(1);
+            auto byte = static_cast<unsigned char>(data[pos++]);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Corrupt batch: varint too long");
+    }
+
+    std::string_view bytes(std::size_t length) {
+        need(length);
+        std::string_view view = data.substr(pos, length);
+        pos += length;
+        return view;
+    }
+
+private:
+    void need(std::size_t length) const {
+        if (pos + length > data.size()) {
+            throw std::runtime_error("Corrupt batch: section too short");
+        }
+    }
+
+    std::string_view data;
+    std::size_t pos = 0;
+};
+
+static void bitpack(std::string& out, const std::vector<std::uint64_t>& values) {
+    std::uint64_t min = values.empty() ? 0 : values.front();
+    std::uint64_t max = min;
+    for (std::uint64_t value : values) {
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+    int width = 0;
+    while (width < 64 && ((max - min) >> width) != 0) {
+        ++width;
+    }
+    put_le(out, min, 8);
+    put_u8(out, static_cast<std::uint8_t>(width));
+
+    const std::size_t start = out.size();
+    out.resize(start + (values.size() * width + 7) / 8, '\0');
+    std::size_t bit = 0;
+    for (std::uint64_t value : values) {
+        const std::uint64_t delta = value - min;
+        for (int b = 0; b < width; ++b, ++bit) {
+            if ((delta >> b) & 1) {
+                out[start + bit / 8] = static_cast<char>(out[start + bit / 8] | (1 << (bit % 8)));
+            }
+        }
+    }
+}
+
+static std::vector<std::uint64_t> bitunpack(decoder& in, std::size_t count) {
+    const std::uint64_t min = in.le(8);
+    const int width = static_cast<int>(in.le(1));
+    if (width > 64) {
+        throw std::runtime_error("Corrupt batch: bit width " + std::to_string(width));
+    }
+    std::string_view packed = in.bytes((count * width + 7) / 8);
+
+    std::vector<std::uint64_t> values;
+    values.reserve(count);
+    std::size_t bit = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        std::uint64_t delta = 0;
+        for (int b = 0; b < width; ++b, ++bit) {
+            if (static_cast<unsigned char>(packed[bit / 8]) & (1u << (bit % 8))) {
+                delta |= 1ULL << b;
+            }
+        }
+        values.push_back(min + delta);
+    }
+    return values;
+}
+
+// Only numbers that print back the same are stored as numbers
+static bool is_plain_number(const std::string& value) {
+    if (value.empty() || value.size() > 19 || (value.size() > 1 && value[0] == '0')) {
+        return false;
+    }
+    for (char c : value) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void write_all(int fd, const char* data, std::size_t length, const fs::path& path) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Could not write " + path.string() + ": " + strerror(errno));
+        }
+        data += written;
+        length -= static_cast<std::size_t>(written);
+    }
+}
+
+batch_builder::batch_builder(const fs::path& spillPath, std::uint64_t spillThreshold)
+    : spillPath(spillPath), spillThreshold(spillThreshold) {
+}
+
+batch_builder::~batch_builder() {
+    clear();
+}
+
+void batch_builder::add_field(std::size_t index, const std::string& value) {
+    column& c = columns[index];
+    if (c.numeric) {
+        if (is_plain_number(value)) {
+            c.numbers.push_back(std::stoull(value));
+        } else {
+            c.numeric = false;
+            c.numbers.clear();
+        }
+    }
+    auto [it, inserted] = c.dictionary.try_emplace(value, static_cast<std::uint32_t>(c.words.size()));
+    if (inserted) {
+        c.words.push_back(value);
+    }
+    c.codes.push_back(it->second);
+}
+
+void batch_builder::append_blob(const char* data, std::size_t length) {
+    if (spillFd < 0 && blob.size() + length > spillThreshold) {
+        // Too much to keep in memory, so payloads go to file from now on
+        spillFd = ::open(spillPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (spillFd < 0) {
+            throw std::runtime_error("Could not create " + spillPath.string() + ": " + strerror(errno));
+        }
+        write_all(spillFd, blob.data(), blob.size(), spillPath);
+        blob = std::string();
+    }
+    if (spillFd < 0) {
+        blob.append(data, length);
+    } else {
+        write_all(spillFd, data, length, spillPath);
+    }
+}
+
+void batch_builder::add(const std::vector<std::string>& headerData, std::string_view input, std::string_view output) {
+    begin_entry(headerData);
+    add_payload(input.data(), input.size());
+    add_payload(output.data(), output.size());
+}
+
+void batch_builder::begin_entry(const std::vector<std::string>& headerData) {
+    if (columns.empty()) {
+        columns.resize(headerData.size());
+    } else if (headerData.size() != columns.size()) {
+        throw std::invalid_argument("Entry has " + std::to_string(headerData.size()) + " header fields, batch has "
+                                    + std::to_string(columns.size()));
+    }
+    for (std::size_t i = 0; i < headerData.size(); ++i) {
+        add_field(i, headerData[i]);
+        rowBytes += headerData[i].size() + 1; // followed by comma or newline
+    }
+    payloadOffsets.push_back(payloadOffsets.back());
+    entryPosition = 0;
+}
+
+void batch_builder::add_payload(const char* data, std::size_t length) {
+    append_blob(data, length);
+    payloadOffsets.back() += length;
+    entryPosition += length;
+}
+
+void batch_builder::add_reference(const std::string& batchName, std::uint64_t offset, std::uint64_t length) {
+    auto [it, inserted] = batchIndex.try_emplace(batchName, static_cast<std::uint32_t>(batchNames.size()));
+    if (inserted) {
+        batchNames.push_back(batchName);
+    }
+    referenceList.push_back({ entries() - 1, entryPosition, it->second, offset, length });
+    entryPosition += length;
+    referencedBytes += length;
+}
+
+std::uint64_t batch_builder::write(const fs::path& path, batch_format format) {
+    const std::size_t n = entries();
+    std::string prefix;
+    std::uint64_t referenceBytes = 0;
+
+    if (format == batch_format::ROWS) {
+        if (!referenceList.empty()) {
+            throw std::logic_error("References need a columnar batch");
+        }
+        std::string lines;
+        for (std::size_t entry = 0; entry < n; ++entry) {
+            for (std::size_t i = 0; i < columns.size(); ++i) {
+                const column& c = columns[i];
+                if (i > 0) {
+                    lines += ',';
+                }
+                lines += c.numeric ? std::to_string(c.numbers[entry]) : c.words[c.codes[entry]];
+            }
+            lines += '\n';
+        }
+        prefix = "ZLRB";
+        put_u8(prefix, BATCH_VERSION);
+        put_le(prefix, n, 4);
+        put_le(prefix, lines.size(), 8);
+        prefix += lines;
+    } else {
+        // Encode columns first, since the directory holds their offsets
+        std::vector<std::pair<std::uint8_t, std::string>> encoded;
+        for (const column& c : columns) {
+            std::string data;
+            if (c.numeric) {
+                bitpack(data, c.numbers);
+                encoded.emplace_back(ENCODING_BITPACKED, std::move(data));
+                continue;
+            }
+            put_varint(data, c.words.size());
+            for (const std::string& word : c.words) {
+                put_varint(data, word.size());
+                data += word;
+            }
+            std::vector<std::pair<std::uint32_t, std::uint64_t>> runs;
+            for (std::uint32_t code : c.codes) {
+                if (!runs.empty() && runs.back().first == code) {
+                    ++runs.back().second;
+                } else {
+                    runs.emplace_back(code, 1);
+                }
+            }
+            std::string asRuns;
+            put_varint(asRuns, runs.size());
+            for (const auto& [code, length] : runs) {
+                put_varint(asRuns, code);
+                put_varint(asRuns, length);
+            }
+            // Values that alternate rather than repeat make for short runs
+            std::string packed;
+            bitpack(packed, std::vector<std::uint64_t>(c.codes.begin(), c.codes.end()));
+            if (packed.size() < asRuns.size()) {
+                put_u8(data, CODES_BITPACKED);
+                data += packed;
+            } else {
+                put_u8(data, CODES_AS_RUNS);
+                data += asRuns;
+            }
+            encoded.emplace_back(ENCODING_DICTIONARY, std::move(data));
+        }
+        std::string offsets;
+        bitpack(offsets, payloadOffsets);
+
+        std::string references;
+        put_varint(references, batchNames.size());
+        for (const std::string& name : batchNames) {
+            put_varint(references, name.size());
+            references += name;
+        }
+        put_varint(references, referenceList.size());
+        std::uint64_t previousEntry = 0;
+        for (const reference& r : referenceList) {
+            put_varint(references, r.entry - previousEntry);
+            put_varint(references, r.position);
+            put_varint(references, r.batch);
+            put_varint(references, r.offset);
+            put_varint(references, r.length);
+            previousEntry = r.entry;
+        }
+
+        const std::uint64_t directorySize = 4 + 1 + 4 + 2 + 17 * (columns.size() + 2) + 16;
+        std::uint64_t at = directorySize;
+
+        prefix = "ZLCB";
+        put_u8(prefix, BATCH_VERSION);
+        put_le(prefix, n, 4);
+        put_le(prefix, columns.size(), 2);
+        for (const auto& [encoding, data] : encoded) {
+            put_u8(prefix, encoding);
+            put_le(prefix, at, 8);
+            put_le(prefix, data.size(), 8);
+            at += data.size();
+        }
+        put_u8(prefix, ENCODING_BITPACKED);
+        put_le(prefix, at, 8);
+        put_le(prefix, offsets.size(), 8);
+        at += offsets.size();
+        put_u8(prefix, 0);
+        put_le(prefix, at, 8);
+        put_le(prefix, references.size(), 8);
+        at += references.size();
+        put_le(prefix, at, 8);
+        put_le(prefix, payload_bytes(), 8);
+
+        for (const auto& [encoding, data] : encoded) {
+            prefix += data;
+        }
+        prefix += offsets;
+        prefix += references;
+        referenceBytes = references.size();
+    }
+
+    const fs::path temporary = path.string() + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create " + temporary.string() + ": " + strerror(errno));
+    }
+    try {
+        write_all(fd, prefix.data(), prefix.size(), temporary);
+        if (spillFd < 0) {
+            write_all(fd, blob.data(), blob.size(), temporary);
+        } else {
+            std::vector<char> buffer(IO_STREAM_CHUNK_SIZE);
+            for (off_t offset = 0; offset < static_cast<off_t>(payload_bytes()); ) {
+                ssize_t got = ::pread(spillFd, buffer.data(), buffer.size(), offset);
+                if (got <= 0) {
+                    if (got < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("Could not read " + spillPath.string());
+                }
+                write_all(fd, buffer.data(), static_cast<std::size_t>(got), temporary);
+                offset += got;
+            }
+        }
+    } catch (...) {
+        ::close(fd);
+        ::unlink(temporary.c_str());
+        throw;
+    }
+    ::close(fd);
+    fs::rename(temporary, path);
+
+    const std::uint64_t headerFieldBytes = prefix.size() - referenceBytes;
+    clear();
+    return headerFieldBytes;
+}
+
+void batch_builder::clear() {
+    columns.clear();
+    payloadOffsets = { 0 };
+    rowBytes = 0;
+    entryPosition = 0;
+    referenceList.clear();
+    batchNames.clear();
+    batchIndex.clear();
+    referencedBytes = 0;
+    blob.clear();
+    if (spillFd >= 0) {
+        ::close(spillFd);
+        ::unlink(spillPath.c_str());
+        spillFd = -1;
+    }
+}
+
+batch_reader::batch_reader(const fs::path& path) : path(path) {
+    std::ifstream in(path.string(), std::ios::binary);
+    char fixed[11];
+    if (!in.read(fixed, sizeof(fixed)) || std::string_view(fixed, 4) != "ZLCB") {
+        throw std::runtime_error("Not a columnar batch: " + path.string());
+    }
+    decoder head(std::string_view(fixed + 4, 7));
+    const auto version = head.le(1);
+    if (version < 1 || version > BATCH_VERSION) {
+        throw std::runtime_error("Unknown batch version: " + path.string());
+    }
+    entryCount = head.le(4);
+    const std::size_t columnCount = head.le(2);
+    const std::size_t sections = version == 1 ? 1 : 2;
+
+    std::string rest(17 * (columnCount + sections) + 16, '\0');
+    if (!in.read(rest.data(), static_cast<std::streamsize>(rest.size()))) {
+        throw std::runtime_error("Corrupt batch: " + path.string());
+    }
+    decoder dir(rest);
+    for (std::size_t i = 0; i < columnCount; ++i) {
+        section s;
+        s.encoding = static_cast<std::uint8_t>(dir.le(1));
+        s.offset = dir.le(8);
+        s.length = dir.le(8);
+        directory.push_back(s);
+    }
+    section offsets;
+    offsets.encoding = static_cast<std::uint8_t>(dir.le(1));
+    offsets.offset = dir.le(8);
+    offsets.length = dir.le(8);
+    section references = { 0, 0, 0 };
+    if (version > 1) {
+        references.encoding = static_cast<std::uint8_t>(dir.le(1));
+        references.offset = dir.le(8);
+        references.length = dir.le(8);
+    }
+    blob.encoding = 0;
+    blob.offset = dir.le(8);
+    blob.length = dir.le(8);
+
+    std::string data = read_section(offsets);
+    decoder table(data);
+    payloadOffsets = bitunpack(table, entryCount + 1);
+
+    if (references.length > 0) {
+        data = read_section(references);
+        decoder in(data);
+        std::vector<std::string> names(in.varint());
+        for (std::string& name : names) {
+            name = in.bytes(in.varint());
+            if (name.empty() || name.find('/') != std::string::npos) {
+                throw std::runtime_error("Corrupt batch: bad reference to \"" + name + "\" in " + path.string());
+            }
+        }
+        std::uint64_t entry = 0;
+        for (std::uint64_t count = in.varint(); count > 0; --count) {
+            reference r;
+            entry += in.varint();
+            r.entry = entry;
+            r.position = in.varint();
+            const std::uint64_t batch = in.varint();
+            r.offset = in.varint();
+            r.length = in.varint();
+            if (entry >= entryCount || batch >= names.size()) {
+                throw std::runtime_error("Corrupt batch: bad reference in " + path.string());
+            }
+            r.batch = names[batch];
+            referenceList.push_back(std::move(r));
+        }
+    }
+}
+
+std::string batch_reader::read_section(const section& s) const {
+    std::ifstream in(path.string(), std::ios::binary);
+    std::string data(s.length, '\0');
+    in.seekg(static_cast<std::streamoff>(s.offset));
+    if (!in.read(data.data(), static_cast<std::streamsize>(s.length))) {
+        throw std::runtime_error("Corrupt batch: section beyond end of " + path.string());
+    }
+    return data;
+}
+
+std::string batch_reader::encoding(std::size_t column) const {
+    return directory.at(column).encoding == ENCODING_BITPACKED ? "bitpacked" : "dictionary";
+}
+
+std::uint64_t batch_reader::encoded_size(std::size_t column) const {
+    return directory.at(column).length;
+}
+
+std::vector<std::string> batch_reader::column(std::size_t column) const {
+    const section& s = directory.at(column);
+    std::string data = read_section(s);
+    decoder in(data);
+
+    std::vector<std::string> values;
+    values.reserve(entryCount);
+    if (s.encoding == ENCODING_BITPACKED) {
+        for (std::uint64_t value : bitunpack(in, entryCount)) {
+            values.push_back(std::to_string(value));
+        }
+        return values;
+    }
+
+    std::vector<std::string> words(in.varint());
+    for (std::string& word : words) {
+        word = in.bytes(in.varint());
+    }
+    if (in.le(1) == CODES_BITPACKED) {
+        for (std::uint64_t code : bitunpack(in, entryCount)) {
+            if (code >= words.size()) {
+                throw std::runtime_error("Corrupt batch: bad code in column " + std::to_string(column));
+            }
+            values.push_back(words[code]);
+        }
+        return values;
+    }
+    for (std::uint64_t runs = in.varint(); runs > 0; --runs) {
+        const std::uint64_t code = in.varint();
+        const std::uint64_t length = in.varint();
+        if (code >= words.size() || values.size() + length > entryCount) {
+            throw std::runtime_error("Corrupt batch: bad run in column " + std::to_string(column));
+        }
+        values.insert(values.end(), length, words[code]);
+    }
+    return values;
+}
+
+std::string batch_reader::blob_bytes(std::uint64_t offset, std::uint64_t length) const {
+    if (offset + length > blob.length) {
+        throw std::runtime_error("Corrupt batch: reference beyond blob of " + path.string());
+    }
+    section s = { 0, blob.offset + offset, length };
+    return read_section(s);
+}
+
+std::uint64_t batch_reader::referenced_bytes() const {
+    std::uint64_t bytes = 0;
+    for (const reference& r : referenceList) {
+        bytes += r.length;
+    }
+    return bytes;
+}
+
+std::string batch_reader::payload(std::size_t entry) const {
+    const std::uint64_t begin = payloadOffsets.at(entry);
+    const std::string stored = blob_bytes(begin, payloadOffsets.at(entry + 1) - begin);
+
+    auto first = std::lower_bound(referenceList.begin(), referenceList.end(), entry,
+                                  [](const reference& r, std::size_t e) { return r.entry < e; });
+    if (first == referenceList.end() || first->entry != entry) {
+        return stored;
+    }
+
+    std::string payload;
+    std::size_t used = 0; // of stored
+    for (auto r = first; r != referenceList.end() && r->entry == entry; ++r) {
+        if (r->position < payload.size() || r->position - payload.size() > stored.size() - used) {
+            throw std::runtime_error("Corrupt batch: bad reference in " + path.string());
+        }
+        const std::size_t before = r->position - payload.size();
+        payload.append(stored, used, before);
+        used += before;
+        if (r->batch == path.filename().string()) {
+            payload += blob_bytes(r->offset, r->length);
+        } else {
+            payload += batch_reader(path.parent_path() / r->batch).blob_bytes(r->offset, r->length);
+        }
+    }
+    payload.append(stored, used, std::string::npos);
+    return payload;
+}
+
+// zlogread --dump-batch [--column=N | --entry=N] <file>
+int dump_batch(const std::string& path, const option_map& options) {
+    batch_reader reader(path);
+    if (has_option(options, "entry")) {
+        std::cout << reader.payload(get_numeric_option(options, "entry", 0));
+        return STATUS_ENDED_SUCCESSFULLY;
+    }
+    if (has_option(options, "column")) {
+        for (const std::string& value : reader.column(get_numeric_option(options, "column", 0))) {
+            std::cout << value << std::endl;
+        }
+        return STATUS_ENDED_SUCCESSFULLY;
+    }
+
+    std::cout << path << ": " << reader.entries() << " entries, " << reader.columns() << " columns, "
+              << reader.references() << " payload references (" << reader.referenced_bytes() << " bytes)" << std::endl;
+    for (std::size_t i = 0; i < reader.columns(); ++i) {
+        std::cout << "  column " << i << ": " << reader.encoding(i) << ", " << reader.encoded_size(i) << " bytes" << std::endl;
+    }
+    return STATUS_ENDED_SUCCESSFULLY;
+}
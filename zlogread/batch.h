@@ -0,0 +1,166 @@
+//
+// Batches of entries, as shipped to object store by write_to_object_store().
+//
+//   rows      header lines (as in .header files), followed by payloads
+//   columnar  header fields stored column by column -- numeric columns bit-packed (frame of
+//             reference), other columns dictionary and run-length encoded -- followed by an
+//             offset table and payloads in a blob region. A directory up front locates each
+//             column, so that single columns may be read without decoding the rest. Payloads
+//             seen before may be stored as references to the blob of this or an earlier batch
+//
+// All integers are little endian. Columnar layout:
+//
+//   "ZLCB" version:u8 entries:u32 columns:u16
+//   columns x { encoding:u8 offset:u64 length:u64 }   column data, at offsets in file
+//   offsets:    { encoding:u8 offset:u64 length:u64 }   entries + 1 payload offsets, bit-packed
+//   references: { encoding:u8 offset:u64 length:u64 }   (from version 2)
+//   blob:       { offset:u64 length:u64 }               payloads (input followed by output)
+//
+// Payload offsets cover bytes in the blob. References (varints) are a table of batch file names
+// -- count, then length and name of each -- followed by count and, for each reference ordered
+// by entry: entry (difference to previous), position in payload of entry, batch (index in
+// table), offset and length in blob of that batch. A payload is made up of its bytes in the
+// blob, with referenced bytes inserted at their positions.
+//
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "zlog.h"
+
+enum class batch_format { ROWS, COLUMNAR };
+
+// Throws std::invalid_argument on unknown format names
+batch_format parse_batch_format(const std::string& name);
+std::string batch_format_name(batch_format format);
+
+class batch_builder {
+public:
+    // Payloads beyond 'spillThreshold' bytes are kept in 'spillPath' rather than in memory
+    batch_builder(const boost::filesystem::path& spillPath, std::uint64_t spillThreshold = IO_STREAM_THRESHOLD);
+    ~batch_builder();
+
+    batch_builder(const batch_builder&) = delete;
+    batch_builder& operator=(const batch_builder&) = delete;
+
+    void add(const std::vector<std::string>& headerData, std::string_view input, std::string_view output);
+
+    // Same, for entries whose payloads are handed over in chunks (input before output)
+    void begin_entry(const std::vector<std::string>& headerData);
+    void add_payload(const char* data, std::size_t length);
+
+    // Continues payload of current entry with 'length' bytes at 'offset' in blob of 'batchName'
+    // (a batch in the same directory, or this one). Only for columnar batches
+    void add_reference(const std::string& batchName, std::uint64_t offset, std::uint64_t length);
+
+    std::size_t entries() const { return payloadOffsets.size() - 1; }
+
+    // Payload bytes in blob, and referenced
+    std::uint64_t payload_bytes() const { return payloadOffsets.back(); }
+    std::uint64_t referenced_bytes() const { return referencedBytes; }
+    std::size_t references() const { return referenceList.size(); }
+
+    // Size of header fields, written as rows
+    std::uint64_t header_bytes() const { return rowBytes; }
+
+    // Writes batch to 'path' (through a temporary file, renamed into place) and clears it.
+    // Returns size of header fields as encoded (not counting references). Throws std::runtime_error on I/O errors
+    std::uint64_t write(const boost::filesystem::path& path, batch_format format);
+
+    void clear();
+
+private:
+    struct column {
+        bool numeric = true;
+        std::vector<std::uint64_t> numbers; // while numeric
+        std::unordered_map<std::string, std::uint32_t> dictionary;
+        std::vector<std::string> words;     // by code
+        std::vector<std::uint32_t> codes;   // per entry
+    };
+
+    void add_field(std::size_t index, const std::string& value);
+    void append_blob(const char* data, std::size_t length);
+
+    struct reference {
+        std::uint64_t entry;
+        std::uint64_t position;
+        std::uint32_t batch;
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
+
+    std::vector<column> columns;
+    std::vector<std::uint64_t> payloadOffsets = { 0 };
+    std::uint64_t rowBytes = 0;
+
+    std::uint64_t entryPosition = 0; // in payload of current entry
+    std::vector<reference> referenceList;
+    std::vector<std::string> batchNames;
+    std::unordered_map<std::string, std::uint32_t> batchIndex;
+    std::uint64_t referencedBytes = 0;
+
+    std::string blob;  // payloads, unless spilled
+    boost::filesystem::path spillPath;
+    std::uint64_t spillThreshold;
+    int spillFd = -1;
+};
+
+// Reads batches written in columnar format
+class batch_reader {
+public:
+    // Reads everything but payloads. Throws std::runtime_error if not a columnar batch
+    explicit batch_reader(const boost::filesystem::path& path);
+
+    std::size_t entries() const { return entryCount; }
+    std::size_t columns() const { return directory.size(); }
+
+    // Encoding ("dictionary" or "bitpacked") and encoded size of column
+    std::string encoding(std::size_t column) const;
+    std::uint64_t encoded_size(std::size_t column) const;
+
+    // Decodes a single column
+    std::vector<std::string> column(std::size_t column) const;
+
+    // Input followed by output of entry, with references resolved
+    std::string payload(std::size_t entry) const;
+
+    // Payload bytes of entries referenced from other batches (or from this one)
+    std::size_t references() const { return referenceList.size(); }
+    std::uint64_t referenced_bytes() const;
+
+    // Bytes at 'offset' in blob
+    std::string blob_bytes(std::uint64_t offset, std::uint64_t length) const;
+
+private:
+    struct section {
+        std::uint8_t encoding;
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
+    std::string read_section(const section& s) const;
+
+    struct reference {
+        std::uint64_t entry;
+        std::uint64_t position;
+        std::string batch;
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
+
+    boost::filesystem::path path;
+    std::size_t entryCount = 0;
+    std::vector<section> directory;
+    std::vector<std::uint64_t> payloadOffsets;
+    std::vector<reference> referenceList; // ordered by entry
+    section blob;
+};
+
+#endif // BATCH_H
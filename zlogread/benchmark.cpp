@@ -0,0 +1,125 @@
+//
+// Startup benchmark: discovery of pairs in a synthetic day directory with many pairs, and
+// time until the first processor could be launched
+//
+//   zlogread --bench-discovery [--pairs=100000] <directory>
+//
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+
+#include "zlog.h"
+#include "options.h"
+#include "discovery.h"
+#include "scheduler.h"
+
+namespace fs = boost::filesystem;
+
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void create_pairs(const fs::path& dirPath, unsigned long from, unsigned long to) {
+    for (unsigned long i = from; i < to; ++i) {
+        const std::string stem = "file" + std::to_string(i);
+        for (const char* extension : { ".header", ".payload" }) {
+            int fd = ::open((dirPath / (stem + extension)).c_str(), O_WRONLY | O_CREAT, 0644);
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+}
+
+// As directories used to be scanned: a stat per entry, and ordered maps of stems
+static std::size_t stat_and_map_scan(const fs::path& dirPath) {
+    std::map<std::string, fs::path> stems;
+    std::map<std::string, std::string> headerFiles;
+    std::map<std::string, std::string> payloadFiles;
+
+    for (const auto& entry : fs::directory_iterator(dirPath)) {
+        if (fs::is_regular_file(entry)) {
+            fs::path filePath = entry.path();
+            std::string stem = filePath.stem().string();
+            stems[stem] = filePath;
+            if (filePath.extension() == ".header") {
+                headerFiles[stem] = filePath.filename().string();
+            } else if (filePath.extension() == ".payload") {
+                payloadFiles[stem] = filePath.filename().string();
+            }
+        }
+    }
+    std::size_t pairs = 0;
+    for (const auto& stem : stems) {
+        pairs += headerFiles.count(stem.first) > 0 && payloadFiles.count(stem.first) > 0;
+    }
+    return pairs;
+}
+
+int benchmark_discovery(const std::string& directory, const option_map& options) {
+    const unsigned long pairs = get_numeric_option(options, "pairs", 100000);
+    const unsigned long added = std::max(1UL, pairs / 100);
+    const fs::path dirPath = directory;
+
+    fs::create_directories(dirPath);
+    std::cout << "Creating " << pairs << " pairs in " << dirPath << std::endl;
+    auto since = std::chrono::steady_clock::now();
+    create_pairs(dirPath, 0, pairs);
+    std::cout << "  created in " << elapsed_ms(since) << " ms" << std::endl;
+
+    // As if files were written a while ago, so that an unchanged directory may be skipped
+    struct timespec past[2];
+    clock_gettime(CLOCK_REALTIME, &past[0]);
+    past[0].tv_sec -= 10 * DISCOVERY_MTIME_MARGIN;
+    past[1] = past[0];
+    utimensat(AT_FDCWD, dirPath.c_str(), past, 0);
+
+    since = std::chrono::steady_clock::now();
+    std::size_t found = stat_and_map_scan(dirPath);
+    std::cout << "stat and ordered maps:      " << elapsed_ms(since) << " ms (" << found << " pairs)" << std::endl;
+
+    pair_discovery discovery;
+    since = std::chrono::steady_clock::now();
+    const std::vector<discovered_pair> initial = discovery.scan(dirPath);
+    const double scanMs = elapsed_ms(since);
+    std::cout << "initial scan:               " << scanMs << " ms (" << initial.size() << " pairs, "
+              << discovery.entries_read() << " entries)" << std::endl;
+
+    // Before the first launch, the monitor used to estimate backlog of every pair found, while
+    // it now estimates a first few (and the rest at the next refresh)
+    for (const std::size_t estimates : { initial.size(), std::min<std::size_t>(initial.size(), SCHEDULER_BACKLOG_ESTIMATES) }) {
+        since = std::chrono::steady_clock::now();
+        unsigned long long backlog = 0;
+        for (std::size_t i = 0; i < estimates; ++i) {
+            backlog += backlog_bytes(dirPath, static_cast<unsigned int>(i), initial[i].headerFile, initial[i].payloadFile);
+        }
+        std::cout << "first launch, " << estimates << " estimated: " << scanMs + elapsed_ms(since) << " ms ("
+                  << backlog << " bytes of backlog)" << std::endl;
+    }
+
+    since = std::chrono::steady_clock::now();
+    found = discovery.scan(dirPath).size();
+    std::cout << "repeat scan, unchanged:     " << elapsed_ms(since) << " ms (" << found << " new pairs, "
+              << discovery.entries_read() << " entries)" << std::endl;
+
+    create_pairs(dirPath, pairs, pairs + added);
+    since = std::chrono::steady_clock::now();
+    found = discovery.scan(dirPath).size();
+    std::cout << "repeat scan, " << added << " pairs added: " << elapsed_ms(since) << " ms (" << found << " new pairs, "
+              << discovery.entries_read() << " entries)" << std::endl;
+
+    since = std::chrono::steady_clock::now();
+    found = discovery.scan(dirPath).size();
+    std::cout << "repeat scan, just changed:  " << elapsed_ms(since) << " ms (" << found << " new pairs, "
+              << discovery.entries_read() << " entries)" << std::endl;
+
+    return STATUS_ENDED_SUCCESSFULLY;
+}
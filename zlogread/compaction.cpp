@@ -0,0 +1,396 @@
+//
+// End-of-day compaction of pairs into segments
+//
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <boost/log/trivial.hpp>
+
+#include "zlog.h"
+#include "logging.h"
+#include "options.h"
+#include "segment.h"
+#include "livering.h"
+
+namespace fs = boost::filesystem;
+
+// Forward declarations
+void load_state(const fs::path& path, unsigned long id, std::streamoff &lastHeaderPos, std::streamoff &lastPayloadPos, unsigned long& size, unsigned long& count);
+
+#if defined(__APPLE__)
+#define st_mtim st_mtimespec
+#endif
+
+struct compaction_unit {
+    std::string stem;
+    bool finished = false;
+    unsigned int shard = 0; // 0 if never registered
+    std::uint64_t headerSize = 0;
+    std::uint64_t payloadSize = 0;
+    struct timespec modified = {};
+};
+
+// Holds a lock file while compacting, so that instances sharing a day directory do not compact it twice
+class compaction_lock {
+public:
+    explicit compaction_lock(const fs::path& path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open lock file " + path.string());
+        }
+        held = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    }
+
+    ~compaction_lock() {
+        if (held) {
+            flock(fd, LOCK_UN);
+        }
+        ::close(fd);
+    }
+
+    compaction_lock(const compaction_lock&) = delete;
+    compaction_lock& operator=(const compaction_lock&) = delete;
+
+    bool acquired() const { return held; }
+
+private:
+    int fd = -1;
+    bool held = false;
+};
+
+static std::map<std::string, unsigned int> read_registry(const fs::path& dayDir) {
+    std::map<std::string, unsigned int> shards;
+    std::ifstream registry((dayDir / COORDINATION_SHARD_REGISTRY).string());
+    std::string line;
+    while (std::getline(registry, line)) {
+        auto comma = line.rfind(',');
+        if (comma == std::string::npos) {
+            continue;
+        }
+        unsigned int shard;
+        auto [ptr, ec] = std::from_chars(line.data() + comma + 1, line.data() + line.size(), shard);
+        if (ec == std::errc() && ptr == line.data() + line.size() && comma + 1 != line.size()) {
+            shards[line.substr(0, comma)] = shard; // corrupt lines are skipped, rather than abort compaction
+        }
+    }
+    return shards;
+}
+
+// Lease files are "owner,expiry,state"
+static bool read_lease_state(const fs::path& path, std::string& state) {
+    std::ifstream file(path.string());
+    std::string line;
+    if (!std::getline(file, line)) {
+        return false;
+    }
+    state = line.substr(line.rfind(',') + 1);
+    return true;
+}
+
+static bool read_seal(const fs::path& path, std::uint64_t& headerSize, std::uint64_t& payloadSize) {
+    std::ifstream seal(path.string());
+    char comma = 0;
+    return static_cast<bool>(seal >> headerSize >> comma >> payloadSize) && comma == ',';
+}
+
+static void write_all(int fd, const char* data, std::size_t length, off_t offset, const fs::path& path) {
+    while (length > 0) {
+        ssize_t written = ::pwrite(fd, data, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Could not write " + path.string() + ": " + strerror(errno));
+        }
+        data += written;
+        length -= static_cast<std::size_t>(written);
+        offset += written;
+    }
+}
+
+// Copies 'length' bytes of 'source' to 'fd' at 'offset' -- within the kernel, where possible
+static void copy_file(const fs::path& source, int fd, off_t offset, std::uint64_t length, const fs::path& path) {
+    int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        throw std::runtime_error("Could not open " + source.string() + ": " + strerror(errno));
+    }
+    off_t from = 0;
+#if defined(__linux__)
+    while (length > 0) {
+        off_t to = offset;
+        ssize_t copied = ::copy_file_range(in, &from, fd, &to, length, 0);
+        if (copied <= 0) {
+            if (copied < 0 && errno == EINTR) {
+                continue;
+            }
+            break; // not supported here, or short file -- in which case plain reads tell
+        }
+        offset = to;
+        length -= static_cast<std::uint64_t>(copied);
+    }
+#endif
+    std::vector<char> buffer(length > 0 ? IO_STREAM_CHUNK_SIZE : 0);
+    while (length > 0) {
+        ssize_t got = ::pread(in, buffer.data(), std::min<std::uint64_t>(buffer.size(), length), from);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            ::close(in);
+            throw std::runtime_error("Could not read " + source.string() + (got == 0 ? ": shorter than sealed" : ""));
+        }
+        write_all(fd, buffer.data(), static_cast<std::size_t>(got), offset, path);
+        from += got;
+        offset += got;
+        length -= static_cast<std::uint64_t>(got);
+    }
+    ::close(in);
+}
+
+// Copies header of pair, counting entries and noting offsets of every SEGMENT_INDEX_INTERVAL'th
+static void copy_header(const fs::path& source, int fd, segment_pair& pair, const fs::path& path) {
+    std::ifstream in(source.string(), std::ios::binary);
+    std::vector<char> buffer(IO_STREAM_CHUNK_SIZE);
+    std::uint64_t position = 0;
+    bool lineStart = true;
+    while (position < pair.headerLength) {
+        const auto wanted = static_cast<std::streamsize>(std::min<std::uint64_t>(buffer.size(), pair.headerLength - position));
+        if (!in.read(buffer.data(), wanted)) {
+            throw std::runtime_error("Could not read " + source.string() + ": shorter than sealed");
+        }
+        for (std::streamsize i = 0; i < wanted; ++i) {
+            if (lineStart) {
+                if (pair.entries % SEGMENT_INDEX_INTERVAL == 0) {
+                    pair.sparse.push_back(position + static_cast<std::uint64_t>(i));
+                }
+                ++pair.entries;
+            }
+            lineStart = buffer[i] == '\n';
+        }
+        write_all(fd, buffer.data(), static_cast<std::size_t>(wanted), static_cast<off_t>(pair.headerOffset + position), path);
+        position += static_cast<std::uint64_t>(wanted);
+    }
+}
+
+// Writes one segment (through a temporary file, renamed into place once synced)
+static void write_segment(const fs::path& dayDir, const fs::path& segmentPath, const std::vector<compaction_unit>& units) {
+    const fs::path temporary = segmentPath.string() + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create " + temporary.string() + ": " + strerror(errno));
+    }
+    try {
+        std::string head = "ZLSG";
+        head += static_cast<char>(1); // version
+        write_all(fd, head.data(), head.size(), 0, temporary);
+
+        std::vector<segment_pair> pairs;
+        std::uint64_t at = head.size();
+        std::uint64_t entries = 0;
+        for (const compaction_unit& unit : units) {
+            segment_pair pair;
+            pair.stem = unit.stem;
+            pair.finished = unit.finished;
+            pair.firstEntry = entries;
+            pair.headerOffset = at;
+            pair.headerLength = unit.headerSize;
+            pair.payloadOffset = at + unit.headerSize;
+            pair.payloadLength = unit.payloadSize;
+            pair.modifiedSeconds = unit.modified.tv_sec;
+            pair.modifiedNanos = unit.modified.tv_nsec;
+
+            copy_header(dayDir / (unit.stem + ".header"), fd, pair, temporary);
+            copy_file(dayDir / (unit.stem + ".payload"), fd, static_cast<off_t>(pair.payloadOffset), pair.payloadLength, temporary);
+
+            at = pair.payloadOffset + pair.payloadLength;
+            entries += pair.entries;
+            pairs.push_back(std::move(pair));
+        }
+        write_segment_index(fd, at, pairs, temporary.string());
+
+        if (fsync(fd) != 0) {
+            throw std::runtime_error("Could not sync " + temporary.string() + ": " + strerror(errno));
+        }
+    } catch (...) {
+        ::close(fd);
+        ::unlink(temporary.c_str());
+        throw;
+    }
+    ::close(fd);
+    fs::rename(temporary, segmentPath);
+}
+
+static void sync_directory(const fs::path& dirPath) {
+    int fd = ::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+static void remove_quietly(const fs::path& path) {
+    boost::system::error_code ec;
+    fs::remove(path, ec);
+}
+
+int compact_day(const fs::path& dayDir, const option_map& options) {
+    auto startTime = std::chrono::steady_clock::now();
+    if (!fs::is_directory(dayDir)) {
+        ZLOG(error) << "No such day directory: " << dayDir << std::endl;
+        return STATUS_INVALID_ARGUMENT;
+    }
+    compaction_lock lock(dayDir / COMPACTION_LOCK_FILE);
+    if (!lock.acquired()) {
+        ZLOG(info) << "Compaction of " << dayDir << " is already under way" << std::endl;
+        return STATUS_ENDED_SUCCESSFULLY;
+    }
+
+    // Sealed and complete pairs are compacted, unless some pair is still leased for processing.
+    // Pairs not sealed are left as they are
+    const std::map<std::string, unsigned int> shards = read_registry(dayDir);
+    std::vector<compaction_unit> units;
+    unsigned long unsealed = 0;
+    for (const auto& entry : fs::directory_iterator(dayDir)) {
+        if (entry.path().extension() != ".header") {
+            continue;
+        }
+        compaction_unit unit;
+        unit.stem = entry.path().stem().string();
+        const fs::path payloadPath = dayDir / (unit.stem + ".payload");
+
+        std::string leaseState;
+        if (read_lease_state(dayDir / (unit.stem + ".lease"), leaseState) && leaseState != "finished") {
+            ZLOG(info) << "Not compacting " << dayDir << " yet, since " << unit.stem << " is being processed" << std::endl;
+            return STATUS_ENDED_UNSUCCESSFULLY;
+        }
+
+        struct stat headerStat, payloadStat;
+        if (!read_seal(dayDir / (unit.stem + ".sealed"), unit.headerSize, unit.payloadSize)
+            || stat(entry.path().c_str(), &headerStat) != 0 || stat(payloadPath.c_str(), &payloadStat) != 0
+            || static_cast<std::uint64_t>(headerStat.st_size) != unit.headerSize
+            || static_cast<std::uint64_t>(payloadStat.st_size) != unit.payloadSize) {
+            ++unsealed;
+            continue;
+        }
+        unit.modified = headerStat.st_mtim;
+
+        // Finished if so leased, or if processor state has reached the seal
+        unit.finished = leaseState == "finished";
+        auto shard = shards.find(unit.stem);
+        if (shard != shards.end()) {
+            unit.shard = shard->second;
+            std::streamoff lastHeaderPos = 0, lastPayloadPos = 0;
+            unsigned long size = 0, count = 0;
+            load_state(dayDir, unit.shard, lastHeaderPos, lastPayloadPos, size, count);
+            unit.finished = unit.finished || static_cast<std::uint64_t>(lastHeaderPos) >= unit.headerSize;
+        }
+        units.push_back(std::move(unit));
+    }
+    if (units.empty()) {
+        ZLOG(info) << "Nothing to compact in " << dayDir << " (" << unsealed << " pairs not sealed)" << std::endl;
+        return STATUS_ENDED_SUCCESSFULLY;
+    }
+    std::sort(units.begin(), units.end(), [](const compaction_unit& a, const compaction_unit& b) { return a.stem < b.stem; });
+
+    // Pairs are grouped into segments of about target size, numbered after those already there
+    const std::uint64_t targetSize = std::max(1UL, get_numeric_option(options, "segment-size", SEGMENT_TARGET_SIZE));
+    unsigned long number = 0;
+    for (const fs::path& existing : find_segments(dayDir)) {
+        const std::string name = existing.stem().string();
+        if (name.starts_with("segment-")) {
+            number = std::max(number, std::stoul(name.substr(8)));
+        }
+    }
+    std::vector<std::pair<fs::path, std::vector<compaction_unit>>> segments;
+    std::uint64_t segmentSize = 0;
+    for (compaction_unit& unit : units) {
+        if (segments.empty() || segmentSize >= targetSize) {
+            segments.emplace_back(dayDir / ("segment-" + std::to_string(++number) + SEGMENT_SUFFIX), std::vector<compaction_unit>());
+            segmentSize = 0;
+        }
+        segmentSize += unit.headerSize + unit.payloadSize;
+        segments.back().second.push_back(std::move(unit));
+    }
+
+    // Segments are written in parallel
+    unsigned long numberOfThreads = get_numeric_option(options, "threads", std::max(1U, std::thread::hardware_concurrency()));
+    numberOfThreads = std::max(1UL, std::min<unsigned long>(numberOfThreads, segments.size()));
+    std::atomic<std::size_t> nextSegment = 0;
+    std::vector<char> written(segments.size(), 0); // not vector<bool>, since set by different threads
+    std::mutex errorMutex;
+    std::vector<std::thread> workers;
+    for (unsigned long t = 0; t < numberOfThreads; ++t) {
+        workers.emplace_back([&]() {
+            std::size_t idx;
+            while ((idx = nextSegment++) < segments.size()) {
+                try {
+                    write_segment(dayDir, segments[idx].first, segments[idx].second);
+                    written[idx] = 1;
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> guard(errorMutex);
+                    ZLOG(error) << "Failed to write " << segments[idx].first << ": " << e.what() << std::endl;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    sync_directory(dayDir);
+
+    // Only once segments are in place are compacted files removed. State of unfinished pairs is
+    // kept, since it is relative to the pair and remains valid
+    unsigned long pairs = 0;
+    unsigned long removed = 0;
+    std::uint64_t bytes = 0;
+    for (std::size_t idx = 0; idx < segments.size(); ++idx) {
+        if (!written[idx]) {
+            continue;
+        }
+        for (const compaction_unit& unit : segments[idx].second) {
+            std::vector<fs::path> files = {
+                dayDir / (unit.stem + ".header"), dayDir / (unit.stem + ".payload"),
+                dayDir / (unit.stem + ".sealed"), dayDir / (unit.stem + LIVE_RING_SUFFIX)
+            };
+            if (unit.finished) {
+                files.push_back(dayDir / (unit.stem + ".lease"));
+                if (unit.shard > 0) {
+                    files.push_back(dayDir / ("processor-" + std::to_string(unit.shard) + ".state"));
+                    files.push_back(dayDir / ("processor-" + std::to_string(unit.shard) + ".agg"));
+                    files.push_back(dayDir / ("processor-" + std::to_string(unit.shard) + ".journal"));
+                }
+            }
+            for (const fs::path& file : files) {
+                if (fs::exists(file)) {
+                    remove_quietly(file);
+                    ++removed;
+                }
+            }
+            ++pairs;
+            bytes += unit.headerSize + unit.payloadSize;
+        }
+    }
+    sync_directory(dayDir);
+
+    const auto failed = static_cast<unsigned long>(std::count(written.begin(), written.end(), 0));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    ZLOG(info) << "Compacted " << pairs << " pairs (" << bytes << " bytes) of " << dayDir << " into "
+               << segments.size() - failed << " segments in " << seconds << " s using " << numberOfThreads
+               << " threads, removing " << removed << " files (" << unsealed << " pairs not sealed were left)" << std::endl;
+    return failed > 0 ? STATUS_GENERAL_FAILURE : STATUS_ENDED_SUCCESSFULLY;
+}
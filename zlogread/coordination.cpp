@@ -0,0 +1,358 @@
+//
+// Coordination between several monitors sharing one base directory
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <csignal>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#if defined(__linux__)
+#include <sys/prctl.h>
+#endif
+
+#include <boost/log/trivial.hpp>
+
+#include "zlog.h"
+#include "logging.h"
+#include "coordination.h"
+
+namespace fs = boost::filesystem;
+
+std::uint64_t stable_hash(const std::string& text) {
+    // FNV-1a, followed by a finalizer (from splitmix64) so that similar stems spread out on the ring
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+void end_with_parent() {
+#if defined(__linux__)
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) {
+        // Parent already gone (before we got to ask)
+        std::raise(SIGTERM);
+    }
+#endif
+}
+
+// Exclusive lock on the day directory, serializing lease and registry updates between instances
+class directory_lock {
+public:
+    explicit directory_lock(const fs::path& path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open lock file " + path.string());
+        }
+        while (flock(fd, LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                ::close(fd);
+                throw std::runtime_error("Could not lock " + path.string());
+            }
+        }
+    }
+
+    ~directory_lock() {
+        flock(fd, LOCK_UN);
+        ::close(fd);
+    }
+
+    directory_lock(const directory_lock&) = delete;
+    directory_lock& operator=(const directory_lock&) = delete;
+
+private:
+    int fd;
+};
+
+// Lease file: "owner,expiry,state", where state is 'active' or 'finished'
+struct lease {
+    std::string owner;
+    std::time_t expiry = 0;
+    bool finished = false;
+};
+
+static bool read_lease(const fs::path& path, lease& l) {
+    std::ifstream file(path.string());
+    std::string line;
+    if (!file.is_open() || !std::getline(file, line)) {
+        return false;
+    }
+    std::stringstream ss(line);
+    std::string expiry, state;
+    if (!std::getline(ss, l.owner, ',') || !std::getline(ss, expiry, ',') || !std::getline(ss, state, ',')) {
+        return false;
+    }
+    // A corrupt lease is as good as none, rather than an end to the monitor
+    long long seconds;
+    auto [ptr, ec] = std::from_chars(expiry.data(), expiry.data() + expiry.size(), seconds);
+    if (ec != std::errc() || ptr != expiry.data() + expiry.size() || expiry.empty()) {
+        return false;
+    }
+    l.expiry = static_cast<std::time_t>(seconds);
+    l.finished = state == "finished";
+    return true;
+}
+
+// Replace file in one go, so that readers never see a partial file
+static void write_atomically(const fs::path& path, const std::string& content) {
+    fs::path tmpPath = path;
+    tmpPath += ".tmp";
+    {
+        std::ofstream file(tmpPath.string(), std::ios::trunc);
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not write " + tmpPath.string());
+        }
+        file << content << std::endl;
+    }
+    fs::rename(tmpPath, path);
+}
+
+static void write_lease(const fs::path& path, const lease& l) {
+    write_atomically(path, l.owner + "," + std::to_string(l.expiry) + "," + (l.finished ? "finished" : "active"));
+}
+
+coordinator::coordinator(const fs::path& basePath, const std::string& instance)
+    : instancesDir(basePath / COORDINATION_INSTANCES_DIR), instanceId(instance) {
+    if (standalone()) {
+        return;
+    }
+    if (instanceId.find_first_of("/,. \t") != std::string::npos) {
+        throw std::invalid_argument("Instance name \"" + instanceId + "\" may not contain '/', ',', '.' or spaces");
+    }
+    fs::create_directories(instancesDir);
+}
+
+bool coordinator::heartbeat() {
+    if (standalone()) {
+        return false;
+    }
+    const std::time_t now = std::time(nullptr);
+
+    // Announce ourselves
+    write_atomically(instancesDir / (instanceId + ".heartbeat"), std::to_string(now + COORDINATION_LEASE_DURATION));
+
+    // ...and see who else is around
+    std::vector<std::string> alive;
+    alive.push_back(instanceId);
+    for (const auto& entry : fs::directory_iterator(instancesDir)) {
+        const fs::path& path = entry.path();
+        if (path.extension() != ".heartbeat" || path.stem().string() == instanceId) {
+            continue;
+        }
+        std::ifstream file(path.string());
+        long long expiry = 0;
+        if (file >> expiry && expiry >= now) {
+            alive.push_back(path.stem().string());
+        }
+    }
+    std::sort(alive.begin(), alive.end());
+
+    if (alive == membership) {
+        return false;
+    }
+    membership = alive;
+
+    ring.clear();
+    for (const std::string& member : membership) {
+        for (int i = 0; i < COORDINATION_VIRTUAL_NODES; ++i) {
+            ring[stable_hash(member + "#" + std::to_string(i))] = member;
+        }
+    }
+    return true;
+}
+
+void coordinator::leave() {
+    if (standalone()) {
+        return;
+    }
+    for (const auto& [stem, expiry] : std::map<std::string, std::time_t>(held)) {
+        release(stem);
+    }
+    boost::system::error_code ec;
+    fs::remove(instancesDir / (instanceId + ".heartbeat"), ec);
+}
+
+bool coordinator::owns(const std::string& stem) const {
+    if (standalone() || ring.empty()) {
+        return true;
+    }
+    auto it = ring.lower_bound(stable_hash(stem));
+    if (it == ring.end()) {
+        it = ring.begin(); // wrap around
+    }
+    return it->second == instanceId;
+}
+
+fs::path coordinator::lock_path() const {
+    return currentDir / COORDINATION_LOCK_FILE;
+}
+
+fs::path coordinator::lease_path(const std::string& stem) const {
+    return currentDir / (stem + ".lease");
+}
+
+void coordinator::switch_directory(const fs::path& dayDir) {
+    if (!currentDir.empty()) {
+        for (const auto& [stem, expiry] : std::map<std::string, std::time_t>(held)) {
+            release(stem);
+        }
+    }
+    held.clear();
+    knownShards.clear();
+    currentDir = dayDir;
+}
+
+unsigned int coordinator::shard_for(const std::string& stem) {
+    auto it = knownShards.find(stem);
+    if (it == knownShards.end()) {
+        register_stems({ stem });
+        it = knownShards.find(stem);
+    }
+    return it->second;
+}
+
+void coordinator::register_stems(const std::vector<std::string>& stems) {
+    bool known = true;
+    for (const std::string& stem : stems) {
+        known = known && knownShards.count(stem) > 0;
+    }
+    if (known) {
+        return;
+    }
+
+    // Registry lines are "stem,shard", and shards are numbered from 1 in order of discovery
+    directory_lock lock(lock_path());
+    const fs::path registryPath = currentDir / COORDINATION_SHARD_REGISTRY;
+
+    unsigned int highest = 0;
+    std::ifstream registry(registryPath.string());
+    std::string line;
+    while (std::getline(registry, line)) {
+        auto comma = line.rfind(',');
+        if (comma == std::string::npos) {
+            continue;
+        }
+        unsigned int shard;
+        auto [ptr, ec] = std::from_chars(line.data() + comma + 1, line.data() + line.size(), shard);
+        if (ec != std::errc() || ptr != line.data() + line.size() || comma + 1 == line.size()) {
+            continue; // corrupt line, as if absent
+        }
+        knownShards[line.substr(0, comma)] = shard;
+        highest = std::max(highest, shard);
+    }
+    registry.close();
+
+    std::string additions;
+    for (const std::string& stem : stems) {
+        if (knownShards.emplace(stem, highest + 1).second) {
+            additions += stem + "," + std::to_string(++highest) + "\n";
+        }
+    }
+    if (additions.empty()) {
+        return;
+    }
+    std::ofstream out(registryPath.string(), std::ios::app);
+    out << additions;
+    out.flush();
+    if (!out) {
+        throw std::runtime_error("Could not update shard registry " + registryPath.string());
+    }
+}
+
+lease_status coordinator::acquire(const std::string& stem) {
+    if (standalone()) {
+        return lease_status::ACQUIRED;
+    }
+    const std::time_t now = std::time(nullptr);
+    const fs::path path = lease_path(stem);
+
+    directory_lock lock(lock_path());
+    lease current;
+    if (read_lease(path, current)) {
+        if (current.finished) {
+            return lease_status::FINISHED;
+        }
+        if (current.owner != instanceId && current.expiry >= now) {
+            return lease_status::HELD_BY_OTHER;
+        }
+        if (current.owner != instanceId) {
+            ZLOG(info) << "Taking over " << stem << " from " << current.owner << ", whose lease expired" << std::endl;
+        }
+    }
+    lease mine { instanceId, now + COORDINATION_LEASE_DURATION, false };
+    write_lease(path, mine);
+    held[stem] = mine.expiry;
+    return lease_status::ACQUIRED;
+}
+
+void coordinator::release(const std::string& stem, bool finished) {
+    if (standalone()) {
+        return;
+    }
+    held.erase(stem);
+
+    const fs::path path = lease_path(stem);
+    directory_lock lock(lock_path());
+    lease current;
+    if (!read_lease(path, current) || current.owner != instanceId) {
+        return; // not ours (any longer)
+    }
+    if (finished) {
+        current.finished = true;
+        write_lease(path, current);
+    } else {
+        boost::system::error_code ec;
+        fs::remove(path, ec);
+    }
+}
+
+bool coordinator::finished(const std::string& stem) {
+    if (standalone()) {
+        return false;
+    }
+    lease current;
+    return read_lease(lease_path(stem), current) && current.finished;
+}
+
+std::vector<std::string> coordinator::renew() {
+    std::vector<std::string> lost;
+    if (standalone()) {
+        return lost;
+    }
+    const std::time_t now = std::time(nullptr);
+
+    for (auto it = held.begin(); it != held.end();) {
+        if (it->second - now > COORDINATION_LEASE_DURATION / 2) {
+            ++it;
+            continue;
+        }
+        const fs::path path = lease_path(it->first);
+        directory_lock lock(lock_path());
+        lease current;
+        if (!read_lease(path, current) || current.owner != instanceId) {
+            ZLOG(warning) << "Lost lease on " << it->first << (current.owner.empty() ? "" : " to " + current.owner) << std::endl;
+            lost.push_back(it->first);
+            it = held.erase(it);
+            continue;
+        }
+        current.expiry = now + COORDINATION_LEASE_DURATION;
+        write_lease(path, current);
+        it->second = current.expiry;
+        ++it;
+    }
+    return lost;
+}
@@ -0,0 +1,84 @@
+//
+// Coordination between several monitors sharing one base directory (on one host,
+// or on hosts sharing a file system).
+//
+// Instances announce themselves with heartbeat files in <base>/.instances and pairs
+// are assigned to instances by consistent hashing of stems. An instance holds a lease
+// (<stem>.lease) on each pair it processes, which it renews while processing. Leases of
+// instances that die expire, and the pair is taken over by the next instance on the ring
+// -- resuming from the processor-N.state checkpoint, since shard numbers are kept in a
+// registry (shards.registry) that is shared between instances.
+//
+
+#ifndef COORDINATION_H
+#define COORDINATION_H
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+enum class lease_status { ACQUIRED, HELD_BY_OTHER, FINISHED };
+
+class coordinator {
+public:
+    // With an empty 'instance', this monitor is on its own and owns every pair
+    coordinator(const boost::filesystem::path& basePath, const std::string& instance);
+
+    bool standalone() const { return instanceId.empty(); }
+    const std::string& instance() const { return instanceId; }
+
+    // Renews own heartbeat and reads membership. Returns true if membership changed
+    bool heartbeat();
+
+    // Leave, so that others need not wait for our heartbeat (and leases) to expire
+    void leave();
+
+    // Whether pair belongs to this instance, according to current membership
+    bool owns(const std::string& stem) const;
+
+    // Day directory where leases and shard numbers are kept. Leases held in a previous
+    // directory are released
+    void switch_directory(const boost::filesystem::path& dayDir);
+
+    // Shard number of pair, stable across instances and restarts
+    unsigned int shard_for(const std::string& stem);
+
+    // Assigns shard numbers to many stems at once (e.g. on startup in a big directory)
+    void register_stems(const std::vector<std::string>& stems);
+
+    lease_status acquire(const std::string& stem);
+    void release(const std::string& stem, bool finished = false);
+    bool finished(const std::string& stem);
+
+    // Renews leases that are about to expire. Returns stems of leases that were lost
+    // (taken over by others), whose processors must stop
+    std::vector<std::string> renew();
+
+    const std::vector<std::string>& members() const { return membership; }
+
+private:
+    boost::filesystem::path lock_path() const;
+    boost::filesystem::path lease_path(const std::string& stem) const;
+
+    boost::filesystem::path instancesDir;
+    std::string instanceId;
+
+    boost::filesystem::path currentDir;
+    std::vector<std::string> membership;                  // sorted
+    std::map<std::uint64_t, std::string> ring;            // point -> instance
+    std::map<std::string, std::time_t> held;              // stem -> lease expiry
+    std::unordered_map<std::string, unsigned int> knownShards; // cached from registry
+};
+
+// Stable (across hosts and builds) 64-bit hash, for placing stems and instances on the ring
+std::uint64_t stable_hash(const std::string& text);
+
+// Have this process terminated (SIGTERM) when the monitor that started it goes away
+void end_with_parent();
+
+#endif // COORDINATION_H
@@ -0,0 +1,121 @@
+//
+// Content-addressed deduplication of payloads, ahead of batching
+//
+#include <cstring>
+
+#include "dedup.h"
+
+static constexpr std::uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static constexpr std::uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr std::uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+static constexpr std::uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr std::uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline std::uint64_t rotl(std::uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline std::uint64_t read64(const unsigned char* p) {
+    std::uint64_t value;
+    std::memcpy(&value, p, sizeof(value)); // little endian hosts only, as everything here
+    return value;
+}
+
+static inline std::uint32_t read32(const unsigned char* p) {
+    std::uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline std::uint64_t round(std::uint64_t acc, std::uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline std::uint64_t merge_round(std::uint64_t acc, std::uint64_t value) {
+    acc ^= round(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+std::uint64_t payload_digest(std::string_view data, std::uint64_t seed) {
+    const auto* p = reinterpret_cast<const unsigned char*>(data.data());
+    const unsigned char* const end = p + data.size();
+    std::uint64_t h;
+
+    if (data.size() >= 32) {
+        std::uint64_t v1 = seed + PRIME1 + PRIME2;
+        std::uint64_t v2 = seed + PRIME2;
+        std::uint64_t v3 = seed;
+        std::uint64_t v4 = seed - PRIME1;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = seed + PRIME5;
+    }
+    h += static_cast<std::uint64_t>(data.size());
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= static_cast<std::uint64_t>(read32(p)) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= (*p) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+payload_dedup::payload_dedup(std::size_t capacity) : capacity(capacity) {
+    index.reserve(capacity);
+}
+
+std::optional<payload_location> payload_dedup::find_or_remember(std::string_view payload, const payload_location& here) {
+    ++lookupCount;
+    const key k = { payload_digest(payload), payload.size() };
+
+    auto it = index.find(k);
+    if (it != index.end()) {
+        recent.splice(recent.begin(), recent, it->second);
+        ++hitCount;
+        savedBytes += payload.size();
+        return it->second->second;
+    }
+
+    if (capacity == 0) {
+        return std::nullopt;
+    }
+    if (recent.size() >= capacity) {
+        index.erase(recent.back().first);
+        recent.pop_back();
+    }
+    recent.emplace_front(k, here);
+    index.emplace(k, recent.begin());
+    return std::nullopt;
+}
+
+void payload_dedup::clear() {
+    recent.clear();
+    index.clear();
+}
@@ -0,0 +1,64 @@
+//
+// Content-addressed deduplication of payloads, ahead of batching
+//
+// Payloads are identified by digest (XXH64) and length. Recently seen payloads are remembered
+// (least recently used are forgotten first) with where they were stored, so that repeats may
+// be stored as references. Payloads are not compared byte by byte; two different payloads of
+// the same length colliding on a 64-bit digest is not considered.
+//
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+#include "zlog.h"
+
+// XXH64 of 'data'
+std::uint64_t payload_digest(std::string_view data, std::uint64_t seed = 0);
+
+// Where a payload is stored: in the blob of a batch
+struct payload_location {
+    std::uint32_t batch;  // as numbered by caller
+    std::uint64_t offset; // in blob
+};
+
+class payload_dedup {
+public:
+    explicit payload_dedup(std::size_t capacity = DEDUP_CAPACITY);
+
+    // Earlier location of 'payload', if remembered. Otherwise remembers it as stored at 'here'
+    std::optional<payload_location> find_or_remember(std::string_view payload, const payload_location& here);
+
+    void clear();
+    void reset_statistics() { lookupCount = hitCount = savedBytes = 0; }
+
+    unsigned long long lookups() const { return lookupCount; }
+    unsigned long long hits() const { return hitCount; }
+    unsigned long long saved_bytes() const { return savedBytes; }
+
+private:
+    struct key {
+        std::uint64_t digest;
+        std::uint64_t length;
+        bool operator==(const key& other) const { return digest == other.digest && length == other.length; }
+    };
+    struct key_hash {
+        std::size_t operator()(const key& k) const { return static_cast<std::size_t>(k.digest ^ (k.length * 0x9E3779B97F4A7C15ULL)); }
+    };
+    using recent_list = std::list<std::pair<key, payload_location>>;
+
+    std::size_t capacity;
+    recent_list recent; // most recently used first
+    std::unordered_map<key, recent_list::iterator, key_hash> index;
+
+    unsigned long long lookupCount = 0;
+    unsigned long long hitCount = 0;
+    unsigned long long savedBytes = 0;
+};
+
+#endif // DEDUP_H
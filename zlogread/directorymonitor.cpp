@@ -9,6 +9,12 @@
 #include <chrono>
 #include <ctime>
 #include <thread>
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+
+#include <poll.h>
+#include <unistd.h>
 
 #include <boost/log/core.hpp>
 #include <boost/process.hpp>
@@ -24,6 +30,14 @@
 #include <boost/log/attributes/named_scope.hpp>
 
 #include "zlog.h"
+#include "logging.h"
+#include "options.h"
+#include "aggregate.h"
+#include "scheduler.h"
+#include "coordination.h"
+#include "discovery.h"
+#include "pool.h"
+#include "probes.h"
 
 namespace fs = boost::filesystem;
 namespace logging = boost::log;
@@ -37,6 +51,7 @@ std::tm today();
 bool differs_from_today(const std::tm& then);
 std::string get_date_path(const std::tm& today);
 void proceed_to_next_day(std::tm& date);
+int compact_day(const fs::path& dayDir, const option_map& options);
 
 //
 typedef std::map<
@@ -47,79 +62,496 @@ typedef std::map<
         std::string /* payload filename */>
 > pair_map;
 
-// Function to list and pair files with ".header" and ".payload" suffixes
-static pair_map find_pairs(const fs::path& dirPath, pair_map& existingFiles) {
+struct monitored_tree;
+struct monitored_day;
+
+// A header and payload pair, as seen by the scheduler
+struct scheduled_unit {
+    monitored_tree* tree = nullptr; // base directory of pair
+    monitored_day* day = nullptr;   // ...and day directory
+    std::string stem;
+    std::string headerFile;
+    std::string payloadFile;
+    unsigned int shard = 0;
+    unsigned long long backlog = 0;
+    bool backlogKnown = false;
+
+    // Pairs compacted into a segment have their lengths from the segment index
+    bool inSegment = false;
+    std::uint64_t headerLength = 0;
+    std::uint64_t payloadLength = 0;
+};
+
+// A processor handling a unit, with its stdout collected line by line. The processor is
+// either a child process of its own, or a worker from the processor pool.
+struct running_processor {
+    scheduled_unit unit;
+    std::shared_ptr<bp::child> child;
+    std::shared_ptr<bp::pipe> pipe;
+    pool_worker worker;
+    pid_t pid = 0;
+    int outputFd = -1;
+    std::string partialLine;
+    std::string lastLine;  // held back, since last line is the final report
+    bool eof = false;
+    int cpuSlot = -1;
+    std::chrono::steady_clock::time_point started;
+    bool preempting = false;
+};
+
+// Collect whatever the processor has written to stdout, without blocking. Complete
+// lines are returned, while partial lines are kept until the rest arrives (or 'drain').
+static std::vector<std::string> collect_output(running_processor& processor, bool drain) {
+    std::vector<std::string> lines;
+    const int fd = processor.outputFd;
+
+    char buffer[4096];
+    while (true) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) <= 0 || (pfd.revents & (POLLIN | POLLHUP)) == 0) {
+            break;
+        }
+        ssize_t n = ::read(fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            processor.eof = true;
+            break; // EOF (or error)
+        }
+        processor.partialLine.append(buffer, n);
+    }
 
-    std::map<std::string /* stem */, std::tuple<std::string /* stem */, fs::path /* directory */, std::string /* header filename */, std::string /* payload filename */>> newEntries;
+    std::string::size_type newline;
+    while ((newline = processor.partialLine.find('\n')) != std::string::npos) {
+        std::string line = processor.partialLine.substr(0, newline);
+        processor.partialLine.erase(0, newline + 1);
+        if (!line.empty()) {
+            lines.push_back(line);
+        }
+    }
+    if (drain && !processor.partialLine.empty()) {
+        lines.push_back(processor.partialLine);
+        processor.partialLine.clear();
+    }
+    return lines;
+}
 
-    if (fs::exists(dirPath) && fs::is_directory(dirPath)) {
-        std::map<std::string /* stem */ , fs::path /* directory path */> stems;
-        std::map<std::string /* stem */, std::string> headerFiles;
-        std::map<std::string /* stem */, std::string> payloadFiles;
+// Wait (at most 'timeout') for processors to report, or for pooled workers to connect
+static void wait_for_activity(const std::vector<running_processor>& running, int listenFd, std::chrono::milliseconds timeout) {
+    std::vector<struct pollfd> fds;
+    for (const auto& processor : running) {
+        if (processor.outputFd >= 0 && !processor.eof) {
+            fds.push_back({ processor.outputFd, POLLIN, 0 });
+        }
+    }
+    if (listenFd >= 0) {
+        fds.push_back({ listenFd, POLLIN, 0 });
+    }
+    poll(fds.data(), fds.size(), static_cast<int>(timeout.count()));
+}
 
-        // Scan through directory and classify files by extension
-        for (const auto& entry : fs::directory_iterator(dirPath)) {
-            if (fs::is_regular_file(entry)) {
-                fs::path filePath = entry.path();
-                if (filePath.extension() == ".state") {
-                    // Ignore state files!
-                    continue;
-                }
+// Compacts pairs of a day that is done into segments, if so instructed
+static void compact_when_done(const fs::path& dayDir, const option_map& options) {
+    try {
+        compact_day(dayDir, options);
+    } catch (const std::exception& e) {
+        ZLOG(error) << "Failed to compact " << dayDir << ": " << e.what() << std::endl;
+    }
+}
 
-                //
-                std::string stem = filePath.stem().string();
-                fs::path basePath = filePath.parent_path();
-                stems[stem] = filePath;
+// Processors of a tenant, as reported now and then
+struct tenant_metrics {
+    unsigned long launched = 0;
+    unsigned long finished = 0;
+    unsigned long preempted = 0;
+    unsigned long retried = 0;  // could not open files
+    unsigned long failed = 0;
+    unsigned long long entries = 0; // processed, as reported by processors that finished
+    std::chrono::steady_clock::duration processorTime{};
+};
+
+// A day directory of a monitored tree. At rollover, processors of the previous day are left
+// to finish (drain) while processors of the new day start alongside them
+struct monitored_day {
+    std::tm date = {};
+    fs::path path;
+    std::unique_ptr<coordinator> coordination; // leases and shard numbers are kept per day directory
+    pair_discovery discovery;
+    pair_map trackedUnits;
+    std::map<std::string /* stem */, scheduled_unit> deferred; // not ours, or leased by others (for now)
+    unsigned long running = 0;
+};
+
+// A base directory being monitored -- on its own, or as one of several tenants sharing the
+// processor slots, CPUs and processor pool of the monitor
+struct monitored_tree {
+    std::string tenant;   // empty, unless serving several
+    std::string basePath;
+    option_map options;   // as handed to processors
+    unsigned long weight = 1;
+    unsigned long maxProcessors = 1;
+
+    std::vector<std::unique_ptr<monitored_day>> days; // current day last, after those draining
+    std::vector<scheduled_unit> pending;    // of all days, ordered by backlog, largest first
+    unsigned long running = 0;
+    std::chrono::steady_clock::time_point lastBacklogRefresh{};
+    bool done = false;
+
+    // Days are compacted in the background, while we go on with the next
+    std::thread compaction;
+
+    tenant_metrics metrics;
+
+    monitored_day& current() { return *days.back(); }
+
+    ~monitored_tree() {
+        if (compaction.joinable()) {
+            compaction.join();
+        }
+    }
+};
 
-                if (filePath.extension() == ".header") {
-                    headerFiles[stem] = filePath.filename().string();
-                } else if (filePath.extension() == ".payload") {
-                    payloadFiles[stem] = filePath.filename().string();
-                }
-            }
+typedef std::vector<std::unique_ptr<monitored_tree>> tree_list;
+
+// Estimating backlog takes a few system calls per unit, so it is done when needed rather
+// than when units are found
+static void estimate_backlog(scheduled_unit& unit) {
+    unit.backlog = unit.inSegment
+        ? backlog_bytes(unit.day->path, unit.shard, unit.headerLength, unit.payloadLength)
+        : backlog_bytes(unit.day->path, unit.shard, unit.headerFile, unit.payloadFile);
+    unit.backlogKnown = true;
+}
+
+// Such as "#3", or "acme#3" when serving several tenants
+static std::string processor_name(const scheduled_unit& unit) {
+    return (unit.tree->tenant.empty() ? "#" : unit.tree->tenant + "#") + std::to_string(unit.shard);
+}
+
+// Log how a processor ended. Returns true if unit should be retried later.
+static bool report_exit(const running_processor& processor, int exitCode, const std::string& line) {
+    const std::string name = processor_name(processor.unit);
+
+    if (exitCode > FILE_READ_RELATED_ERRORS) {
+        // 101: Error opening header file
+        // 102: Error opening payload file
+        //
+        std::string info = "Processor ";
+        info += name;
+        info += " (pid=";
+        info += std::to_string(processor.pid);
+        info += ") could not load ";
+        if (exitCode == STATUS_COULD_NOT_OPEN_HEADER_FILE) {
+            info += "header file ";
+            info += processor.unit.headerFile;
+        } else if (exitCode == STATUS_COULD_NOT_OPEN_PAYLOAD_FILE) {
+            info += "payload file ";
+            info += processor.unit.payloadFile;
+        } else {
+            info += "some file??";
+        }
+        if (!line.empty()) {
+            info += ". It reports: " + line;
         }
+        ZLOG(info) << info << " -- Retrying later" << std::endl;
+        return true;
+
+    } else if (exitCode == STATUS_PREEMPTED) {
+        ZLOG(info) << "Processor " << name << " (pid=" << processor.pid << ") was preempted and is re-queued: " << line << std::endl;
+        return true;
+
+    } else if (exitCode == STATUS_ENDED_UNSUCCESSFULLY) {
+        std::string info = "Processor ";
+        info += name;
+        info += " (pid=";
+        info += std::to_string(processor.pid);
+        info += ") could not process all headers in file ";
+        info += processor.unit.headerFile + ". ";
+        if (!line.empty()) {
+            info += ". It reports: " + line;
+        }
+        ZLOG(error) << info << std::endl;
+
+    } else if (exitCode == 0) {
+        ZLOG(info) << "Processor " << name << " (pid=" << processor.pid << ") finished gracefully with report: " << line << std::endl;
+    } else {
+        ZLOG(info) << "Processor " << name << " (pid=" << processor.pid << ") reports error (" << exitCode << "): " << line << std::endl;
+    }
+    return false;
+}
 
-        // Match .header and .payload pairs by stem
-        for (const auto& _stem : stems) {
-            const std::string stem = _stem.first;
-            const fs::path path = _stem.second;
+// Starts monitoring a day directory of tree
+static monitored_day& open_day(monitored_tree& tree, const std::tm& date) {
+    auto day = std::make_unique<monitored_day>();
+    day->date = date;
+    day->path = tree.basePath;
+    day->path /= get_date_path(date);
+    day->coordination = std::make_unique<coordinator>(tree.basePath, get_option(tree.options, "instance"));
+    day->coordination->switch_directory(day->path);
+    day->discovery.include_finished(has_option(tree.options, "backfill"));
+
+    tree.days.push_back(std::move(day));
+    return tree.current();
+}
 
-            if (headerFiles.find(stem) != headerFiles.end() &&
-                payloadFiles.find(stem) != payloadFiles.end()) {
-                // We have a pair of header and payload files
-                std::tuple<std::string, fs::path, std::string, std::string> entry =
-                    std::make_tuple(stem, path, headerFiles[stem], payloadFiles[stem]);
+// Find new pairs in day directory, and claim those that are ours
+static void scan_day(monitored_tree& tree, monitored_day& day, std::vector<running_processor>& running) {
+    coordinator& coordination = *day.coordination;
 
-                // Check if the entry already exists in the existing map
-                if (existingFiles.find(stem) == existingFiles.end()) {
-                    // New entry, add it to both the newEntries and the existingFiles map
-                    newEntries[stem] = entry;
-                    existingFiles[stem] = entry;
-                }
+    if (coordination.heartbeat()) {
+        if (&day == &tree.current()) {
+            std::string members;
+            for (const std::string& member : coordination.members()) {
+                members += members.empty() ? member : ", " + member;
+            }
+            ZLOG(info) << "Instances sharing " << tree.basePath << ": " << members << std::endl;
+        }
+
+        // Hand over pairs that now belong to others
+        for (auto& processor : running) {
+            if (processor.unit.day == &day && !processor.preempting && !coordination.owns(processor.unit.stem)) {
+                ZLOG(info) << "Handing over " << processor.unit.stem << " (processor " << processor_name(processor.unit) << ")" << std::endl;
+                ::kill(processor.pid, SIGTERM);
+                processor.preempting = true;
+            }
+        }
+        for (auto pit = tree.pending.begin(); pit != tree.pending.end();) {
+            if (pit->day != &day || coordination.owns(pit->stem)) {
+                ++pit;
             } else {
-                BOOST_LOG_TRIVIAL(error) << ".header and .payload files do not match for " << stem << std::endl;
+                coordination.release(pit->stem);
+                day.deferred[pit->stem] = *pit;
+                pit = tree.pending.erase(pit);
             }
         }
+    }
+
+    // Processors must stop if their leases were taken over (e.g. if we were stalled)
+    for (const std::string& stem : coordination.renew()) {
+        for (auto& processor : running) {
+            if (processor.unit.day == &day && processor.unit.stem == stem && !processor.preempting) {
+                ::kill(processor.pid, SIGTERM);
+                processor.preempting = true;
+            }
+        }
+    }
+
+    // Find new pairs of files in the day directory. Shard numbers are kept
+    // per stem (also across instances), so that a re-queued unit finds its state again.
+    std::vector<discovered_pair> untrackedUnits = day.discovery.scan(day.path);
+    if (!untrackedUnits.empty()) {
+        std::vector<std::string> stems;
+        stems.reserve(untrackedUnits.size());
+        for (const auto& untrackedUnit : untrackedUnits) {
+            stems.push_back(untrackedUnit.stem);
+        }
+        coordination.register_stems(stems);
+    }
+    for (auto& untrackedUnit : untrackedUnits) {
+        scheduled_unit unit;
+        unit.tree = &tree;
+        unit.day = &day;
+        unit.stem = untrackedUnit.stem;
+        unit.headerFile = untrackedUnit.headerFile;
+        unit.payloadFile = untrackedUnit.payloadFile;
+        unit.inSegment = untrackedUnit.inSegment;
+        unit.headerLength = untrackedUnit.headerLength;
+        unit.payloadLength = untrackedUnit.payloadLength;
+        unit.shard = coordination.shard_for(unit.stem);
+        day.deferred[unit.stem] = unit;
+
+        day.trackedUnits[unit.stem] = std::make_tuple(std::move(untrackedUnit.stem), day.path,
+                                                      std::move(untrackedUnit.headerFile), std::move(untrackedUnit.payloadFile));
+    }
+
+    // Claim pairs that are ours, and forget about pairs others have finished (which only
+    // matters when we are done ourselves)
+    const bool idle = day.running == 0
+        && std::none_of(tree.pending.begin(), tree.pending.end(), [&day](const scheduled_unit& u) { return u.day == &day; });
+    for (auto dit = day.deferred.begin(); dit != day.deferred.end();) {
+        lease_status status = coordination.owns(dit->first)
+            ? coordination.acquire(dit->first)
+            : (idle && coordination.finished(dit->first) ? lease_status::FINISHED : lease_status::HELD_BY_OTHER);
+
+        if (status == lease_status::ACQUIRED) {
+            tree.pending.push_back(dit->second);
+            dit = day.deferred.erase(dit);
+        } else if (status == lease_status::FINISHED) {
+            dit = day.deferred.erase(dit);
+        } else {
+            ++dit;
+        }
+    }
+}
+
+// Previous day has drained, i.e. its processors have ended. Merge and compact what it produced
+static void wrap_up_day(monitored_tree& tree, const monitored_day& day) {
+    std::string info = "\nProcessed log files in directory: ";
+    info += day.path.string();
+    info += "\n";
+
+    for (const auto& trackedUnit : day.trackedUnits) {
+        // 'entry' is pairs of stem and tuples from the 'trackedFiles' map.
+        const std::string& headerFile = std::get<2>(trackedUnit.second);
+        const std::string& payloadFile = std::get<3>(trackedUnit.second);
+
+        info += "   ";
+        info += headerFile + " & ";
+        info += payloadFile;
+        info += "\n";
+    }
+    ZLOG(info) << info << std::endl;
+
+    if (has_option(tree.options, "group-by")) {
+        merge_aggregates(day.path, get_option(tree.options, "aggregates"));
+    }
+    if (has_option(tree.options, "compact")) {
+        if (tree.compaction.joinable()) {
+            tree.compaction.join();
+        }
+        tree.compaction = std::thread(compact_when_done, day.path, std::cref(tree.options));
+    }
+}
+
+// Find new pairs in tree. At rollover, pairs of the new day are picked up right away, while
+// processors of the previous day drain
+static void scan_tree(monitored_tree& tree, std::vector<running_processor>& running, std::chrono::steady_clock::time_point now, bool rollover) {
+    if (rollover && differs_from_today(tree.current().date)) {
+        const fs::path previous = tree.current().path;
+        const unsigned long draining = tree.current().running;
+        monitored_day& day = open_day(tree, today());
+
+        ZLOG(info) << "Detected day rollover. Switching to new directory: " << day.path << ", while "
+                   << draining << " processors drain " << previous << std::endl;
+    }
+
+    for (auto& day : tree.days) {
+        scan_day(tree, *day, running);
+    }
+
+    // Days before the current one are done when their processors have ended
+    for (auto dit = tree.days.begin(); dit != tree.days.end() - 1;) {
+        monitored_day* day = dit->get();
+        if (day->running > 0 || std::any_of(tree.pending.begin(), tree.pending.end(), [day](const scheduled_unit& u) { return u.day == day; })) {
+            ++dit;
+            continue;
+        }
+        wrap_up_day(tree, *day);
+        day->coordination->switch_directory(fs::path()); // releases what is left
+        dit = tree.days.erase(dit);
+    }
+
+    // Furthest behind goes first. There may be very many waiting units, so only a first few new ones
+    // are estimated per scan, and all of them now and then
+    if (now - tree.lastBacklogRefresh >= SCHEDULER_BACKLOG_REFRESH) {
+        tree.lastBacklogRefresh = now;
+        for (auto& unit : tree.pending) {
+            estimate_backlog(unit);
+        }
     } else {
-        BOOST_LOG_TRIVIAL(error) << "Directory does not exist or is not accessible: " << dirPath << std::endl;
+        std::size_t estimates = 0;
+        for (auto uit = tree.pending.begin(); uit != tree.pending.end() && estimates < SCHEDULER_BACKLOG_ESTIMATES; ++uit) {
+            if (!uit->backlogKnown) {
+                estimate_backlog(*uit);
+                ++estimates;
+            }
+        }
     }
 
-    // Return the delta map (only new entries)
-    return newEntries;
+    // Units not yet estimated go after those known to be behind, but before those known to be caught up
+    auto rank = [](const scheduled_unit& u) { return !u.backlogKnown ? 1 : (u.backlog > 0 ? 0 : 2); };
+    std::stable_sort(tree.pending.begin(), tree.pending.end(), [&rank](const scheduled_unit& a, const scheduled_unit& b) {
+        return rank(a) != rank(b) ? rank(a) < rank(b) : a.backlog > b.backlog;
+    });
 }
 
-// Function to process files and monitor rollover
-int monitor_directory(const fs::path& myself, const std::string& basePath, const std::string& dateStr) {
-    // Set up file logging
-    logging::add_file_log(
-        keywords::file_name = "monitor_%N.log",
-        keywords::open_mode = std::ios_base::app,    // Open in append mode
-        keywords::rotation_size = 10 * 1024 * 1024,  // Rotate after 10 MB
-        keywords::format = "[%TimeStamp%] [%Severity%] %Message%",
-        keywords::auto_flush = true  // Flush to file after each log message
-    );
-
-    logging::add_common_attributes();
+// If shards with backlog are waiting (in any tree), make room by preempting processors that are just tailing
+static void make_room(const tree_list& trees, std::vector<running_processor>& running, unsigned long maxProcessors, std::chrono::steady_clock::time_point now) {
+    if (running.size() < maxProcessors) {
+        return;
+    }
+    std::size_t waiting = 0;
+    for (const auto& tree : trees) {
+        waiting += std::count_if(tree->pending.begin(), tree->pending.end(), [](const scheduled_unit& u) { return !u.backlogKnown || u.backlog > 0; });
+    }
+    for (auto& processor : running) {
+        if (waiting == 0) {
+            break;
+        }
+        // Processors of a previous day (draining) need no grace, being at the end of their day anyway
+        const bool draining = processor.unit.day != &processor.unit.tree->current();
+        if (processor.preempting || (!draining && now - processor.started < SCHEDULER_PREEMPTION_GRACE)) {
+            continue;
+        }
+        estimate_backlog(processor.unit);
+        if (processor.unit.backlog == 0) {
+            ZLOG(debug) << "Preempting idle processor " << processor_name(processor.unit) << " (pid=" << processor.pid << ")" << std::endl;
+            ::kill(processor.pid, SIGTERM);
+            processor.preempting = true;
+            --waiting;
+        }
+    }
+}
+
+// Tree to launch a processor for next: of those with pairs waiting (and room for more processors),
+// the one running fewest processors for its weight -- or, when even, the one furthest behind
+static monitored_tree* next_tree(const tree_list& trees) {
+    monitored_tree* next = nullptr;
+    for (const auto& tree : trees) {
+        if (tree->pending.empty() || tree->running >= tree->maxProcessors) {
+            continue;
+        }
+        if (next == nullptr) {
+            next = tree.get();
+            continue;
+        }
+        const unsigned long long share = static_cast<unsigned long long>(tree->running) * next->weight;
+        const unsigned long long nextShare = static_cast<unsigned long long>(next->running) * tree->weight;
+        if (share < nextShare || (share == nextShare && tree->pending.front().backlog > next->pending.front().backlog)) {
+            next = tree.get();
+        }
+    }
+    return next;
+}
+
+static void report_tenant(const monitored_tree& tree) {
+    const tenant_metrics& metrics = tree.metrics;
+    ZLOG(info) << "Tenant " << tree.tenant << ": " << tree.running << " processors running and " << tree.pending.size()
+               << " pairs waiting; " << metrics.launched << " processors launched, " << metrics.finished << " finished ("
+               << metrics.entries << " entries), " << metrics.preempted << " preempted, " << metrics.retried << " retried and "
+               << metrics.failed << " failed, using " << std::chrono::duration_cast<std::chrono::seconds>(metrics.processorTime).count()
+               << " processor seconds" << std::endl;
+}
+
+// Nothing is running and nothing is waiting in tree. Wraps up when done with the day
+// given (returning true)
+static bool when_idle(monitored_tree& tree, const std::string& dateStr) {
+    monitored_day& day = tree.current();
+    if (day.trackedUnits.empty() && day.discovery.segments() == 0) {
+        ZLOG_RATE_LIMITED(error, LOG_RATE_LIMIT_INTERVAL) << "No matching .header and .payload pairs found in directory: " << day.path << std::endl;
+    }
+
+    // Without a date, processors have ended (e.g. since writer sealed their pairs) before
+    // end of day, and we keep looking for new pairs. Rollover is handled by scan_tree
+    if (dateStr.empty() || !day.deferred.empty()) {
+        return false;
+    }
+
+    // ...and pairs handled by other instances are finished as well
+    if (has_option(tree.options, "group-by")) {
+        merge_aggregates(day.path, get_option(tree.options, "aggregates"));
+    }
+    if (has_option(tree.options, "compact")) {
+        compact_when_done(day.path, tree.options);
+    }
+    day.coordination->leave();
+    if (!tree.tenant.empty()) {
+        ZLOG(info) << "Done with " << day.path << " of tenant " << tree.tenant << std::endl;
+    }
+    return true;
+}
+
+// Monitors one or more base directories, sharing processor slots (and pool) between them
+static int monitor_trees(const fs::path& myself, const std::vector<tenant_config>& configs, const std::string& dateStr, const option_map& options) {
+    // Set up file logging (asynchronous, so that we do not wait for the log file on the hot path)
+    init_file_log("monitor_%N.log");
 
     // Details for spawning child processes, later on
     std::vector<fs::path> location;
@@ -134,192 +566,306 @@ int monitor_directory(const fs::path& myself, const std::string& basePath, const
         date = string_to_tm(dateStr, DATE_FORMAT);
     }
 
-    BOOST_LOG_TRIVIAL(debug) << "Will instantiate sub-processes using executable: " << myself << std::endl;
+    // Number of concurrent processors, and where they run
+    const unsigned long maxProcessors = std::max(1UL, get_numeric_option(options, "max-processors", std::max(1U, std::thread::hardware_concurrency())));
+    cpu_allocator cpus(parse_pin_mode(get_option(options, "pin")));
 
-    // Determine path to log files
-    fs::path currentPath = basePath;
-    currentPath /= get_date_path(date);
+    // Processors may be pre-forked, rather than exec'ed per pair
+    std::unique_ptr<worker_pool> pool;
+    if (has_option(options, "pool")) {
+        pool = std::make_unique<worker_pool>(bp::search_path(executable, location), get_numeric_option(options, "pool", maxProcessors), options);
+    }
 
-    pair_map trackedUnits;
+    ZLOG(debug) << "Will instantiate sub-processes using executable: " << myself << std::endl;
+    ZLOG(info) << "Running at most " << maxProcessors << " processors at a time" << std::endl;
+
+    tree_list trees;
+    for (const tenant_config& config : configs) {
+        auto tree = std::make_unique<monitored_tree>();
+        tree->tenant = config.name;
+        tree->basePath = config.basePath;
+        tree->options = config.options;
+        tree->options.erase("tenants");
+
+        if (!tree->tenant.empty()) {
+            // Processors log to files of their own, and batches of all tenants go to the one
+            // outbox (unless given one of their own)
+            tree->options["tenant"] = tree->tenant;
+            if (has_option(options, "outbox") && get_option(tree->options, "outbox") == get_option(options, "outbox")) {
+                tree->options["outbox"] = (fs::path(get_option(options, "outbox")) / tree->tenant).string();
+            }
+        }
+        tree->weight = std::max(1UL, get_numeric_option(tree->options, "weight", 1));
+        tree->maxProcessors = std::clamp(get_numeric_option(tree->options, "max-processors", maxProcessors), 1UL, maxProcessors);
+        tree->lastBacklogRefresh = std::chrono::steady_clock::now(); // not all at once, before first launch
+
+        // Memory quota of tree is split between its processors
+        if (has_option(tree->options, "memory-quota")) {
+            unsigned long perProcessor = get_numeric_option(tree->options, "memory-quota", 0) / tree->maxProcessors;
+            if (has_option(tree->options, "max-memory")) {
+                perProcessor = std::min(perProcessor, get_numeric_option(tree->options, "max-memory", perProcessor));
+            }
+            if (perProcessor < 2 * IO_DIRECT_ALIGNMENT * 16) {
+                throw std::invalid_argument("--memory-quota of " + tree->basePath + " is too small for "
+                                            + std::to_string(tree->maxProcessors) + " processors");
+            }
+            tree->options["max-memory"] = std::to_string(perProcessor);
+        }
+
+        // Group-by aggregation is done by the processors, but merged here. Validate early on
+        if (has_option(tree->options, "group-by")) {
+            aggregate_table validation(get_option(tree->options, "group-by"));
+            parse_aggregate_names(get_option(tree->options, "aggregates"));
+        }
+
+        // Other monitors may share this base directory, in which case pairs are split between us
+        monitored_day& day = open_day(*tree, date);
+        if (!day.coordination->standalone()) {
+            ZLOG(info) << "Running as instance " << day.coordination->instance() << " of " << tree->basePath << std::endl;
+        }
+
+        if (tree->tenant.empty()) {
+            ZLOG(info) << "Monitoring directory: " << day.path << std::endl;
+        } else {
+            ZLOG(info) << "Monitoring directory: " << day.path << " of tenant " << tree->tenant << " (weight "
+                       << tree->weight << ", at most " << tree->maxProcessors << " processors)" << std::endl;
+        }
+        trees.push_back(std::move(tree));
+    }
+    const bool tenants = !trees.front()->tenant.empty();
+
+    std::vector<running_processor> running;
+    std::chrono::steady_clock::time_point lastScan{};
+    std::chrono::steady_clock::time_point lastReport = std::chrono::steady_clock::now();
 
     // Identify log files and spawn child processes for processing header and payload pairs
     while (true) {
-        BOOST_LOG_TRIVIAL(info) << "Monitoring directory: " << currentPath << std::endl;
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastScan >= SCHEDULER_SCAN_INTERVAL) {
+            lastScan = now;
 
-        // Find pairs of files in the current directory
-        auto untrackedUnits = find_pairs(currentPath, trackedUnits);
-        if (untrackedUnits.empty()) {
-            BOOST_LOG_TRIVIAL(error) << "No matching .header and .payload pairs found in directory: " << currentPath << std::endl;
-        } else {
-            // Launch a child process for each pair of files
-            std::vector<
-                std::tuple<std::shared_ptr<bp::child>, std::shared_ptr<bp::ipstream>, unsigned int /* shard */, std::string /* stem */>
-            > children;
-            {
-                unsigned int shard = 0;
-                for (const auto& untrackedUnit : untrackedUnits) {
-                    // 'untrackedUnit' is pairs of stem and tuples from the 'untrackedUnits' map.
-                    const std::string& stem = std::get<0>(untrackedUnit.second);
-                    const fs::path& path = std::get<1>(untrackedUnit.second);
-                    const std::string& headerFile = std::get<2>(untrackedUnit.second);
-                    const std::string& payloadFile = std::get<3>(untrackedUnit.second);
-
-                    // Pipe for capturing stdout of child process
-                    auto pipe_stream = std::make_shared<bp::ipstream>();
-
-                    // Launch a new child process with stdout redirected to pipe_stream
-                    try {
-                        std::shared_ptr<bp::child> child = std::make_shared<bp::child>(
-                            bp::search_path(executable, location),
-                            "-p",
-                            std::to_string(++shard),
-                            basePath,
-                            tm_to_string(date, DATE_FORMAT),
-                            headerFile,
-                            payloadFile,
-                            bp::std_out > *pipe_stream  // redirect stdout to pipe_stream
-                        );
-                        children.emplace_back(child, pipe_stream, shard, stem);
-
-                        BOOST_LOG_TRIVIAL(info)
-                        << "Processor #" << shard << " (pid=" << child->id() << ") handles "
-                        << headerFile << " and "
-                        << payloadFile
-                        << std::endl;
-                    }
-                    catch (const boost::process::v1::process_error& e) {
-                        BOOST_LOG_TRIVIAL(error) << "Failed to spawn child process: " << e.what() << std::endl;
-                    }
+            for (auto& tree : trees) {
+                if (!tree->done) {
+                    scan_tree(*tree, running, now, dateStr.empty());
                 }
             }
+            make_room(trees, running, maxProcessors, now);
 
-            // Wait for all child processes to finish
-            while (!children.empty()) {
-                for (auto cit = children.begin(); cit != children.end();) {
-                    std::shared_ptr<bp::child> child = std::get<0>(*cit);
-                    std::shared_ptr<bp::ipstream> pipe_stream = std::get<1>(*cit);
-                    unsigned int shard = std::get<2>(*cit);
-                    std::string stem = std::get<3>(*cit);
-
-                    if (child->running()) {
-                        std::string line;
-                        // Read from the child's stdout (non-blocking). Note that if we read while
-                        // the process is running, we will not be able to read anything when the
-                        // child has exited. We accept that, since we want to be able to pick up
-                        // possible reports from the child process as they arrive.
-                        if (pipe_stream && std::getline(*pipe_stream, line) && !line.empty()) {
-                            BOOST_LOG_TRIVIAL(info) << "Processor #" << shard << " (pid=" << child->id() << ") reports: " << line;
-                        }
-                        ++cit; // since we are iterating manually (to accommodate the erase (below))
-                    } else {
-                        child->wait();
-
-                        // Read from the child's stdout (non-blocking). Note that this picks
-                        // up data from stdout that has not already been read (above). Anyhow,
-                        // the child process log entry is duly identified so we will be able to
-                        // piece together what happened.
-                        std::string line;
-                        if (pipe_stream)
-                            std::getline(*pipe_stream, line);
-
-                        int exitCode = child->exit_code();
-
-                        if (exitCode > FILE_READ_RELATED_ERRORS) {
-                            // 101: Error opening header file
-                            // 102: Error opening payload file
-                            //
-                            std::string info = "Processor #";
-                            info += std::to_string(shard);
-                            info += " (pid=";
-                            info += std::to_string(child->id());
-                            info += ") could not load ";
-                            if (exitCode == STATUS_COULD_NOT_OPEN_HEADER_FILE) {
-                                info += "header file ";
-                                info += stem + ".header";
-                            } else if (exitCode == STATUS_COULD_NOT_OPEN_PAYLOAD_FILE) {
-                                info += "payload file ";
-                                info += stem + ".payload";
-                            } else {
-                                info += "some file??";
-                            }
-                            if (!line.empty()) {
-                                info += ". It reports: " + line;
-                            }
-
-                            // Remove this header and payload file pair from 'trackedUnits', and they will
-                            // be picked up again in a little while.
-                            //
-                            auto tuit = trackedUnits.find(stem);
-                            if (tuit != trackedUnits.end()) {
-                                trackedUnits.erase(tuit);
-                                BOOST_LOG_TRIVIAL(info) << info << " -- Retrying later" << std::endl;
-                            } else {
-                                BOOST_LOG_TRIVIAL(error) << info << " -- Failed to locate unit among tracked units!" << std::endl;
-                            }
-                        } else if (exitCode == STATUS_ENDED_UNSUCCESSFULLY) {
-                            std::string info = "Processor #";
-                            info += std::to_string(shard);
-                            info += " (pid=";
-                            info += std::to_string(child->id());
-                            info += ") could not process all headers in file ";
-                            info += stem + ".header. ";
-                            if (!line.empty()) {
-                                info += ". It reports: " + line;
-                            }
-                            BOOST_LOG_TRIVIAL(error) << info << std::endl;
-
-                        } else if (exitCode == 0) {
-                            BOOST_LOG_TRIVIAL(info) << "Processor #" << shard << " (pid=" << child->id() << ") finished gracefully with report: " << line << std::endl;
-                        } else {
-                            BOOST_LOG_TRIVIAL(info) << "Processor #" << shard << " (pid=" << child->id() << ") reports error (" << exitCode << "): " << line << std::endl;
-                        }
-
-                        cit = children.erase(cit);
-                    }
+            if (tenants && now - lastReport >= SCHEDULER_TENANT_REPORT) {
+                lastReport = now;
+                for (const auto& tree : trees) {
+                    report_tenant(*tree);
                 }
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
             }
         }
 
-        if (dateStr.empty()) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-            // Check if we have rolled over to the next day
-            if (differs_from_today(date)) {
-                BOOST_LOG_TRIVIAL(info) << "Detected day rollover" << std::endl;
+        // Launch processors, as long as there is room for them
+        if (pool) {
+            pool->accept_workers();
+        }
+        while (running.size() < maxProcessors && (!pool || pool->available())) {
+            monitored_tree* tree = next_tree(trees);
+            if (tree == nullptr) {
+                break;
+            }
+            scheduled_unit unit = tree->pending.front();
+            tree->pending.erase(tree->pending.begin());
+            if (!unit.backlogKnown) {
+                estimate_backlog(unit);
+            }
 
-                std::string info = "\nProcessed log files in directory: ";
-                info += currentPath.string();
-                info += "\n";
+            running_processor processor;
+            processor.unit = unit;
+            processor.started = now;
+
+            std::vector<std::string> args = {
+                "-p",
+                std::to_string(unit.shard),
+                tree->basePath,
+                tm_to_string(unit.day->date, DATE_FORMAT),
+                unit.headerFile,
+                unit.payloadFile
+            };
+            for (const std::string& option : format_options(tree->options)) {
+                args.push_back(option);
+            }
+            std::vector<int> placement;
+            processor.cpuSlot = cpus.acquire(placement);
+            if (processor.cpuSlot >= 0) {
+                args.push_back("--cpus=" + format_cpu_list(placement));
+            }
 
-                for (const auto& trackedUnit : trackedUnits) {
-                    // 'entry' is pairs of stem and tuples from the 'trackedFiles' map.
-                    const std::string& headerFile = std::get<2>(trackedUnit.second);
-                    const std::string& payloadFile = std::get<3>(trackedUnit.second);
+            try {
+                if (pool) {
+                    // Hand over to a warm worker, which reports back over its connection
+                    processor.worker = pool->assign(args);
+                    processor.pid = processor.worker.pid;
+                    processor.outputFd = processor.worker.fd;
+                } else {
+                    // Launch a new child process with stdout redirected to pipe
+                    processor.pipe = std::make_shared<bp::pipe>();  // for capturing stdout of child process
+                    processor.child = std::make_shared<bp::child>(
+                        bp::search_path(executable, location),
+                        bp::args(args),
+                        bp::std_out > *processor.pipe  // redirect stdout to pipe
+                    );
+                    processor.pid = processor.child->id();
+                    processor.outputFd = processor.pipe->native_source();
+                }
+                ZLOG_PROBE2(child_spawned, unit.shard, processor.pid);
+
+                ZLOG(info)
+                << "Processor " << processor_name(unit) << " (pid=" << processor.pid << ") handles "
+                << unit.headerFile << " and "
+                << unit.payloadFile
+                << " (backlog " << unit.backlog << " bytes)"
+                << std::endl;
+
+                running.push_back(std::move(processor));
+                ++tree->running;
+                ++unit.day->running;
+                ++tree->metrics.launched;
+            }
+            catch (const std::exception& e) {
+                ZLOG(error) << "Failed to spawn child process: " << e.what() << std::endl;
+                cpus.release(processor.cpuSlot);
+                tree->pending.push_back(unit);
+                break; // try again later
+            }
+        }
 
-                    info += "   ";
-                    info += headerFile + " & ";
-                    info += payloadFile;
-                    info += "\n";
+        // Pick up reports from processors, and collect the ones that have ended
+        bool slotsFreed = false;
+        for (auto rit = running.begin(); rit != running.end();) {
+            running_processor& processor = *rit;
+
+            // Pick up possible reports from the processor as they arrive. The last line is the final
+            // report, while lines before that are ordinary reports
+            const bool exited = processor.child && !processor.child->running();
+            bool ended = false;
+            int exitCode = STATUS_GENERAL_FAILURE;
+
+            for (const std::string& line : collect_output(processor, exited)) {
+                if (processor.worker.fd >= 0 && parse_exit_line(line, exitCode)) {
+                    ended = true;
+                    break;
+                }
+                if (!processor.lastLine.empty()) {
+                    ZLOG(info) << "Processor " << processor_name(processor.unit) << " (pid=" << processor.pid << ") reports: " << processor.lastLine;
                 }
-                BOOST_LOG_TRIVIAL(info) << info << std::endl;
+                processor.lastLine = line;
+            }
 
-                date = today();
-                currentPath = basePath;
-                currentPath /= get_date_path(date);
+            if (exited) {
+                processor.child->wait();
+                exitCode = processor.child->exit_code();
+                ended = true;
+            } else if (processor.worker.fd >= 0) {
+                if (ended) {
+                    pool->give_back(processor.worker);
+                } else if (processor.eof) {
+                    // Worker died in the middle of things. If asked to stop, it may have been before
+                    // it could handle SIGTERM, and state is saved per entry, so the pair is re-queued
+                    ended = true;
+                    exitCode = processor.preempting ? STATUS_PREEMPTED : STATUS_GENERAL_FAILURE;
+                    pool->discard(processor.worker);
+                }
+            }
+            if (!ended) {
+                ++rit; // since we are iterating manually (to accommodate the erase (below))
+                continue;
+            }
+            const std::string line = processor.lastLine;
+            ZLOG_PROBE3(child_reaped, processor.unit.shard, processor.pid, exitCode);
+
+            monitored_tree& tree = *processor.unit.tree;
+            monitored_day& day = *processor.unit.day;
+            coordinator& coordination = *day.coordination;
+            --tree.running;
+            --day.running;
+            tree.metrics.processorTime += now - processor.started;
+
+            if (report_exit(processor, exitCode, line)) {
+                if (exitCode == STATUS_PREEMPTED) {
+                    ++tree.metrics.preempted;
+                    if (coordination.owns(processor.unit.stem)) {
+                        tree.pending.push_back(processor.unit);
+                    } else {
+                        coordination.release(processor.unit.stem);
+                        day.deferred[processor.unit.stem] = processor.unit;
+                    }
+                } else {
+                    ++tree.metrics.retried;
+                    coordination.release(processor.unit.stem);
+
+                    // Remove this header and payload file pair from 'trackedUnits', and they will
+                    // be picked up again in a little while.
+                    //
+                    auto tuit = day.trackedUnits.find(processor.unit.stem);
+                    if (tuit != day.trackedUnits.end()) {
+                        day.trackedUnits.erase(tuit);
+                        day.discovery.forget(processor.unit.stem);
+                    } else {
+                        ZLOG(error) << "Failed to locate unit " << processor.unit.stem << " among tracked units!" << std::endl;
+                    }
+                }
+            } else {
+                // Done with this pair, so no other instance should pick it up
+                coordination.release(processor.unit.stem, /* finished */ true);
+
+                unsigned long long entries = 0;
+                if (exitCode == STATUS_ENDED_SUCCESSFULLY) {
+                    ++tree.metrics.finished;
+                    if (std::sscanf(line.c_str(), "Processed %llu entries", &entries) == 1) {
+                        tree.metrics.entries += entries;
+                    }
+                } else {
+                    ++tree.metrics.failed;
+                }
+            }
 
-                trackedUnits.clear();
+            cpus.release(processor.cpuSlot);
+            rit = running.erase(rit);
+            slotsFreed = true;
+        }
 
-                BOOST_LOG_TRIVIAL(info) << "Switching to new directory: " << currentPath << std::endl;
-            } else {
-                BOOST_LOG_TRIVIAL(info) << "No day rollover detected, but child processes ended?" << std::endl;
-                BOOST_LOG_TRIVIAL(info) << "Set on " << tm_to_string(date, DATE_FORMAT)
-                << " and today is " << tm_to_string(today(), DATE_FORMAT) << std::endl;
-                std::this_thread::sleep_for(std::chrono::seconds(30));
+        // Trees where nothing is running and nothing is waiting
+        bool allDone = true;
+        for (auto& tree : trees) {
+            if (!tree->done && tree->running == 0 && tree->pending.empty() && now - lastScan < SCHEDULER_SCAN_INTERVAL) {
+                tree->done = when_idle(*tree, dateStr);
             }
-        } else {
-            BOOST_LOG_TRIVIAL(info) << "Ending" << std::endl;
+            allDone = allDone && tree->done;
+        }
+        if (allDone) {
+            if (tenants) {
+                for (const auto& tree : trees) {
+                    report_tenant(*tree);
+                }
+            }
+            ZLOG(info) << "Ending" << std::endl;
             return STATUS_ENDED_SUCCESSFULLY;
         }
+
+        bool waiting = false;
+        for (const auto& tree : trees) {
+            waiting = waiting || !tree->pending.empty();
+        }
+        if (!slotsFreed || !waiting) {
+            wait_for_activity(running, pool ? pool->listen_fd() : -1, std::chrono::milliseconds(100));
+        }
     }
 }
+
+// Function to process files and monitor rollover
+int monitor_directory(const fs::path& myself, const std::string& basePath, const std::string& dateStr, const option_map& options) {
+    tenant_config single;
+    single.basePath = basePath;
+    single.options = options;
+    return monitor_trees(myself, { single }, dateStr, options);
+}
+
+// Same, for several base directories (tenants) as given in 'tenantFile'
+int monitor_tenants(const fs::path& myself, const std::string& tenantFile, const std::string& dateStr, const option_map& options) {
+    return monitor_trees(myself, load_tenants(tenantFile, options), dateStr, options);
+}
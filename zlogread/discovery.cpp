@@ -0,0 +1,301 @@
+//
+// Discovery of header and payload pairs in day directories
+//
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <boost/log/trivial.hpp>
+
+#include "zlog.h"
+#include "logging.h"
+#include "discovery.h"
+#include "segment.h"
+
+namespace fs = boost::filesystem;
+
+#if defined(__APPLE__)
+#define st_mtim st_mtimespec
+#endif
+
+static constexpr std::string_view HEADER_SUFFIX = ".header";
+static constexpr std::string_view PAYLOAD_SUFFIX = ".payload";
+static constexpr std::string_view SEGMENT_FILE_SUFFIX = SEGMENT_SUFFIX;
+static constexpr std::string_view ARCHIVED_HEADER_SUFFIX = ".header" ARCHIVE_SUFFIX;
+static constexpr std::string_view ARCHIVED_PAYLOAD_SUFFIX = ".payload" ARCHIVE_SUFFIX;
+
+static bool operator==(const struct timespec& a, const struct timespec& b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Entries of unknown type (some file systems do not fill in d_type) and symbolic links must be stat'ed
+static bool is_regular(int dirFd, const char* name, unsigned char type) {
+    if (type == DT_REG) {
+        return true;
+    }
+    if (type != DT_UNKNOWN && type != DT_LNK) {
+        return false;
+    }
+    struct stat stat_buf;
+    return fstatat(dirFd, name, &stat_buf, 0) == 0 && S_ISREG(stat_buf.st_mode);
+}
+
+pair_discovery::slot* pair_discovery::find(std::string_view stem) {
+    if (slots.empty()) {
+        return nullptr;
+    }
+    const std::size_t mask = slots.size() - 1;
+    std::size_t idx = std::hash<std::string_view>{}(stem) & mask;
+    while (slots[idx].occupied) {
+        if (slots[idx].stem == stem) {
+            return &slots[idx];
+        }
+        idx = (idx + 1) & mask;
+    }
+    return nullptr;
+}
+
+pair_discovery::slot& pair_discovery::find_or_insert(std::string_view stem) {
+    if ((used + 1) * 10 > slots.size() * 7) { // keep load factor below 0.7
+        grow();
+    }
+
+    const std::size_t mask = slots.size() - 1;
+    std::size_t idx = std::hash<std::string_view>{}(stem) & mask;
+    while (slots[idx].occupied) {
+        if (slots[idx].stem == stem) {
+            return slots[idx];
+        }
+        idx = (idx + 1) & mask;
+    }
+    slots[idx].occupied = true;
+    slots[idx].stem = stem;
+    ++used;
+    return slots[idx];
+}
+
+void pair_discovery::grow() {
+    std::vector<slot> old;
+    old.swap(slots);
+    slots.resize(old.empty() ? 1024 : old.size() * 2);
+    used = 0;
+
+    for (slot& s : old) {
+        if (s.occupied) {
+            slot& moved = find_or_insert(s.stem);
+            moved = std::move(s); // with lengths of compacted pairs, not just flags
+        }
+    }
+}
+
+void pair_discovery::reset(const fs::path& dirPath) {
+    currentDir = dirPath;
+    slots.clear();
+    used = 0;
+    incompleteStems = 0;
+    segmentCount = 0;
+    retry.clear();
+    scanned = false;
+}
+
+void pair_discovery::forget(const std::string& stem) {
+    slot* s = find(stem);
+    if (s != nullptr && (s->flags & REPORTED)) {
+        s->flags &= ~REPORTED;
+        retry.push_back(stem);
+    }
+}
+
+discovered_pair pair_discovery::pair_of(const slot& s) {
+    discovered_pair pair;
+    pair.stem = s.stem;
+    pair.headerFile = s.stem + std::string(s.flags & HEADER_ARCHIVED ? ARCHIVED_HEADER_SUFFIX : HEADER_SUFFIX);
+    pair.payloadFile = s.stem + std::string(s.flags & PAYLOAD_ARCHIVED ? ARCHIVED_PAYLOAD_SUFFIX : PAYLOAD_SUFFIX);
+    pair.inSegment = (s.flags & COMPACTED) != 0;
+    pair.headerLength = s.headerLength;
+    pair.payloadLength = s.payloadLength;
+    return pair;
+}
+
+void pair_discovery::visit(int dirFd, const char* entryName, unsigned char type, std::vector<discovered_pair>& found) {
+    std::string_view name(entryName);
+    std::uint8_t kind;
+    std::uint8_t archived = 0;
+    std::string_view stem;
+    if (name.size() > HEADER_SUFFIX.size() && name.ends_with(HEADER_SUFFIX)) {
+        kind = HEADER;
+        stem = name.substr(0, name.size() - HEADER_SUFFIX.size());
+    } else if (name.size() > PAYLOAD_SUFFIX.size() && name.ends_with(PAYLOAD_SUFFIX)) {
+        kind = PAYLOAD;
+        stem = name.substr(0, name.size() - PAYLOAD_SUFFIX.size());
+    } else if (name.size() > ARCHIVED_HEADER_SUFFIX.size() && name.ends_with(ARCHIVED_HEADER_SUFFIX)) {
+        kind = HEADER;
+        archived = HEADER_ARCHIVED;
+        stem = name.substr(0, name.size() - ARCHIVED_HEADER_SUFFIX.size());
+    } else if (name.size() > ARCHIVED_PAYLOAD_SUFFIX.size() && name.ends_with(ARCHIVED_PAYLOAD_SUFFIX)) {
+        kind = PAYLOAD;
+        archived = PAYLOAD_ARCHIVED;
+        stem = name.substr(0, name.size() - ARCHIVED_PAYLOAD_SUFFIX.size());
+    } else if (name.size() > SEGMENT_FILE_SUFFIX.size() && name.ends_with(SEGMENT_FILE_SUFFIX)) {
+        slot* known = find(name); // segments are kept by file name, among stems
+        if ((known == nullptr || !(known->flags & SEGMENT)) && is_regular(dirFd, entryName, type)) {
+            visit_segment(entryName, found);
+        }
+        return;
+    } else {
+        return; // state files and such
+    }
+
+    // Known name? This is the common case on repeat scans, and costs a lookup only
+    slot* known = find(stem);
+    if (known != nullptr && (known->flags & kind)) {
+        return;
+    }
+    if (!is_regular(dirFd, entryName, type)) {
+        return;
+    }
+
+    slot& s = known != nullptr ? *known : find_or_insert(stem);
+    const bool wasIncomplete = s.flags & (HEADER | PAYLOAD);
+    s.flags |= kind | archived;
+
+    if ((s.flags & (HEADER | PAYLOAD)) == (HEADER | PAYLOAD)) {
+        if (wasIncomplete) {
+            --incompleteStems;
+        }
+        s.flags |= REPORTED;
+        found.push_back(pair_of(s));
+    } else {
+        ++incompleteStems;
+    }
+}
+
+void pair_discovery::visit_segment(const char* entryName, std::vector<discovered_pair>& found) {
+    find_or_insert(entryName).flags |= SEGMENT;
+    ++segmentCount;
+    try {
+        segment_index index(currentDir / entryName);
+        for (const segment_pair& pair : index.pairs()) {
+            if (pair.finished && !includeFinished) {
+                continue;
+            }
+            // Files of pair may have been seen before compaction removed them
+            slot& s = find_or_insert(pair.stem);
+            if (s.flags & REPORTED) {
+                continue;
+            }
+            if ((s.flags & (HEADER | PAYLOAD)) != 0 && (s.flags & (HEADER | PAYLOAD)) != (HEADER | PAYLOAD)) {
+                --incompleteStems;
+            }
+            s.flags |= HEADER | PAYLOAD | REPORTED | COMPACTED;
+            s.headerLength = pair.headerLength;
+            s.payloadLength = pair.payloadLength;
+            found.push_back(pair_of(s));
+        }
+    } catch (const std::exception& e) {
+        ZLOG(error) << "Could not read segment " << entryName << " in " << currentDir << ": " << e.what() << std::endl;
+    }
+}
+
+std::vector<discovered_pair> pair_discovery::scan(const fs::path& dirPath) {
+    std::vector<discovered_pair> found;
+    if (dirPath != currentDir) {
+        reset(dirPath);
+    }
+    entriesRead = 0;
+
+    // Pairs to retry are reported whether directory has changed or not
+    for (const std::string& stem : retry) {
+        slot* s = find(stem);
+        if (s != nullptr && !(s->flags & REPORTED)) {
+            s->flags |= REPORTED;
+            found.push_back(pair_of(*s));
+        }
+    }
+    retry.clear();
+
+    int dirFd = ::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        ZLOG_RATE_LIMITED(error, LOG_RATE_LIMIT_INTERVAL) << "Directory does not exist or is not accessible: " << dirPath << std::endl;
+        return found;
+    }
+
+    struct timespec scanStarted;
+    clock_gettime(CLOCK_REALTIME, &scanStarted);
+
+    // A directory is unchanged if its modification time is the same as last time -- but since time stamps
+    // are coarse, only if it was modified well before last scan started
+    struct stat stat_buf;
+    if (fstat(dirFd, &stat_buf) == 0) {
+        if (scanned && stat_buf.st_mtim == lastModified
+            && lastScanned.tv_sec - lastModified.tv_sec >= DISCOVERY_MTIME_MARGIN) {
+            ::close(dirFd);
+            return found;
+        }
+        lastModified = stat_buf.st_mtim;
+    } else {
+        lastModified = {};
+    }
+
+#if defined(__linux__) && defined(SYS_getdents64)
+    // Entries as laid out by getdents64(2). Read in big batches, since directories may be huge
+    struct linux_dirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    buffer.resize(DISCOVERY_BUFFER_SIZE);
+
+    while (true) {
+        long n = syscall(SYS_getdents64, dirFd, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ZLOG(error) << "Failed to read directory " << dirPath << ": " << strerror(errno) << std::endl;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (long pos = 0; pos < n;) {
+            auto* entry = reinterpret_cast<linux_dirent64*>(buffer.data() + pos);
+            pos += entry->d_reclen;
+            ++entriesRead;
+
+            visit(dirFd, entry->d_name, entry->d_type, found);
+        }
+    }
+    ::close(dirFd);
+#else
+    DIR* dir = fdopendir(dirFd);
+    if (dir == nullptr) {
+        ::close(dirFd);
+        return found;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        ++entriesRead;
+        visit(dirfd(dir), entry->d_name, entry->d_type, found);
+    }
+    closedir(dir);
+#endif
+
+    scanned = true;
+    lastScanned = scanStarted;
+
+    if (incompleteStems > 0) {
+        ZLOG_RATE_LIMITED(error, LOG_RATE_LIMIT_INTERVAL) << incompleteStems << " .header and .payload files do not match in " << dirPath << std::endl;
+    }
+    return found;
+}
@@ -0,0 +1,91 @@
+//
+// Discovery of header and payload pairs in (possibly very large) day directories.
+//
+// Directory entries are read in big batches (getdents64 on Linux) and classified by
+// d_type, so that no file needs to be stat'ed. Stems are kept in a flat hash index
+// between scans, so that repeat scans only do work for names not seen before -- and
+// a directory that has not changed since last scan is not read at all.
+//
+// Archived pairs (<stem>.header.zst and <stem>.payload.zst, see seekable.h) are reported by
+// those names. Pairs of compacted days are found in the indexes of segments (see segment.h),
+// and reported as if their files were still there -- unless processed before compaction.
+//
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+struct discovered_pair {
+    std::string stem;
+    std::string headerFile;
+    std::string payloadFile;
+
+    // Pairs compacted into a segment have no files of their own, but lengths in the segment
+    bool inSegment = false;
+    std::uint64_t headerLength = 0;
+    std::uint64_t payloadLength = 0;
+};
+
+class pair_discovery {
+public:
+    // Complete pairs in 'dirPath' not reported before. Switching directory starts over
+    std::vector<discovered_pair> scan(const boost::filesystem::path& dirPath);
+
+    // Have pair reported again by next scan (e.g. to retry it)
+    void forget(const std::string& stem);
+
+    // Also report pairs in segments that were processed before compaction (e.g. for backfill)
+    void include_finished(bool include) { includeFinished = include; }
+
+    std::size_t stems() const { return used; }
+    std::size_t segments() const { return segmentCount; }
+    std::size_t incomplete() const { return incompleteStems; }
+
+    // Directory entries read by last scan (0 if directory was unchanged and not read)
+    std::size_t entries_read() const { return entriesRead; }
+
+private:
+    enum : std::uint8_t { HEADER = 1, PAYLOAD = 2, REPORTED = 4, SEGMENT = 8, HEADER_ARCHIVED = 16, PAYLOAD_ARCHIVED = 32, COMPACTED = 64 };
+
+    struct slot {
+        std::string stem;
+        std::uint64_t headerLength = 0;  // in segment, if COMPACTED
+        std::uint64_t payloadLength = 0;
+        std::uint8_t flags = 0;
+        bool occupied = false;
+    };
+
+    slot& find_or_insert(std::string_view stem);
+    slot* find(std::string_view stem);
+    void grow();
+    static discovered_pair pair_of(const slot& s);
+    void reset(const boost::filesystem::path& dirPath);
+
+    // Classifies one directory entry, possibly completing a pair
+    void visit(int dirFd, const char* entryName, unsigned char type, std::vector<discovered_pair>& found);
+    void visit_segment(const char* entryName, std::vector<discovered_pair>& found);
+
+    boost::filesystem::path currentDir;
+    std::vector<slot> slots;
+    std::size_t used = 0;
+    std::size_t incompleteStems = 0;
+    std::size_t segmentCount = 0;
+    std::size_t entriesRead = 0;
+    std::vector<std::string> retry;
+    bool includeFinished = false;
+
+    bool scanned = false;
+    struct timespec lastModified = {};  // of directory, as of last scan
+    struct timespec lastScanned = {};   // when last scan started
+
+    std::vector<char> buffer; // for reading directory entries
+};
+
+#endif // DISCOVERY_H
@@ -0,0 +1,134 @@
+//
+// Header field predicates
+//
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <stdexcept>
+
+#include "zlog.h"
+#include "filter.h"
+
+static std::vector<std::string> split_on(const std::string& text, char delimiter) {
+    std::vector<std::string> result;
+    std::string::size_type start = 0;
+    while (true) {
+        std::string::size_type end = text.find(delimiter, start);
+        result.push_back(text.substr(start, end - start));
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    return result;
+}
+
+static bool parse_number(std::string_view text, long long& value) {
+    if (text.empty()) {
+        return false;
+    }
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return ec == std::errc() && ptr == text.data() + text.size();
+}
+
+header_filter::header_filter(const std::string& expression) : text(expression) {
+    for (const std::string& term : split_on(expression, '&')) {
+        if (term.empty()) {
+            continue;
+        }
+
+        // Leading field number
+        std::size_t pos = 0;
+        while (pos < term.size() && std::isdigit(static_cast<unsigned char>(term[pos]))) {
+            ++pos;
+        }
+        if (pos == 0 || pos == term.size()) {
+            throw std::invalid_argument("Filter clause must start with a field number and an operator: " + term);
+        }
+
+        clause c;
+        c.field = std::stoul(term.substr(0, pos));
+        if (c.field >= NUMBER_HEADER_FIELDS) {
+            throw std::invalid_argument("Filter refers to non-existing header field " + std::to_string(c.field) + ": " + term);
+        }
+
+        std::string operand;
+        if (term.compare(pos, 2, "^=") == 0) {
+            c.kind = op::PREFIX;
+            c.values.push_back(term.substr(pos + 2));
+
+        } else if (term[pos] == '=') {
+            operand = term.substr(pos + 1);
+            c.values = split_on(operand, '|');
+            c.kind = c.values.size() > 1 ? op::IN : op::EQUALS;
+            std::sort(c.values.begin(), c.values.end());
+
+        } else if (term[pos] == ':') {
+            operand = term.substr(pos + 1);
+            std::string::size_type dots = operand.find("..");
+            if (dots == std::string::npos) {
+                throw std::invalid_argument("Filter range must be on the form <low>..<high>: " + term);
+            }
+            c.kind = op::RANGE;
+            std::string_view low = std::string_view(operand).substr(0, dots);
+            std::string_view high = std::string_view(operand).substr(dots + 2);
+            if (!low.empty()) {
+                if (!parse_number(low, c.low)) {
+                    throw std::invalid_argument("Filter range has non-numeric lower bound: " + term);
+                }
+                c.hasLow = true;
+            }
+            if (!high.empty()) {
+                if (!parse_number(high, c.high)) {
+                    throw std::invalid_argument("Filter range has non-numeric upper bound: " + term);
+                }
+                c.hasHigh = true;
+            }
+        } else {
+            throw std::invalid_argument("Unknown filter operator in clause: " + term);
+        }
+
+        clauses.push_back(std::move(c));
+    }
+}
+
+bool header_filter::evaluate(const clause& c, std::string_view value) const {
+    switch (c.kind) {
+        case op::EQUALS:
+            return value == c.values.front();
+
+        case op::IN:
+            return std::binary_search(c.values.begin(), c.values.end(), value, std::less<>());
+
+        case op::PREFIX:
+            return value.starts_with(c.values.front());
+
+        case op::RANGE: {
+            long long number;
+            if (!parse_number(value, number)) {
+                return false;
+            }
+            return (!c.hasLow || number >= c.low) && (!c.hasHigh || number <= c.high);
+        }
+    }
+    return false;
+}
+
+bool header_filter::matches(const std::string_view* fields, std::size_t count) const {
+    for (const clause& c : clauses) {
+        if (c.field >= count || !evaluate(c, fields[c.field])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool header_filter::matches(const std::vector<std::string>& fields) const {
+    for (const clause& c : clauses) {
+        if (c.field >= fields.size() || !evaluate(c, fields[c.field])) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+//
+// Header field predicates, compiled once and evaluated on every parsed header
+// before any payload I/O takes place.
+//
+// Expression syntax (clauses are AND:ed together using '&'):
+//    3=Carrot            field 3 equals "Carrot"
+//    0=Apple|Fig|Grape   field 0 is one of the listed values
+//    5^=Gr               field 5 starts with "Gr"
+//    7:50..100           field 7 is numeric and 50 <= value <= 100 (either bound may be left out)
+//
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+class header_filter {
+public:
+    header_filter() = default;
+
+    // Throws std::invalid_argument if expression is malformed
+    explicit header_filter(const std::string& expression);
+
+    bool empty() const { return clauses.empty(); }
+
+    bool matches(const std::string_view* fields, std::size_t count) const;
+    bool matches(const std::vector<std::string>& fields) const;
+
+    const std::string& expression() const { return text; }
+
+private:
+    enum class op { EQUALS, IN, PREFIX, RANGE };
+
+    struct clause {
+        std::size_t field = 0;
+        op kind = op::EQUALS;
+        std::vector<std::string> values; // sorted, for EQUALS/IN/PREFIX
+        bool hasLow = false;
+        bool hasHigh = false;
+        long long low = 0;
+        long long high = 0;
+    };
+
+    bool evaluate(const clause& c, std::string_view value) const;
+
+    std::string text;
+    std::vector<clause> clauses;
+};
+
+#endif // FILTER_H
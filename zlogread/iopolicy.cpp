@@ -0,0 +1,292 @@
+//
+// I/O policies for processors reading right behind the writer
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/log/trivial.hpp>
+
+#include "zlog.h"
+#include "logging.h"
+#include "iopolicy.h"
+#include "seekable.h"
+
+io_policy parse_io_policy(const std::string& name) {
+    if (name.empty() || name == "normal") {
+        return io_policy::NORMAL;
+    } else if (name == "sequential") {
+        return io_policy::SEQUENTIAL;
+    } else if (name == "dontneed") {
+        return io_policy::DONTNEED;
+    } else if (name == "direct") {
+        return io_policy::DIRECT;
+    }
+    throw std::invalid_argument("Unknown I/O policy \"" + name + "\". Use normal, sequential, dontneed or direct");
+}
+
+std::string io_policy_name(io_policy policy) {
+    switch (policy) {
+        case io_policy::NORMAL:     return "normal";
+        case io_policy::SEQUENTIAL: return "sequential";
+        case io_policy::DONTNEED:   return "dontneed";
+        case io_policy::DIRECT:     return "direct";
+    }
+    return "unknown";
+}
+
+static off_t page_align_down(off_t offset) {
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    return offset - (offset % pageSize);
+}
+
+io_advisor::io_advisor(int fd, io_policy policy, off_t readaheadWindow)
+    : fd(fd), policy(policy), window(readaheadWindow) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd >= 0 && policy != io_policy::NORMAL) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+}
+
+io_advisor::~io_advisor() {
+    if (owned && fd >= 0) {
+        ::close(fd);
+    }
+}
+
+io_advisor::io_advisor(io_advisor&& other) noexcept {
+    *this = std::move(other);
+}
+
+io_advisor& io_advisor::operator=(io_advisor&& other) noexcept {
+    if (this != &other) {
+        if (owned && fd >= 0) {
+            ::close(fd);
+        }
+        fd = std::exchange(other.fd, -1);
+        owned = std::exchange(other.owned, false);
+        policy = other.policy;
+        window = other.window;
+        prefetchedUpTo = other.prefetchedUpTo;
+        releasedUpTo = other.releasedUpTo;
+    }
+    return *this;
+}
+
+io_advisor io_advisor::open(const std::string& path, io_policy policy, off_t readaheadWindow) {
+    if (policy == io_policy::NORMAL) {
+        return {};
+    }
+    io_advisor advisor(::open(path.c_str(), O_RDONLY), policy, readaheadWindow);
+    advisor.owned = true;
+    return advisor;
+}
+
+void io_advisor::advance(off_t cursor) {
+    if (fd < 0 || policy == io_policy::NORMAL || window <= 0) {
+        return;
+    }
+
+    // Keep (at least) half a window prefetched ahead of the cursor
+    if (cursor + window / 2 < prefetchedUpTo) {
+        return;
+    }
+    off_t from = std::max(cursor, prefetchedUpTo);
+    off_t to = cursor + window;
+#if defined(__linux__)
+    readahead(fd, from, static_cast<size_t>(to - from));
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, from, to - from, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct radvisory advice = { from, static_cast<int>(to - from) };
+    fcntl(fd, F_RDADVISE, &advice);
+#endif
+    prefetchedUpTo = to;
+}
+
+void io_advisor::release(off_t checkpointed, bool force) {
+    if (fd < 0 || (policy != io_policy::DONTNEED && policy != io_policy::DIRECT)) {
+        return;
+    }
+
+    // Only whole pages may be dropped, and we do it in chunks to keep syscalls down
+    off_t upTo = page_align_down(checkpointed);
+    if (upTo <= releasedUpTo || (!force && upTo - releasedUpTo < IO_RELEASE_GRANULARITY)) {
+        return;
+    }
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, releasedUpTo, upTo - releasedUpTo, POSIX_FADV_DONTNEED);
+#endif
+    releasedUpTo = upTo;
+}
+
+payload_reader::~payload_reader() {
+    close();
+}
+
+bool payload_reader::open(const std::string& path, io_policy policy, off_t readaheadWindow) {
+    close();
+
+    if (path.ends_with(ARCHIVE_SUFFIX)) {
+        archiveFile = seekable_zstd_file::open(path);
+        return archiveFile != nullptr;
+    }
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    advisor = io_advisor(fd, policy, policy == io_policy::DIRECT ? 0 : readaheadWindow);
+
+    if (policy == io_policy::DIRECT) {
+        // Bypass page cache altogether. Not all file systems support this (e.g. tmpfs),
+        // in which case we fall back on buffered reads that are dropped afterwards.
+#if defined(O_DIRECT)
+        directFd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+        directFd = ::open(path.c_str(), O_RDONLY);
+        if (directFd >= 0) {
+            fcntl(directFd, F_NOCACHE, 1);
+        }
+#endif
+        if (directFd < 0) {
+            ZLOG(warning) << "Direct I/O not available for " << path << " (" << strerror(errno) << "), using buffered reads" << std::endl;
+        }
+    }
+    return true;
+}
+
+void payload_reader::close() {
+    if (directFd >= 0) {
+        ::close(directFd);
+        directFd = -1;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    archiveFile.reset();
+    std::free(buffer);
+    buffer = nullptr;
+    capacity = 0;
+}
+
+void payload_reader::reserve(std::size_t size, std::size_t alignment) {
+    if (size <= capacity) {
+        return;
+    }
+    if (memoryLimit > 0 && size > memoryLimit) {
+        throw std::length_error("Reading " + std::to_string(size) + " bytes at once would exceed memory limit of "
+                                + std::to_string(memoryLimit) + " bytes");
+    }
+    std::free(buffer);
+    buffer = nullptr;
+    capacity = 0;
+
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignment, size) != 0) {
+        throw std::bad_alloc();
+    }
+    buffer = static_cast<char*>(memory);
+    capacity = size;
+}
+
+const char* payload_reader::read(off_t offset, std::size_t length) {
+    if (length == 0) {
+        return buffer;
+    }
+    if (archiveFile) {
+        if (memoryLimit > 0 && length > memoryLimit) {
+            throw std::length_error("Reading " + std::to_string(length) + " bytes at once would exceed memory limit of "
+                                    + std::to_string(memoryLimit) + " bytes");
+        }
+        const char* data = archiveFile->read(static_cast<std::uint64_t>(offset), length);
+        bytesRead += length;
+        return data;
+    }
+
+    int readFd = fd;
+    off_t readOffset = offset;
+    std::size_t readLength = length;
+    std::size_t skip = 0;
+
+    if (directFd >= 0) {
+        // Offsets, lengths and buffers must all be aligned when bypassing the page cache
+        readFd = directFd;
+        readOffset = offset - (offset % IO_DIRECT_ALIGNMENT);
+        skip = static_cast<std::size_t>(offset - readOffset);
+        readLength = (skip + length + IO_DIRECT_ALIGNMENT - 1) / IO_DIRECT_ALIGNMENT * IO_DIRECT_ALIGNMENT;
+        reserve(readLength, IO_DIRECT_ALIGNMENT);
+    } else {
+        advisor.advance(offset);
+        reserve(length, alignof(std::max_align_t));
+    }
+
+    std::size_t got = 0;
+    while (got < readLength) {
+        ssize_t n = pread(readFd, buffer + got, readLength - got, readOffset + static_cast<off_t>(got));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to read payload: ") + strerror(errno));
+        }
+        if (n == 0) {
+            break; // EOF, which is expected when reading aligned blocks at end of file
+        }
+        got += static_cast<std::size_t>(n);
+    }
+
+    if (got < skip + length) {
+        throw std::underflow_error("Payload file ends at " + std::to_string(readOffset + got)
+                                   + ", expected data up to " + std::to_string(offset + length));
+    }
+    bytesRead += length;
+    return buffer + skip;
+}
+
+std::pair<unsigned long, unsigned long> page_cache_footprint(const std::string& path) {
+    unsigned long resident = 0;
+    unsigned long total = 0;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return { 0, 0 };
+    }
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) == 0 && stat_buf.st_size > 0) {
+        const std::size_t pageSize = sysconf(_SC_PAGESIZE);
+        const std::size_t length = static_cast<std::size_t>(stat_buf.st_size);
+        total = (length + pageSize - 1) / pageSize;
+
+        void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            std::vector<unsigned char> pages(total);
+#ifdef __APPLE__
+            int rc = mincore(addr, length, reinterpret_cast<char*>(pages.data()));
+#else
+            int rc = mincore(addr, length, pages.data());
+#endif
+            if (rc == 0) {
+                for (unsigned char page : pages) {
+                    resident += page & 1;
+                }
+            }
+            munmap(addr, length);
+        }
+    }
+    ::close(fd);
+    return { resident, total };
+}
@@ -0,0 +1,104 @@
+//
+// I/O policies for processors that read right behind the writer and never
+// return to data once it has been processed and checkpointed.
+//
+//    normal      no hints, plain buffered reads (the default)
+//    sequential  sequential access hint, plus explicit readahead ahead of the cursor
+//    dontneed    as sequential, but drops processed and checkpointed ranges from the page cache
+//    direct      as dontneed for headers, while payloads are read using O_DIRECT (for backfill)
+//
+
+#ifndef IOPOLICY_H
+#define IOPOLICY_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+enum class io_policy { NORMAL, SEQUENTIAL, DONTNEED, DIRECT };
+
+// Throws std::invalid_argument on unknown policy names
+io_policy parse_io_policy(const std::string& name);
+std::string io_policy_name(io_policy policy);
+
+// Issues access hints for one file as the read cursor moves forward
+class io_advisor {
+public:
+    io_advisor() = default;
+    io_advisor(int fd, io_policy policy, off_t readaheadWindow);
+    ~io_advisor();
+
+    io_advisor(const io_advisor&) = delete;
+    io_advisor& operator=(const io_advisor&) = delete;
+    io_advisor(io_advisor&& other) noexcept;
+    io_advisor& operator=(io_advisor&& other) noexcept;
+
+    // For files read by other means (e.g. std::ifstream), opening a descriptor of our own
+    static io_advisor open(const std::string& path, io_policy policy, off_t readaheadWindow);
+
+    // Called as the read cursor moves forward
+    void advance(off_t cursor);
+
+    // Called when everything before 'checkpointed' is processed and persisted
+    void release(off_t checkpointed, bool force = false);
+
+private:
+    int fd = -1;
+    bool owned = false;
+    io_policy policy = io_policy::NORMAL;
+    off_t window = 0;
+    off_t prefetchedUpTo = 0;
+    off_t releasedUpTo = 0;
+};
+
+class seekable_zstd_file;
+
+// Reads payload ranges using pread(), honouring the I/O policy. Archived payload files (see
+// seekable.h) are read by decompressing the frames covering each range, without hints
+class payload_reader {
+public:
+    payload_reader() = default;
+    ~payload_reader();
+
+    payload_reader(const payload_reader&) = delete;
+    payload_reader& operator=(const payload_reader&) = delete;
+
+    // Returns false (with errno set) if file could not be opened
+    bool open(const std::string& path, io_policy policy, off_t readaheadWindow);
+    void close();
+
+    // Returns pointer to 'length' bytes at 'offset', valid until next read.
+    // Throws std::underflow_error if the file is shorter than expected, and
+    // std::length_error if the read buffer would exceed the memory limit.
+    const char* read(off_t offset, std::size_t length);
+
+    // Ceiling for the read buffer (0 means no limit)
+    void set_memory_limit(std::size_t limit) { memoryLimit = limit; }
+
+    void release(off_t checkpointed, bool force = false) { advisor.release(checkpointed, force); }
+
+    bool is_direct() const { return directFd >= 0; }
+
+    // Archived file being read, if any
+    const seekable_zstd_file* archive() const { return archiveFile.get(); }
+    unsigned long long bytes_read() const { return bytesRead; }
+
+private:
+    int fd = -1;
+    int directFd = -1;
+    io_advisor advisor;
+    std::unique_ptr<seekable_zstd_file> archiveFile;
+
+    char* buffer = nullptr;
+    std::size_t capacity = 0;
+    std::size_t memoryLimit = 0;
+    unsigned long long bytesRead = 0;
+
+    void reserve(std::size_t size, std::size_t alignment);
+};
+
+// Pages of file currently in page cache (using mincore()), along with total number of pages
+std::pair<unsigned long, unsigned long> page_cache_footprint(const std::string& path);
+
+#endif // IOPOLICY_H
@@ -0,0 +1,263 @@
+//
+// Write-ahead journal of the batch being built (see journal.h)
+//
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "zlog.h"
+#include "journal.h"
+
+namespace fs = boost::filesystem;
+
+#define RECORD_BATCH       'B'
+#define RECORD_ENTRY       'E'
+#define RECORD_PAYLOAD     'P'
+#define RECORD_REFERENCE   'R'
+#define RECORD_CHECKPOINT  'C'
+
+static void put_varint(std::string& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static void put_string(std::string& out, const std::string& value) {
+    put_varint(out, value.size());
+    out += value;
+}
+
+// A record, as read back
+struct journal_record {
+    char type = 0;
+    std::vector<std::string> fields; // of entry
+    std::string data;                // payload bytes, or name of batch
+    std::uint64_t offset = 0;        // of reference, or header position of checkpoint
+    std::uint64_t length = 0;        // of reference, or payload position of checkpoint
+};
+
+static bool get_varint(std::istream& in, std::uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        char c;
+        if (!in.get(c)) {
+            return false;
+        }
+        const auto byte = static_cast<unsigned char>(c);
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_bytes(std::istream& in, std::string& value, std::uint64_t length) {
+    value.resize(length);
+    return length == 0 || static_cast<bool>(in.read(value.data(), static_cast<std::streamsize>(length)));
+}
+
+static bool get_string(std::istream& in, std::string& value) {
+    std::uint64_t length;
+    return get_varint(in, length) && length <= IO_STREAM_THRESHOLD && get_bytes(in, value, length);
+}
+
+// Returns false at end of journal, or at a record that was torn (or is corrupt)
+static bool read_record(std::istream& in, journal_record& record) {
+    if (!in.get(record.type)) {
+        return false;
+    }
+    std::uint64_t count;
+    switch (record.type) {
+        case RECORD_BATCH:
+            return get_string(in, record.data);
+
+        case RECORD_ENTRY:
+            if (!get_varint(in, count) || count > NUMBER_HEADER_FIELDS) {
+                return false;
+            }
+            record.fields.resize(count);
+            for (auto& field : record.fields) {
+                if (!get_string(in, field)) {
+                    return false;
+                }
+            }
+            return true;
+
+        case RECORD_PAYLOAD:
+            return get_varint(in, count) && count <= IO_STREAM_THRESHOLD && get_bytes(in, record.data, count);
+
+        case RECORD_REFERENCE:
+            return get_string(in, record.data) && get_varint(in, record.offset) && get_varint(in, record.length);
+
+        case RECORD_CHECKPOINT:
+            return get_varint(in, record.offset) && get_varint(in, record.length);
+
+        default:
+            return false;
+    }
+}
+
+batch_journal::batch_journal(const fs::path& path) : path(path) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open journal " + path.string() + ": " + strerror(errno));
+    }
+}
+
+batch_journal::~batch_journal() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+void batch_journal::write_pending() {
+    const char* data = pending.data();
+    std::size_t length = pending.size();
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Could not write journal " + path.string() + ": " + strerror(errno));
+        }
+        data += written;
+        length -= static_cast<std::size_t>(written);
+    }
+    pending.clear();
+}
+
+void batch_journal::start(const std::string& batchName) {
+    if (::ftruncate(fd, 0) != 0) {
+        throw std::runtime_error("Could not truncate journal " + path.string() + ": " + strerror(errno));
+    }
+    pending.clear();
+    pending += RECORD_BATCH;
+    put_string(pending, batchName);
+    write_pending();
+}
+
+void batch_journal::begin_entry(const std::vector<std::string>& headerData) {
+    pending += RECORD_ENTRY;
+    put_varint(pending, headerData.size());
+    for (const std::string& field : headerData) {
+        put_string(pending, field);
+    }
+}
+
+void batch_journal::add_payload(const char* data, std::size_t length) {
+    // Large payloads are handed over in chunks, which need not all be kept until checkpoint
+    for (std::size_t done = 0; done < length;) {
+        const std::size_t part = std::min<std::size_t>(length - done, IO_STREAM_THRESHOLD);
+        pending += RECORD_PAYLOAD;
+        put_varint(pending, part);
+        pending.append(data + done, part);
+        done += part;
+
+        if (pending.size() >= IO_STREAM_CHUNK_SIZE) {
+            write_pending();
+        }
+    }
+}
+
+void batch_journal::add_reference(const std::string& batchName, std::uint64_t offset, std::uint64_t length) {
+    pending += RECORD_REFERENCE;
+    put_string(pending, batchName);
+    put_varint(pending, offset);
+    put_varint(pending, length);
+}
+
+void batch_journal::checkpoint(std::streamoff headerPos, std::streamoff payloadPos) {
+    pending += RECORD_CHECKPOINT;
+    put_varint(pending, static_cast<std::uint64_t>(headerPos));
+    put_varint(pending, static_cast<std::uint64_t>(payloadPos));
+    write_pending();
+}
+
+journal_replay batch_journal::replay(std::streamoff headerPos, std::streamoff payloadPos, const fs::path& outbox,
+                                     const std::string& nextBatch, batch_builder& batch) {
+    journal_replay result;
+    std::ifstream in(path.string(), std::ios::binary);
+
+    // Find last checkpoint matching saved state. Records after that were not checkpointed, and
+    // the entries they belong to will be read from the pair again
+    journal_record record;
+    std::string batchName;
+    if (!read_record(in, record) || record.type != RECORD_BATCH) {
+        start(nextBatch);
+        return result;
+    }
+    batchName = record.data;
+    const std::streamoff firstRecord = in.tellg();
+
+    std::streamoff replayEnd = -1;
+    std::size_t entries = 0;
+    std::uint64_t bytes = 0;
+    while (read_record(in, record)) {
+        if (record.type == RECORD_ENTRY) {
+            ++entries;
+        } else if (record.type == RECORD_PAYLOAD) {
+            bytes += record.data.size();
+        } else if (record.type == RECORD_REFERENCE) {
+            bytes += record.length;
+        } else if (record.type == RECORD_CHECKPOINT
+                   && record.offset == static_cast<std::uint64_t>(headerPos) && record.length == static_cast<std::uint64_t>(payloadPos)) {
+            replayEnd = in.tellg();
+            result.entries = entries;
+            result.bytes = bytes;
+        }
+    }
+
+    if (!outbox.empty() && fs::exists(outbox / batchName)) {
+        result.outcome = journal_outcome::SHIPPED;
+    } else if (replayEnd < 0) {
+        result.entries = entries;
+        result.bytes = bytes;
+        result.outcome = entries > 0 ? journal_outcome::STALE : journal_outcome::EMPTY;
+    } else if (result.entries > 0) {
+        result.outcome = journal_outcome::REPLAYED;
+    }
+    if (result.outcome != journal_outcome::REPLAYED) {
+        start(nextBatch);
+        return result;
+    }
+
+    // Rebuild batch, and journal (in a file of its own, until complete)
+    fs::path tmpPath = path;
+    tmpPath += ".tmp";
+    int tmpFd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (tmpFd < 0) {
+        throw std::runtime_error("Could not open journal " + tmpPath.string() + ": " + strerror(errno));
+    }
+    ::close(fd);
+    fd = tmpFd;
+    pending.clear();
+    pending += RECORD_BATCH;
+    put_string(pending, nextBatch);
+
+    in.clear();
+    in.seekg(firstRecord);
+    while (in.tellg() < replayEnd && read_record(in, record)) {
+        if (record.type == RECORD_ENTRY) {
+            batch.begin_entry(record.fields);
+            begin_entry(record.fields);
+        } else if (record.type == RECORD_PAYLOAD) {
+            batch.add_payload(record.data.data(), record.data.size());
+            add_payload(record.data.data(), record.data.size());
+        } else if (record.type == RECORD_REFERENCE) {
+            const std::string& name = record.data == batchName ? nextBatch : record.data;
+            batch.add_reference(name, record.offset, record.length);
+            add_reference(name, record.offset, record.length);
+        }
+    }
+    checkpoint(headerPos, payloadPos);
+    fs::rename(tmpPath, path);
+    return result;
+}
@@ -0,0 +1,77 @@
+//
+// Write-ahead journal of the batch being built, kept in processor-N.journal next to the
+// processor state. What is handed to the batch is appended to the journal, and written out
+// when state is saved -- followed by a checkpoint with the positions saved. The journal
+// starts over whenever a batch has been shipped.
+//
+// When a pair is picked up again after a crash or preemption, the batch is rebuilt from the
+// journal (up to the checkpoint matching the saved state) rather than lost. Records, with
+// integers as varints:
+//
+//   'B' length name                   batch being built (first record)
+//   'E' fields { length field }       entry, with its header fields
+//   'P' length bytes                  payload bytes of entry
+//   'R' length name offset length     reference (see batch_builder::add_reference)
+//   'C' header payload                checkpoint, with positions in pair
+//
+// The journal is not synced, so it survives processes ending in any way, but not the host.
+//
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "batch.h"
+
+enum class journal_outcome {
+    EMPTY,     // nothing to replay
+    REPLAYED,  // batch rebuilt
+    SHIPPED,   // batch in journal was shipped (just before journal would have started over)
+    STALE      // no checkpoint matches saved state, so entries in journal could not be used
+};
+
+struct journal_replay {
+    journal_outcome outcome = journal_outcome::EMPTY;
+    std::size_t entries = 0;
+    std::uint64_t bytes = 0; // payload bytes, including those referenced
+};
+
+class batch_journal {
+public:
+    // Throws std::runtime_error if journal could not be opened
+    explicit batch_journal(const boost::filesystem::path& path);
+    ~batch_journal();
+
+    batch_journal(const batch_journal&) = delete;
+    batch_journal& operator=(const batch_journal&) = delete;
+
+    // Rebuilds 'batch' from journal, up to the checkpoint at given positions, and starts journal
+    // over for 'nextBatch' with what was replayed. References to the batch in journal (by its
+    // earlier name) are made to 'nextBatch'. Batches already shipped are looked for in 'outbox'
+    journal_replay replay(std::streamoff headerPos, std::streamoff payloadPos, const boost::filesystem::path& outbox,
+                          const std::string& nextBatch, batch_builder& batch);
+
+    // Starts over, for a new batch
+    void start(const std::string& batchName);
+
+    void begin_entry(const std::vector<std::string>& headerData);
+    void add_payload(const char* data, std::size_t length);
+    void add_reference(const std::string& batchName, std::uint64_t offset, std::uint64_t length);
+
+    // Writes out what was added since last checkpoint, followed by positions of saved state
+    void checkpoint(std::streamoff headerPos, std::streamoff payloadPos);
+
+private:
+    void write_pending();
+
+    boost::filesystem::path path;
+    int fd = -1;
+    std::string pending; // records not yet written
+};
+
+#endif // JOURNAL_H
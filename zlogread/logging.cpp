@@ -0,0 +1,116 @@
+//
+// Asynchronous logging
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <boost/core/null_deleter.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/sinks/async_frontend.hpp>
+#include <boost/log/sinks/text_file_backend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/log/sinks/unbounded_fifo_queue.hpp>
+#include <boost/log/utility/setup/common_attributes.hpp>
+#include <boost/log/utility/setup/formatter_parser.hpp>
+#include <boost/make_shared.hpp>
+
+#include "logging.h"
+
+namespace logging = boost::log;
+namespace sinks = boost::log::sinks;
+namespace keywords = boost::log::keywords;
+
+#define LOG_FORMAT "[%TimeStamp%] [%Severity%] %Message%"
+
+typedef sinks::asynchronous_sink<sinks::text_file_backend, sinks::unbounded_fifo_queue> file_sink;
+typedef sinks::asynchronous_sink<sinks::text_ostream_backend, sinks::unbounded_fifo_queue> console_sink;
+
+static std::vector<boost::shared_ptr<sinks::sink>> activeSinks;
+static std::mutex sinksMutex;
+
+template <typename Sink>
+static void register_sink(const boost::shared_ptr<Sink>& sink) {
+    sink->set_formatter(logging::parse_formatter(LOG_FORMAT));
+    logging::core::get()->add_sink(sink);
+
+    std::lock_guard<std::mutex> lock(sinksMutex);
+    if (activeSinks.empty()) {
+        logging::add_common_attributes();
+        std::atexit(flush_logs);
+    }
+    activeSinks.push_back(sink);
+}
+
+void init_console_log() {
+    auto backend = boost::make_shared<sinks::text_ostream_backend>();
+    backend->add_stream(boost::shared_ptr<std::ostream>(&std::clog, boost::null_deleter()));
+    backend->auto_flush(true);  // Written by the sink thread, not by the one logging
+
+    register_sink(boost::make_shared<console_sink>(backend));
+}
+
+void init_file_log(const std::string& fileNamePattern) {
+    auto backend = boost::make_shared<sinks::text_file_backend>(
+        keywords::file_name = fileNamePattern,
+        keywords::open_mode = std::ios_base::app,    // Open in append mode
+        keywords::rotation_size = 10 * 1024 * 1024,  // Rotate after 10 MB
+        keywords::auto_flush = true  // Written by the sink thread, not by the one logging
+    );
+
+    register_sink(boost::make_shared<file_sink>(backend));
+}
+
+template <typename Sink>
+static bool stop_sink(const boost::shared_ptr<sinks::sink>& sink) {
+    auto typed = boost::dynamic_pointer_cast<Sink>(sink);
+    if (typed) {
+        typed->stop();
+        typed->flush();
+    }
+    return !!typed;
+}
+
+void flush_logs() {
+    std::lock_guard<std::mutex> lock(sinksMutex);
+    for (const auto& sink : activeSinks) {
+        logging::core::get()->remove_sink(sink);
+        stop_sink<file_sink>(sink) || stop_sink<console_sink>(sink);
+    }
+    activeSinks.clear();
+}
+
+void close_file_log() {
+    std::lock_guard<std::mutex> lock(sinksMutex);
+    for (auto it = activeSinks.begin(); it != activeSinks.end();) {
+        if (boost::dynamic_pointer_cast<file_sink>(*it)) {
+            logging::core::get()->remove_sink(*it);
+            stop_sink<file_sink>(*it);
+            it = activeSinks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool log_rate_limiter::allow() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (last.time_since_epoch().count() == 0 || now - last >= interval) {
+        last = now;
+        reported = suppressed;
+        suppressed = 0;
+        return true;
+    }
+    ++suppressed;
+    return false;
+}
+
+std::string log_rate_limiter::suppressed_note() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (reported == 0) {
+        return "";
+    }
+    return "[suppressed " + std::to_string(reported) + " similar messages] ";
+}
@@ -0,0 +1,63 @@
+//
+// Logging for the monitor and its processors. Log records are handed over to
+// background sink threads (through lock-free queues), so logging on the hot
+// path never waits for the write syscall.
+//
+// Statements below ZLOG_MIN_SEVERITY (0=trace, 1=debug, 2=info, ...) are
+// removed at compile time, and repetitive messages may be rate limited:
+//
+//    ZLOG(debug) << "Loaded state";
+//    ZLOG_RATE_LIMITED(info, 60) << "Header not ready";  // at most once a minute, reporting suppressed messages
+//
+
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+
+#include <boost/log/trivial.hpp>
+
+#ifndef ZLOG_MIN_SEVERITY
+#define ZLOG_MIN_SEVERITY 0
+#endif
+
+#define ZLOG(severity) \
+    if constexpr (::boost::log::trivial::severity < ZLOG_MIN_SEVERITY) {} else \
+    BOOST_LOG_TRIVIAL(severity)
+
+#define ZLOG_RATE_LIMITED(severity, intervalSeconds) \
+    if constexpr (::boost::log::trivial::severity < ZLOG_MIN_SEVERITY) {} else \
+    if (static log_rate_limiter zlog_limiter_{std::chrono::seconds(intervalSeconds)}; !zlog_limiter_.allow()) {} else \
+    BOOST_LOG_TRIVIAL(severity) << zlog_limiter_.suppressed_note()
+
+// Asynchronous sinks, one console sink (stderr) and one file sink per process
+void init_console_log();
+void init_file_log(const std::string& fileNamePattern);
+
+// Drains queues and stops sink threads (done automatically at exit)
+void flush_logs();
+
+// Drains and removes file sinks only, so that a new file log may be set up (e.g. by pooled workers)
+void close_file_log();
+
+// Lets one message through per interval, counting the ones suppressed in between
+class log_rate_limiter {
+public:
+    explicit log_rate_limiter(std::chrono::steady_clock::duration interval) : interval(interval) {}
+
+    bool allow();
+
+    // Something like "[suppressed 42 similar messages] ", or empty
+    std::string suppressed_note();
+
+private:
+    std::mutex mutex;
+    std::chrono::steady_clock::duration interval;
+    std::chrono::steady_clock::time_point last{};
+    unsigned long suppressed = 0;
+    unsigned long reported = 0;
+};
+
+#endif // LOGGING_H
@@ -7,40 +7,91 @@
 #include <boost/log/utility/setup/console.hpp>
 
 #include "zlog.h"
+#include "logging.h"
+#include "options.h"
+#include "scheduler.h"
+#include "coordination.h"
+#include "pool.h"
 
 namespace fs = boost::filesystem;
 namespace logging = boost::log;
 namespace keywords = boost::log::keywords;
 
 // Forward declarations
-int process(int id, const std::string& baseDir, const std::string& date, const std::string& headerFile, const std::string& payloadFile);
-int monitor_directory(const fs::path& myself, const std::string& basePath, const std::string& dateStr);
+int process(int id, const std::string& baseDir, const std::string& date, const std::string& headerFile, const std::string& payloadFile, const option_map& options);
+int monitor_directory(const fs::path& myself, const std::string& basePath, const std::string& dateStr, const option_map& options);
+int monitor_tenants(const fs::path& myself, const std::string& tenantFile, const std::string& dateStr, const option_map& options);
+int benchmark_discovery(const std::string& directory, const option_map& options);
+int dump_batch(const std::string& path, const option_map& options);
+int dump_segment(const std::string& path, const option_map& options);
+int compact_day(const fs::path& dayDir, const option_map& options);
+std::tm string_to_tm(const std::string& timeString, const std::string& format);
+std::string get_date_path(const std::tm& today);
 
 
 //
 int main(int argc, char* argv[]) {
     try {
-        if (argc < 2) {
-            std::cerr << "Usage: " << argv[0] << " <base-directory> [<date>]" << std::endl;
+        option_map options;
+        std::vector<std::string> args = parse_options(argc, argv, options);
+
+        // Fork server of processor pool. Must come before anything that starts threads
+        if (has_option(options, "fork-server")) {
+            return run_fork_server(get_option(options, "fork-server"), options);
+        }
+
+        if (args.size() < 2 && !has_option(options, "tenants")) {
+            std::cerr << "Usage: " << argv[0] << " [--filter=<expression>] <base-directory> [<date>]" << std::endl;
+            std::cerr << "       " << argv[0] << " --tenants=<tenant-file> [<date>]" << std::endl;
             return STATUS_ARGUMENTS_MISSING;
         }
 
+        // Placement decided by monitor. Pin before any threads (e.g. logging) are started, so they inherit it
+        if (has_option(options, "cpus")) {
+            pin_to_cpus(parse_cpu_list(get_option(options, "cpus")));
+        }
+
         // Set up console logging
-        logging::add_console_log(
-            std::clog,
-            keywords::format = "[%TimeStamp%] [%Severity%] %Message%"
-        );
+        init_console_log();
+
+        // One monitor serving several base directories, where the (optional) date comes first
+        if (has_option(options, "tenants")) {
+            return monitor_tenants(args[0], get_option(options, "tenants"), args.size() >= 2 ? args[1] : "", options);
+        }
+
+        if (has_option(options, "bench-discovery")) {
+            return benchmark_discovery(args[1], options);
+        }
+
+        if (has_option(options, "dump-batch")) {
+            return dump_batch(args[1], options);
+        }
+
+        if (has_option(options, "dump-segment")) {
+            return dump_segment(args[1], options);
+        }
+
+        if (has_option(options, "compact-day")) {
+            if (args.size() < 3) {
+                std::cerr << "Usage: " << argv[0] << " --compact-day [--threads=<n>] [--segment-size=<bytes>] <base-directory> <date>" << std::endl;
+                return STATUS_ARGUMENTS_MISSING;
+            }
+            return compact_day(fs::path(args[1]) / get_date_path(string_to_tm(args[2], DATE_FORMAT)), options);
+        }
+
+        if (args[1] == "-p" && args.size() == 7) {
+            // Should the monitor die, its pairs are taken over by others -- so we must not go on
+            end_with_parent();
 
-        if (std::strcmp(argv[1], "-p") == 0 && argc == 7) {
-            int id = std::stoi(argv[2]);
-            return process(id, argv[3], argv[4], argv[5], argv[6]);
+            int id = std::stoi(args[2]);
+            return process(id, args[3], args[4], args[5], args[6], options);
         }
 
         std::string dateStr;
-        if (argc >= 3) {
-            dateStr = argv[2];
+        if (args.size() >= 3) {
+            dateStr = args[2];
         }
-        return monitor_directory(argv[0], argv[1], dateStr);
+        return monitor_directory(args[0], args[1], dateStr, options);
     }
     catch (const std::invalid_argument& ia) {
         std::cout << "Invalid argument: " << ia.what() << std::endl;
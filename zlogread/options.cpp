@@ -0,0 +1,117 @@
+//
+// Command line option handling
+//
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "options.h"
+
+std::vector<std::string> parse_options(int argc, char* argv[], option_map& options) {
+    std::vector<std::string> positional;
+
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i > 0 && arg.size() > 2 && arg.starts_with("--")) {
+            // --name=value or just --name (a flag)
+            std::string::size_type eq = arg.find('=');
+            if (eq == std::string::npos) {
+                options[arg.substr(2)] = "";
+            } else {
+                options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    return positional;
+}
+
+std::vector<std::string> format_options(const option_map& options) {
+    std::vector<std::string> args;
+    for (const auto& option : options) {
+        if (option.second.empty()) {
+            args.push_back("--" + option.first);
+        } else {
+            args.push_back("--" + option.first + "=" + option.second);
+        }
+    }
+    return args;
+}
+
+std::string get_option(const option_map& options, const std::string& name, const std::string& defaultValue) {
+    auto it = options.find(name);
+    return it != options.end() ? it->second : defaultValue;
+}
+
+unsigned long get_numeric_option(const option_map& options, const std::string& name, unsigned long defaultValue) {
+    auto it = options.find(name);
+    if (it == options.end() || it->second.empty()) {
+        return defaultValue;
+    }
+    try {
+        return std::stoul(it->second);
+    } catch (const std::exception&) {
+        throw std::invalid_argument("Option --" + name + " expects a number, got \"" + it->second + "\"");
+    }
+}
+
+bool has_option(const option_map& options, const std::string& name) {
+    return options.find(name) != options.end();
+}
+
+std::vector<tenant_config> load_tenants(const std::string& path, const option_map& defaults) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::invalid_argument("Could not read tenant file " + path);
+    }
+    std::vector<tenant_config> tenants;
+    std::set<std::string> names;
+    std::set<std::string> basePaths;
+
+    std::string line;
+    unsigned long lineNumber = 0;
+    while (std::getline(file, line)) {
+        ++lineNumber;
+        line = line.substr(0, line.find('#'));
+
+        std::vector<std::string> words;
+        std::istringstream iss(line);
+        for (std::string word; iss >> word;) {
+            words.push_back(word);
+        }
+        if (words.empty()) {
+            continue;
+        }
+        const std::string where = " (line " + std::to_string(lineNumber) + " of " + path + ")";
+
+        tenant_config tenant;
+        tenant.options = defaults;
+        std::string program = path; // in place of program name
+        std::vector<char*> argv = { program.data() };
+        for (std::string& word : words) {
+            argv.push_back(word.data());
+        }
+        std::vector<std::string> positional = parse_options(static_cast<int>(argv.size()), argv.data(), tenant.options);
+        if (positional.size() != 3) {
+            throw std::invalid_argument("Expected tenant name and base directory, followed by options" + where);
+        }
+        tenant.name = positional[1];
+        tenant.basePath = positional[2];
+        if (tenant.name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-") != std::string::npos) {
+            throw std::invalid_argument("Tenant names may only hold letters, digits and '-': " + tenant.name + where);
+        }
+        if (!names.insert(tenant.name).second || !basePaths.insert(tenant.basePath).second) {
+            throw std::invalid_argument("Tenant " + tenant.name + " or base directory " + tenant.basePath + " given twice" + where);
+        }
+        tenants.push_back(std::move(tenant));
+    }
+    if (tenants.empty()) {
+        throw std::invalid_argument("No tenants in " + path);
+    }
+    return tenants;
+}
@@ -0,0 +1,37 @@
+//
+// Command line options of the form --name=value, shared by the monitor and
+// its processors. The monitor forwards its options verbatim to each child.
+//
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::map<std::string /* name */, std::string /* value */> option_map;
+
+// Split argv into positional arguments and --name=value options
+std::vector<std::string> parse_options(int argc, char* argv[], option_map& options);
+
+// Render options back into --name=value arguments (for child processes)
+std::vector<std::string> format_options(const option_map& options);
+
+std::string get_option(const option_map& options, const std::string& name, const std::string& defaultValue = "");
+unsigned long get_numeric_option(const option_map& options, const std::string& name, unsigned long defaultValue);
+bool has_option(const option_map& options, const std::string& name);
+
+// A base directory served by a monitor serving several (tenants), as given in a tenant file: one
+// line per tenant, "<name> <base-directory> [--name=value ...]", where '#' starts a comment
+struct tenant_config {
+    std::string name;
+    std::string basePath;
+    option_map options; // those given for all tenants, overridden by those on tenant line
+};
+
+// Throws std::invalid_argument if file could not be read, on malformed lines, and on repeated
+// names or base directories
+std::vector<tenant_config> load_tenants(const std::string& path, const option_map& defaults);
+
+#endif // OPTIONS_H
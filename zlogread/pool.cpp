@@ -0,0 +1,320 @@
+//
+// Pre-forked processor pool
+//
+
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <boost/log/trivial.hpp>
+
+#include "zlog.h"
+#include "logging.h"
+#include "scheduler.h"
+#include "coordination.h"
+#include "pool.h"
+
+namespace fs = boost::filesystem;
+namespace bp = boost::process;
+
+// Forward declarations
+int process(int id, const std::string& baseDir, const std::string& date, const std::string& headerFile, const std::string& payloadFile, const option_map& options);
+void watch_for_preemption();
+
+#define POOL_HELLO_PREFIX "#hello "
+#define POOL_EXIT_PREFIX  "#exit "
+
+
+static sockaddr_un socket_address(const std::string& socketPath) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path too long: " + socketPath);
+    }
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+// Reads one line from 'fd', waiting at most 'timeoutMs' (or forever, if negative)
+static bool read_line(int fd, std::string& pending, std::string& line, int timeoutMs) {
+    char buffer[4096];
+    while (true) {
+        std::string::size_type newline = pending.find('\n');
+        if (newline != std::string::npos) {
+            line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            return true;
+        }
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeoutMs);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return false;
+        }
+        ssize_t n = ::read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false; // EOF (or error)
+        }
+        pending.append(buffer, n);
+    }
+}
+
+// Number following 'prefix' of a line read from the other end, which is not trusted to be well formed
+static bool parse_number_after(const std::string& line, const char* prefix, long& value) {
+    const char* begin = line.data() + std::strlen(prefix);
+    const char* end = line.data() + line.size();
+    auto [ptr, ec] = std::from_chars(begin, end, value);
+    return ec == std::errc() && ptr == end && begin != end;
+}
+
+bool parse_exit_line(const std::string& line, int& exitCode) {
+    if (!line.starts_with(POOL_EXIT_PREFIX)) {
+        return false;
+    }
+    long code;
+    if (!parse_number_after(line, POOL_EXIT_PREFIX, code) || code < 0 || code > 255) {
+        ZLOG(warning) << "Worker ended with a garbled exit line: " << line << std::endl;
+        code = STATUS_GENERAL_FAILURE;
+    }
+    exitCode = static_cast<int>(code);
+    return true;
+}
+
+worker_pool::worker_pool(const fs::path& executable, unsigned long size, const option_map& options)
+    : recycleAfter(get_numeric_option(options, "pool-recycle", POOL_RECYCLE_ASSIGNMENTS)) {
+    socketPath = fs::temp_directory_path() / ("zlogread-" + std::to_string(getpid()) + ".sock");
+    fs::remove(socketPath);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address = socket_address(socketPath.string());
+    if (listenFd < 0
+        || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+        || listen(listenFd, static_cast<int>(size) + 16) != 0) {
+        throw std::runtime_error("Could not listen on " + socketPath.string() + ": " + strerror(errno));
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+    // Workers get the same options as exec'ed processors would
+    option_map serverOptions = options;
+    serverOptions["fork-server"] = socketPath.string();
+    serverOptions["pool"] = std::to_string(size);
+
+    forkServer = std::make_unique<bp::child>(executable, bp::args(format_options(serverOptions)));
+    ZLOG(info) << "Started fork server (pid=" << forkServer->id() << ") for " << size << " workers on " << socketPath << std::endl;
+}
+
+worker_pool::~worker_pool() {
+    for (pool_worker& worker : idle) {
+        ::close(worker.fd);
+    }
+    if (forkServer && forkServer->running()) {
+        ::kill(forkServer->id(), SIGTERM);
+        forkServer->wait();
+    }
+    if (listenFd >= 0) {
+        ::close(listenFd);
+    }
+    boost::system::error_code ec;
+    fs::remove(socketPath, ec);
+}
+
+void worker_pool::accept_workers() {
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                ZLOG_RATE_LIMITED(error, LOG_RATE_LIMIT_INTERVAL) << "Failed to accept worker: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+
+        // Worker introduces itself right after connecting
+        std::string pending, line;
+        long pid = 0;
+        if (!read_line(fd, pending, line, 1000) || !line.starts_with(POOL_HELLO_PREFIX)
+            || !parse_number_after(line, POOL_HELLO_PREFIX, pid) || pid <= 0) {
+            ZLOG(warning) << "Worker did not introduce itself, dropping connection" << std::endl;
+            ::close(fd);
+            continue;
+        }
+        pool_worker worker;
+        worker.fd = fd;
+        worker.pid = static_cast<pid_t>(pid);
+        idle.push_back(worker);
+        ZLOG(debug) << "Worker (pid=" << worker.pid << ") ready" << std::endl;
+    }
+}
+
+pool_worker worker_pool::assign(const std::vector<std::string>& args) {
+    if (idle.empty()) {
+        throw std::logic_error("No idle worker");
+    }
+    pool_worker worker = idle.back();
+    idle.pop_back();
+
+    std::string assignment;
+    for (const std::string& arg : args) {
+        if (!assignment.empty()) {
+            assignment += '\t';
+        }
+        assignment += arg;
+    }
+    assignment += '\n';
+
+    // Small enough to go in one write, and the worker is waiting for it
+    if (::send(worker.fd, assignment.data(), assignment.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(assignment.size())) {
+        ::close(worker.fd);
+        throw std::runtime_error("Worker (pid=" + std::to_string(worker.pid) + ") went away");
+    }
+    ++worker.assignments;
+    return worker;
+}
+
+void worker_pool::give_back(pool_worker& worker) {
+    if (worker.assignments >= recycleAfter) {
+        discard(worker); // worker exits on its own, and the fork server starts a fresh one
+        return;
+    }
+    idle.push_back(worker);
+    worker = {};
+}
+
+void worker_pool::discard(pool_worker& worker) {
+    if (worker.fd >= 0) {
+        ::close(worker.fd);
+    }
+    worker = {};
+}
+
+// Worker, forked by fork server. Handles assignments until recycled (or monitor goes away)
+static int serve_assignments(const std::string& socketPath, unsigned long recycleAfter) {
+    end_with_parent();
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address = socket_address(socketPath);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        return STATUS_GENERAL_FAILURE;
+    }
+
+    // Reports go to the monitor, just like stdout of an exec'ed processor
+    dup2(fd, STDOUT_FILENO);
+    std::cout << POOL_HELLO_PREFIX << getpid() << std::endl;
+
+    // Pairs assigned without CPUs must not run where the previous pair was pinned. Only this thread is
+    // pinned, and threads it starts while processing -- the console log sink started here stays unpinned
+    const std::vector<int> initialCpus = available_cpus();
+    init_console_log();
+
+    std::string pending, line;
+    for (unsigned long assignments = 0; assignments < recycleAfter; ++assignments) {
+        // The monitor may preempt us as soon as we are assigned a pair, before we get to process it
+        watch_for_preemption();
+        if (!read_line(fd, pending, line, -1)) {
+            break; // monitor went away
+        }
+
+        std::vector<std::string> argv = { "zlogread" };
+        std::stringstream ss(line);
+        std::string arg;
+        while (std::getline(ss, arg, '\t')) {
+            argv.push_back(arg);
+        }
+        std::vector<char*> cargv;
+        for (std::string& a : argv) {
+            cargv.push_back(a.data());
+        }
+
+        option_map options;
+        std::vector<std::string> args = parse_options(static_cast<int>(cargv.size()), cargv.data(), options);
+
+        int status;
+        try {
+            if (args.size() != 7 || args[1] != "-p") {
+                throw std::invalid_argument("Malformed assignment: " + line);
+            }
+            if (has_option(options, "cpus")) {
+                pin_to_cpus(parse_cpu_list(get_option(options, "cpus")));
+            }
+            status = process(std::stoi(args[2]), args[3], args[4], args[5], args[6], options);
+        }
+        catch (const std::invalid_argument& ia) {
+            std::cout << "Invalid argument: " << ia.what() << std::endl;
+            status = STATUS_INVALID_ARGUMENT;
+        }
+        catch (std::exception& e) {
+            std::cout << "Failed to process logs: " << e.what() << std::endl;
+            status = STATUS_GENERAL_FAILURE;
+        }
+
+        // Next assignment gets a log file of its own, and the CPUs we started with
+        close_file_log();
+        if (has_option(options, "cpus") && !initialCpus.empty()) {
+            pin_to_cpus(initialCpus);
+        }
+        std::cout << POOL_EXIT_PREFIX << status << std::endl;
+    }
+    flush_logs();
+    return STATUS_ENDED_SUCCESSFULLY;
+}
+
+int run_fork_server(const std::string& socketPath, const option_map& options) {
+    const unsigned long size = std::max(1UL, get_numeric_option(options, "pool", 1));
+    const unsigned long recycleAfter = std::max(1UL, get_numeric_option(options, "pool-recycle", POOL_RECYCLE_ASSIGNMENTS));
+
+    // Goes away with the monitor, and workers go away with us
+    end_with_parent();
+
+    std::map<pid_t, std::chrono::steady_clock::time_point> workers;
+    while (true) {
+        while (workers.size() < size) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                _exit(serve_assignments(socketPath, recycleAfter));
+            }
+            if (pid < 0) {
+                std::cerr << "Fork server could not fork: " << strerror(errno) << std::endl;
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            workers[pid] = std::chrono::steady_clock::now();
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return STATUS_GENERAL_FAILURE;
+        }
+        auto it = workers.find(pid);
+        if (it == workers.end()) {
+            continue;
+        }
+        // Do not spin if workers fail right away (e.g. if the monitor stopped listening)
+        const bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != STATUS_ENDED_SUCCESSFULLY;
+        if (failed && std::chrono::steady_clock::now() - it->second < std::chrono::seconds(1)) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        workers.erase(it);
+    }
+}
@@ -0,0 +1,72 @@
+//
+// Pre-forked processor pool, for when pairs are many and short-lived.
+//
+// Instead of exec'ing zlogread once per pair, the monitor starts one fork server
+// (a single threaded zlogread, started before any logging threads) that keeps a
+// number of warm worker processes around. Workers connect to the monitor over a
+// Unix socket and are handed pair assignments, one at a time. Reports are written
+// to the socket, just as they would be written to stdout by an exec'ed processor,
+// followed by a line with the exit status. Workers are recycled after a number of
+// assignments.
+//
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/process.hpp>
+
+#include "options.h"
+
+struct pool_worker {
+    int fd = -1;
+    pid_t pid = 0;
+    unsigned long assignments = 0;
+};
+
+class worker_pool {
+public:
+    // Starts fork server, running 'size' workers
+    worker_pool(const boost::filesystem::path& executable, unsigned long size, const option_map& options);
+    ~worker_pool();
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    // Picks up workers that have connected since last time (without blocking)
+    void accept_workers();
+
+    bool available() const { return !idle.empty(); }
+
+    // Readable when workers are connecting
+    int listen_fd() const { return listenFd; }
+
+    // Hands processor command line (as given to 'zlogread -p ...') to an idle worker
+    pool_worker assign(const std::vector<std::string>& args);
+
+    // Worker done with its assignment, either to be reused or recycled
+    void give_back(pool_worker& worker);
+    void discard(pool_worker& worker);
+
+private:
+    boost::filesystem::path socketPath;
+    int listenFd = -1;
+    unsigned long recycleAfter;
+    std::unique_ptr<boost::process::child> forkServer;
+    std::vector<pool_worker> idle;
+};
+
+// Recognizes the line ending an assignment, as written by the worker. A garbled exit code is
+// taken for STATUS_GENERAL_FAILURE
+bool parse_exit_line(const std::string& line, int& exitCode);
+
+// Fork server mode, which must be entered before any threads are started
+int run_fork_server(const std::string& socketPath, const option_map& options);
+
+#endif // POOL_H
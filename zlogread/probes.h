@@ -0,0 +1,40 @@
+//
+// Static tracepoints (USDT) on hot paths, for perf and bpftrace:
+//
+//    bpftrace -l 'usdt:./zlogread:zlog:*'
+//    bpftrace -e 'usdt:./zlogread:zlog:checkpoint { @[arg0] = count(); }'
+//
+// A probe is a single nop (plus a note in .note.stapsdt, locating the nop and its arguments), so
+// arguments should be values at hand. Probes are compiled out without <sys/sdt.h> (as found in
+// systemtap-sdt-dev or systemtap-sdt-devel), or with ZLOG_NO_PROBES defined.
+//
+//   entry_parsed       shard, header position (after entry), input size, output size
+//   payload_ready      shard, payload offset, payload size
+//   payload_not_ready  shard, payload size needed, payload file size
+//   action_start       shard, input size, output size
+//   action_end         shard, input size, output size
+//   checkpoint         shard, header position, payload position
+//   batch_sealed       shard, entries, header field bytes (as encoded), payload bytes
+//   child_spawned      shard, pid
+//   child_reaped       shard, pid, exit status
+//
+// Positions and offsets are relative to the pair. See doc/probes for example scripts.
+//
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(ZLOG_NO_PROBES) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+
+#define ZLOG_PROBE2(name, a, b) DTRACE_PROBE2(zlog, name, a, b)
+#define ZLOG_PROBE3(name, a, b, c) DTRACE_PROBE3(zlog, name, a, b, c)
+#define ZLOG_PROBE4(name, a, b, c, d) DTRACE_PROBE4(zlog, name, a, b, c, d)
+
+#else
+#define ZLOG_PROBE2(name, a, b) do {} while (0)
+#define ZLOG_PROBE3(name, a, b, c) do {} while (0)
+#define ZLOG_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif // PROBES_H
@@ -10,6 +10,12 @@
 #include <cerrno>
 #include <cstring>    // For strerror
 #include <thread>
+#include <chrono>
+#include <memory>
+#include <csignal>
+#include <algorithm>
+#include <tuple>
+#include <sys/resource.h> // For peak memory usage
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -23,6 +29,16 @@
 #include <boost/log/attributes/named_scope.hpp>
 
 #include "zlog.h"
+#include "logging.h"
+#include "options.h"
+#include "filter.h"
+#include "aggregate.h"
+#include "iopolicy.h"
+#include "livering.h"
+#include "batch.h"
+#include "segment.h"
+#include "probes.h"
+#include "seekable.h"
 
 
 namespace fs = boost::filesystem;
@@ -36,17 +52,44 @@ std::tm today();
 bool differs_from_today(const std::tm& then);
 std::string get_date_path(const std::tm& today);
 
+void save_state(const fs::path& path, unsigned long id, std::streamoff lastHeaderPos, std::streamoff lastPayloadPos, unsigned long size, unsigned long count);
+void load_state(const fs::path& path, unsigned long id, std::streamoff &lastHeaderPos, std::streamoff &lastPayloadPos, unsigned long& size, unsigned long& count);
+
+void open_outbox(const fs::path& outbox, int shard, batch_format format, std::size_t dedupCapacity);
 void write_to_object_store(const std::string& reason);
+void open_journal(const fs::path& stateDir, int shard, std::streamoff headerPos, std::streamoff payloadPos, unsigned long& size, unsigned long& count);
 
 void process_header_and_payload(
     const std::vector<std::string>& headerData,
-    std::streamsize inputSize,
-    std::streamsize outputSize,
-    std::ifstream& payloadStream,
+    const char* input, std::streamsize inputSize,
+    const char* output, std::streamsize outputSize,
+    unsigned long& size, unsigned long& count
+);
+
+void begin_streamed_entry(const std::vector<std::string>& headerData, std::streamsize inputSize, std::streamsize outputSize);
+void process_payload_chunk(
+    const std::vector<std::string>& headerData, payload_part part,
+    const char* data, std::streamsize length, std::streamoff position, std::streamsize partSize
+);
+void end_streamed_entry(
+    const std::vector<std::string>& headerData, std::streamsize inputSize, std::streamsize outputSize,
     unsigned long& size, unsigned long& count
 );
 
 
+// Set when the monitor asks us to make room for processors with more backlog
+static volatile std::sig_atomic_t preemptionRequested = 0;
+
+static void request_preemption(int) {
+    preemptionRequested = 1;
+}
+
+// Pooled workers watch from before they are handed a pair, clearing requests meant for the previous one
+void watch_for_preemption() {
+    preemptionRequested = 0;
+    std::signal(SIGTERM, request_preemption);
+}
+
 static std::vector<std::string> split(const std::string& line, char delimiter) {
     std::vector<std::string> result;
     std::stringstream ss(line);
@@ -66,71 +109,90 @@ static std::streamoff get_filesize(const std::string& path) {
     return rc == 0 ? stat_buf.st_size : -1;
 }
 
-// Utility function to save the current state (last read positions)
-static void save_state(const fs::path& path, unsigned long id, std::streamoff lastHeaderPos, std::streamoff lastPayloadPos, unsigned long size, unsigned long count) {
-    std::string name = "processor-" + std::to_string(id) + ".state";
-    fs::path statePath = path;
-    statePath /= name;
-
-    std::ofstream stateStream(statePath.string(), std::ios::binary | std::ios::out | std::ios::trunc);
-    if (stateStream) {
-        stateStream
-            << std::to_string(lastHeaderPos) << ","
-            << std::to_string(lastPayloadPos) << ","
-            << std::to_string(size) << ","
-            << std::to_string(count) << std::endl;
-        stateStream.close();
+// Utility function to check whether writer has sealed the pair, in which case final sizes are loaded
+static bool load_seal(const fs::path& sealPath, std::streamoff& headerSize, std::streamoff& payloadSize) {
+    std::ifstream sealFile(sealPath.string(), std::ios::binary | std::ios::in);
+    if (!sealFile) {
+        return false;
+    }
+
+    std::string line;
+    if (std::getline(sealFile, line)) {
+        std::vector<std::string> data = split(line, ',');
+        if (data.size() == 2) {
+            headerSize = static_cast<std::streamoff>(std::stoul(data[0]));
+            payloadSize = static_cast<std::streamoff>(std::stoul(data[1]));
+            return true;
+        }
     }
+    ZLOG(error) << "Corrupt seal: " << line << " (" << sealPath.filename() << ")" << std::endl;
+    return false;
 }
 
-// Utility function to load the saved state (last read positions)
-static void load_state(const fs::path& path, unsigned long id, std::streamoff &lastHeaderPos, std::streamoff &lastPayloadPos, unsigned long& size, unsigned long& count) {
-    std::string name = "processor-" + std::to_string(id) + ".state";
-    fs::path statePath = path;
-    statePath /= name;
-
-    std::ifstream stateFile(statePath.string(), std::ios::binary | std::ios::in);
-    if (stateFile) {
-        std::string line;
-        if (std::getline(stateFile, line)) {
-            std::vector<std::string> data = split(line, ',');
-            if (data.size() != 4) {
-                BOOST_LOG_TRIVIAL(error) << "Corrupt state: " << line << " (" << name << ")" << std::endl;
-            } else {
-                lastHeaderPos = static_cast<std::streamoff>(std::stoul(data[0]));
-                lastPayloadPos = static_cast<std::streamoff>(std::stoul(data[1]));
-                size = static_cast<std::streamoff>(std::stoul(data[2]));
-                count = static_cast<std::streamoff>(std::stoul(data[3]));
-                BOOST_LOG_TRIVIAL(trace) << "Loaded state [" << id <<"]: header=" << lastHeaderPos << ", payload=" << lastPayloadPos << ", size=" << size << ", count=" << count << std::endl;
-            }
-        } else {
-            BOOST_LOG_TRIVIAL(debug) << "Empty file: " << name << std::endl;
+// Utility function to bring aggregates up to date with already processed entries, after a restart
+static void catch_up_aggregates(std::istream& headerStream, std::streamoff from, std::streamoff to, const header_filter& filter, aggregate_table& aggregates) {
+    headerStream.clear();
+    headerStream.seekg(from);
+
+    std::string line;
+    while (headerStream.tellg() < to && std::getline(headerStream, line)) {
+        std::vector<std::string> headerData = split(line, ',');
+        if (headerData.size() != NUMBER_HEADER_FIELDS) {
+            break;
         }
-        stateFile.close();
+        if (filter.empty() || filter.matches(headerData)) {
+            aggregates.add(headerData, std::stoul(headerData[7]), std::stoul(headerData[8]));
+        }
+    }
+    headerStream.clear();
+}
+
+// Utility function to summarise effects of I/O policy: throughput and page cache footprint
+static std::string io_report(io_policy policy, unsigned long long bytesRead, std::chrono::steady_clock::duration busy, const fs::path& headerFilePath, const fs::path& payloadFilePath) {
+    double seconds = std::chrono::duration<double>(busy).count();
+    double megabytes = static_cast<double>(bytesRead) / (1024.0 * 1024.0);
+    auto [headerResident, headerPages] = page_cache_footprint(headerFilePath.string());
+    auto [payloadResident, payloadPages] = page_cache_footprint(payloadFilePath.string());
+
+    std::ostringstream report;
+    report << "I/O policy " << io_policy_name(policy) << ": read " << megabytes << " MB in " << seconds << " s";
+    if (seconds > 0.0) {
+        report << " (" << megabytes / seconds << " MB/s)";
     }
+    report << ", page cache holds " << headerResident << " of " << headerPages << " header pages and "
+           << payloadResident << " of " << payloadPages << " payload pages";
+    return report.str();
 }
 
+// Header entry whose payload is ready, waiting to be read together with adjacent payloads
+struct batched_entry {
+    std::vector<std::string> headerData;
+    std::streamoff offset;
+    std::streamsize inputSize;
+    std::streamsize outputSize;
+    std::streamoff nextHeaderPos;
+};
+
 int process(
     int shard,
     const std::string& baseDir,
     const std::string& dateStr,
     const std::string& headerFile,
-    const std::string& payloadFile
+    const std::string& payloadFile,
+    const option_map& options
 ) {
     std::string logFileName = "processor_";
+    if (has_option(options, "tenant")) {
+        logFileName += get_option(options, "tenant") + "_"; // since shards are numbered per tenant
+    }
     logFileName += std::to_string(shard);
     logFileName += "_%N.log";
 
-    // Set up file logging
-    logging::add_file_log(
-        keywords::file_name = logFileName,
-        keywords::open_mode = std::ios_base::app,    // Open in append mode
-        keywords::rotation_size = 10 * 1024 * 1024,  // Rotate after 10 MB
-        keywords::format = "[%TimeStamp%] [%Severity%] %Message%",
-        keywords::auto_flush = true  // Flush to file after each log message
-    );
+    // Set up file logging (asynchronous, so that we do not wait for the log file on the hot path)
+    init_file_log(logFileName);
 
-    logging::add_common_attributes();
+    // The monitor sends SIGTERM when preempting us, and we stop at the next entry boundary
+    std::signal(SIGTERM, request_preemption);
 
     //
     std::streamoff lastPayloadPos = 0;
@@ -146,12 +208,72 @@ int process(
     headerFilePath /= headerFile; // unique
     payloadFilePath /= payloadFile; // unique
 
+    // Pairs of compacted days are read from their segment, at offsets relative to the pair as before
+    fs::path segmentPath;
+    segment_pair segmentPair;
+    const bool inSegment = !fs::exists(headerFilePath)
+        && find_in_segments(stateDir, fs::path(headerFile).stem().string(), segmentPath, segmentPair);
+    const auto headerBase = static_cast<std::streamoff>(segmentPair.headerOffset);
+    const auto payloadBase = static_cast<std::streamoff>(segmentPair.payloadOffset);
+    if (inSegment) {
+        headerFilePath = segmentPath;
+        payloadFilePath = segmentPath;
+    }
+
+    // Archived pairs are read from seekable zstd files, at offsets into decompressed data as before
+    const bool archived = headerFile.ends_with(ARCHIVE_SUFFIX) || payloadFile.ends_with(ARCHIVE_SUFFIX);
+    std::unique_ptr<seekable_zstd_buffer> headerArchive;
+    const seekable_zstd_file* payloadArchive = nullptr;
+
+    auto header_size = [&]() {
+        if (headerArchive) {
+            return static_cast<std::streamoff>(headerArchive->archive().size());
+        }
+        return inSegment ? static_cast<std::streamoff>(segmentPair.headerLength) : get_filesize(headerFilePath.string());
+    };
+    auto payload_size = [&]() {
+        if (payloadArchive) {
+            return static_cast<std::streamoff>(payloadArchive->size());
+        }
+        return inSegment ? static_cast<std::streamoff>(segmentPair.payloadLength) : get_filesize(payloadFilePath.string());
+    };
+
+    // Header predicate, compiled once. Entries not matching are skipped without payload I/O
+    header_filter filter(get_option(options, "filter"));
+    if (!filter.empty()) {
+        ZLOG(info) << "Processor #" << shard << " only processes entries matching: " << filter.expression() << std::endl;
+    }
+
+    // Optional group-by aggregation over header fields, checkpointed next to the state file
+    std::unique_ptr<aggregate_table> aggregates;
+    fs::path aggregatePath = stateDir;
+    aggregatePath /= "processor-" + std::to_string(shard) + ".agg";
+    if (has_option(options, "group-by")) {
+        aggregates = std::make_unique<aggregate_table>(get_option(options, "group-by"));
+    }
+
+    // How to treat the page cache, since we will not read the same data again
+    const io_policy ioPolicy = parse_io_policy(get_option(options, "io-policy"));
+    const auto readaheadWindow = static_cast<off_t>(get_numeric_option(options, "readahead", IO_READAHEAD_WINDOW));
+
+    // Batches are shipped to an outbox directory, if given (otherwise just accounted for)
+    fs::path outbox;
+    if (has_option(options, "outbox")) {
+        outbox = get_option(options, "outbox");
+        outbox /= get_date_path(date);
+        fs::create_directories(outbox);
+    }
+    // Payloads seen before may be shipped as references (--dedup, or --dedup=<digests remembered>)
+    const std::size_t dedupCapacity = has_option(options, "dedup") ? get_numeric_option(options, "dedup", DEDUP_CAPACITY) : 0;
+    open_outbox(outbox, shard, parse_batch_format(get_option(options, "batch-format")), outbox.empty() ? 0 : dedupCapacity);
+
     // Accumulators
     unsigned long accSize = 0L;
     unsigned long accCount = 0L;
 
-    // Load the previous state (if any)
+    // Load the previous state (if any), and rebuild the batch that was unshipped at that point
     load_state(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
+    open_journal(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
     if (accSize > NOMINAL_BATCH_SIZE || accCount > NOMINAL_BATCH_COUNT) {
         write_to_object_store("Reached limit: size=" + std::to_string(accSize) + " count=" + std::to_string(accCount));
 
@@ -160,87 +282,411 @@ int process(
         accCount = 0L;
     }
 
-    BOOST_LOG_TRIVIAL(info) << "Processor #" << shard << " starting at position " << lastHeaderPos << " in " << headerFilePath.string() << std::endl;
+    ZLOG(info) << "Processor #" << shard << " starting at position " << lastHeaderPos << " in " << headerFilePath.string()
+               << (inSegment ? " (" + headerFile + ")" : "") << std::endl;
 
     // Open both files and keep them open
-    std::ifstream headerStream(headerFilePath.string(), std::ios::binary | std::ios::in);
-    std::ifstream payloadStream(payloadFilePath.string(), std::ios::binary | std::ios::in);
+    std::filebuf headerFileBuffer;
+    std::istream headerStream(nullptr);
+    if (headerFile.ends_with(ARCHIVE_SUFFIX)) {
+        if (auto archive = seekable_zstd_file::open(headerFilePath.string())) {
+            headerArchive = std::make_unique<seekable_zstd_buffer>(std::move(archive));
+            headerStream.rdbuf(headerArchive.get());
+        }
+    } else if (headerFileBuffer.open(headerFilePath.string(), std::ios::binary | std::ios::in)) {
+        headerStream.rdbuf(&headerFileBuffer);
+    }
+    payload_reader payloadReader;
+    bool payloadOpened = payloadReader.open(payloadFilePath.string(), ioPolicy, readaheadWindow);
+    payloadArchive = payloadReader.archive();
 
-    if (!headerStream.is_open()) {
+    if (headerStream.rdbuf() == nullptr) {
         std::string info = "Error opening header file (";
         info += strerror(errno);
         info += "): " + headerFilePath.string();
-        BOOST_LOG_TRIVIAL(error) << info << std::endl;
+        ZLOG(error) << info << std::endl;
         std::cout << info << std::endl;
 
         return 101;
     }
 
     // Check for file open errors
-    if (!payloadStream.is_open()) {
+    if (!payloadOpened) {
         std::string info = "Error opening payload file (";
         info += strerror(errno);
         info += "): " + payloadFilePath.string();
-        BOOST_LOG_TRIVIAL(error) << info << std::endl;
+        ZLOG(error) << info << std::endl;
         std::cout << info << std::endl;
 
-        headerStream.close();
+        headerFileBuffer.close();
         return 102;
     }
 
+    if (aggregates) {
+        std::streamoff aggregatedPos = 0;
+        aggregates->load(aggregatePath, aggregatedPos);
+        if (aggregatedPos < lastHeaderPos) {
+            ZLOG(debug) << "Catching up on aggregates from position " << aggregatedPos << " to " << lastHeaderPos << std::endl;
+            catch_up_aggregates(headerStream, headerBase + aggregatedPos, headerBase + lastHeaderPos, filter, *aggregates);
+        }
+    }
+
+    // Header file is read through 'headerStream', so hints are issued on a descriptor of its own
+    io_advisor headerAdvisor = headerArchive ? io_advisor() : io_advisor::open(headerFilePath.string(), ioPolicy, readaheadWindow);
+    const std::streamoff initialHeaderPos = lastHeaderPos;
+    std::chrono::steady_clock::duration busyTime{0};
+
     //
     unsigned long processedEntries = 0L;
+    unsigned long skippedEntries = 0L;
+    unsigned long skippedPayloadBytes = 0L;
+    unsigned long streamedEntries = 0L;
     signed int remainingReadAttempts = 0;
+
+    // Ready entries waiting for their (adjacent) payloads to be read
+    std::vector<batched_entry> batch;
+    std::streamsize batchBytes = 0;
+    auto coalesceLimit = static_cast<std::streamsize>(get_numeric_option(options, "coalesce", IO_COALESCE_LIMIT));
+
+    // Payloads above threshold are handed to action in chunks, so that no payload needs to fit in memory.
+    // With a memory ceiling, payload buffers get (at most) half of it
+    auto streamThreshold = static_cast<std::streamsize>(get_numeric_option(options, "stream-threshold", IO_STREAM_THRESHOLD));
+    auto chunkSize = static_cast<std::streamsize>(get_numeric_option(options, "chunk-size", IO_STREAM_CHUNK_SIZE));
+    const auto maxMemory = static_cast<std::streamsize>(get_numeric_option(options, "max-memory", 0));
+    if (maxMemory > 0) {
+        if (maxMemory < 2 * IO_DIRECT_ALIGNMENT * 16) {
+            throw std::invalid_argument("--max-memory is too small: " + std::to_string(maxMemory));
+        }
+        const std::streamsize payloadBudget = maxMemory / 2 - 2 * IO_DIRECT_ALIGNMENT; // room for aligning direct reads
+        coalesceLimit = std::min(coalesceLimit, payloadBudget);
+        streamThreshold = std::min(streamThreshold, payloadBudget);
+        payloadReader.set_memory_limit(static_cast<std::size_t>(maxMemory / 2));
+    }
+    chunkSize = std::max<std::streamsize>(1, std::min(chunkSize, std::max<std::streamsize>(streamThreshold, 1)));
+
+    // Entries may be taken straight from the writer, through shared memory, if the writer offers it
+    const bool liveTail = has_option(options, "live-tail");
+    fs::path livePath = headerFilePath;
+    livePath.replace_extension(LIVE_RING_SUFFIX);
+    live_ring_reader liveRing;
+    unsigned long liveEntries = 0L;
+    unsigned long liveOverruns = 0L;
+
+    // Common wrap up, whatever the reason for ending
+    auto wrap_up = [&]() -> std::string {
+        headerAdvisor.release(headerBase + lastHeaderPos, true);
+        payloadReader.release(payloadBase + lastPayloadPos, true);
+        std::string ioReport = io_report(ioPolicy, (lastHeaderPos - initialHeaderPos) + payloadReader.bytes_read(), busyTime, headerFilePath, payloadFilePath);
+        ZLOG(info) << ioReport << std::endl;
+        ZLOG(info) << "Filter skipped " << skippedEntries << " entries (" << skippedPayloadBytes << " payload bytes not read)" << std::endl;
+        ZLOG(info) << "Streamed " << streamedEntries << " entries in chunks of " << chunkSize << " bytes" << std::endl;
+        if (liveTail) {
+            ZLOG(info) << "Took " << liveEntries << " entries from live ring (fell behind writer " << liveOverruns << " times)" << std::endl;
+        }
+
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            ZLOG(info) << "Peak resident memory " << usage.ru_maxrss / 1024 << " MB" << std::endl;
+        }
+
+        if (archived) {
+            const unsigned long long frames = (headerArchive ? headerArchive->archive().frames_decompressed() : 0)
+                                              + (payloadArchive ? payloadArchive->frames_decompressed() : 0);
+            const unsigned long long compressedBytes = (headerArchive ? headerArchive->archive().compressed_bytes_read() : 0)
+                                                       + (payloadArchive ? payloadArchive->compressed_bytes_read() : 0);
+            ZLOG(info) << "Decompressed " << frames << " frames of archived pair (" << compressedBytes << " compressed bytes read)" << std::endl;
+        }
+
+        headerFileBuffer.close();
+        payloadReader.close();
+
+        if (aggregates) {
+            aggregates->save(aggregatePath, lastHeaderPos);
+        }
+        return ioReport;
+    };
+
+    // Consumes entries from live ring (for at most 'duration') as long as they follow right after
+    // what has been processed, and returns when files must be read to catch up
+    auto tail_live_ring = [&](std::chrono::steady_clock::duration duration) {
+        const auto until = std::chrono::steady_clock::now() + duration;
+        bool stateChanged = false;
+        live_entry entry;
+
+        while (!preemptionRequested && std::chrono::steady_clock::now() < until) {
+            const live_ring_reader::result result = liveRing.peek(entry);
+            if (result == live_ring_reader::result::OVERRUN) {
+                ++liveOverruns; // fell behind the writer
+                break;
+            }
+            if (result == live_ring_reader::result::EMPTY) {
+                if (liveRing.closed()) {
+                    liveRing.detach();
+                    break;
+                }
+                if (stateChanged) {
+                    save_state(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
+                    stateChanged = false;
+                }
+                liveRing.wait(std::chrono::milliseconds(100));
+                continue;
+            }
+            const auto entryHeaderPos = static_cast<std::streamoff>(entry.headerOffset);
+            if (entryHeaderPos < lastHeaderPos) {
+                liveRing.consume(); // already read from file
+                continue;
+            }
+            if (entryHeaderPos > lastHeaderPos) {
+                // Entries in between are only to be found in files, once the writer has flushed them
+                if (header_size() >= entryHeaderPos
+                    && payload_size() >= static_cast<std::streamoff>(entry.payloadOffset)) {
+                    break;
+                }
+                liveRing.wait(std::chrono::milliseconds(100));
+                continue;
+            }
+
+            std::string_view line = entry.headerLine;
+            if (line.ends_with('\n')) {
+                line.remove_suffix(1);
+            }
+            std::vector<std::string> headerData = split(std::string(line), ',');
+            if (headerData.size() != NUMBER_HEADER_FIELDS) {
+                break; // leave it to file reading
+            }
+            auto inputSize = static_cast<std::streamsize>(std::stoul(headerData[7]));
+            auto outputSize = static_cast<std::streamsize>(std::stoul(headerData[8]));
+            if (static_cast<std::size_t>(inputSize + outputSize) != entry.payload.size()) {
+                break;
+            }
+
+            lastHeaderPos += static_cast<std::streamoff>(entry.headerLine.size());
+            lastPayloadPos = static_cast<std::streamoff>(entry.payloadOffset + entry.payload.size());
+            stateChanged = true;
+            if (!filter.empty() && !filter.matches(headerData)) {
+                skippedEntries++;
+                skippedPayloadBytes += inputSize + outputSize;
+            } else {
+                const char* payload = entry.payload.data();
+                ZLOG_PROBE3(action_start, shard, inputSize, outputSize);
+                process_header_and_payload(headerData, payload, inputSize, payload + inputSize, outputSize, accSize, accCount);
+                ZLOG_PROBE3(action_end, shard, inputSize, outputSize);
+                processedEntries++;
+                liveEntries++;
+
+                if (aggregates) {
+                    aggregates->add(headerData, inputSize, outputSize);
+                    if (processedEntries % AGGREGATE_CHECKPOINT_INTERVAL == 0) {
+                        // State first, as for batches, so aggregates are never ahead of it
+                        save_state(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
+                        stateChanged = false;
+                        aggregates->save(aggregatePath, lastHeaderPos);
+                    }
+                }
+            }
+            liveRing.consume();
+            remainingReadAttempts = 0;
+        }
+        if (stateChanged) {
+            save_state(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
+        }
+    };
+
+    // Written by the writer when it closes the pair, holding final file sizes
+    fs::path sealPath = headerFilePath;
+    sealPath.replace_extension(".sealed");
+    std::streamoff sealedHeaderSize = inSegment || archived ? header_size() : 0; // compacted and archived pairs were sealed
+    std::streamoff sealedPayloadSize = inSegment || archived ? payload_size() : 0;
+
     while (true) {
+        // Observe seal *before* reading, since everything is written by the time it appears
+        const bool sealed = inSegment || archived || load_seal(sealPath, sealedHeaderSize, sealedPayloadSize);
+
         try {
-            if (get_filesize(headerFilePath.string()) > lastHeaderPos) {
+            if (header_size() > lastHeaderPos) {
+                auto busySince = std::chrono::steady_clock::now();
+
                 // Seek to the last known position in the header file
                 headerStream.clear(); // clears EOF flag if set
-                headerStream.seekg(lastHeaderPos);
+                headerStream.seekg(headerBase + lastHeaderPos);
+                headerAdvisor.advance(headerBase + lastHeaderPos);
+
+                // Read header entries. Entries whose payloads are adjacent in the payload file (as they
+                // usually are, since writers append) are batched and their payloads read in one go
+                std::streamoff knownPayloadSize = payload_size();
+                bool stateChanged = false;
+
+                auto process_batch = [&]() {
+                    if (batch.empty()) {
+                        return;
+                    }
+                    const std::streamoff batchStart = batch.front().offset;
+                    const std::streamoff batchEnd = batch.back().offset + batch.back().inputSize + batch.back().outputSize;
+                    const char* payloads = payloadReader.read(payloadBase + batchStart, static_cast<std::size_t>(batchEnd - batchStart));
+
+                    const unsigned long processedBefore = processedEntries;
+                    std::size_t done = 0;
+                    while (done < batch.size()) {
+                        const batched_entry& entry = batch[done++];
+                        const char* payload = payloads + (entry.offset - batchStart);
+
+                        // Process input/output
+                        ZLOG_PROBE3(action_start, shard, entry.inputSize, entry.outputSize);
+                        process_header_and_payload(entry.headerData, payload, entry.inputSize, payload + entry.inputSize, entry.outputSize, accSize, accCount);
+                        ZLOG_PROBE3(action_end, shard, entry.inputSize, entry.outputSize);
+                        processedEntries++;
+
+                        if (aggregates) {
+                            aggregates->add(entry.headerData, entry.inputSize, entry.outputSize);
+                        }
+                        if (preemptionRequested) {
+                            break; // rest of batch is read again by whoever picks up this pair
+                        }
+                    }
+
+                    // Update the last read position in both the header and payload files, and persist them
+                    const batched_entry& last = batch[done - 1];
+                    lastPayloadPos = last.offset + last.inputSize + last.outputSize;
+                    lastHeaderPos = last.nextHeaderPos;
+                    save_state(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
+                    stateChanged = false;
+                    headerAdvisor.release(headerBase + lastHeaderPos);
+                    payloadReader.release(payloadBase + lastPayloadPos);
+                    remainingReadAttempts = 0;
+
+                    if (aggregates && processedEntries / AGGREGATE_CHECKPOINT_INTERVAL != processedBefore / AGGREGATE_CHECKPOINT_INTERVAL) {
+                        aggregates->save(aggregatePath, lastHeaderPos);
+                    }
+                    batch.clear();
+                    batchBytes = 0;
+                };
+
+                // Entries with large payloads are handed over chunk by chunk, reusing the same read buffer
+                auto stream_entry = [&](const std::vector<std::string>& headerData, std::streamoff offset,
+                                        std::streamsize inputSize, std::streamsize outputSize, std::streamoff nextHeaderPos) {
+                    ZLOG_PROBE3(action_start, shard, inputSize, outputSize);
+                    begin_streamed_entry(headerData, inputSize, outputSize);
+
+                    const std::tuple<payload_part, std::streamoff, std::streamsize> parts[] = {
+                        { payload_part::INPUT, offset, inputSize },
+                        { payload_part::OUTPUT, offset + inputSize, outputSize }
+                    };
+                    for (const auto& [part, partOffset, partSize] : parts) {
+                        for (std::streamoff position = 0; position < partSize; position += chunkSize) {
+                            const std::streamsize length = std::min<std::streamsize>(chunkSize, partSize - position);
+                            const char* chunk = payloadReader.read(payloadBase + partOffset + position, static_cast<std::size_t>(length));
+                            process_payload_chunk(headerData, part, chunk, length, position, partSize);
+
+                            // Already consumed, so no need to keep it in page cache (if so instructed)
+                            payloadReader.release(payloadBase + partOffset + position + length);
+                        }
+                    }
+                    end_streamed_entry(headerData, inputSize, outputSize, accSize, accCount);
+                    ZLOG_PROBE3(action_end, shard, inputSize, outputSize);
+                    processedEntries++;
+                    streamedEntries++;
+
+                    if (aggregates) {
+                        aggregates->add(headerData, inputSize, outputSize);
+                    }
 
-                // Read header entries
+                    lastPayloadPos = offset + inputSize + outputSize;
+                    lastHeaderPos = nextHeaderPos;
+                    save_state(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
+                    stateChanged = false;
+                    headerAdvisor.release(headerBase + lastHeaderPos);
+                    remainingReadAttempts = 0;
+
+                    if (aggregates && processedEntries % AGGREGATE_CHECKPOINT_INTERVAL == 0) {
+                        aggregates->save(aggregatePath, lastHeaderPos);
+                    }
+                };
+
+                std::streamoff headerPos = lastHeaderPos; // kept track of here, since tellg() costs a syscall
                 std::string line;
-                while (std::getline(headerStream, line)) {
+                while (!preemptionRequested && std::getline(headerStream, line)) {
+                    headerPos += static_cast<std::streamoff>(line.size()) + 1;
+                    if (inSegment && headerPos > sealedHeaderSize) {
+                        break; // into payload of pair
+                    }
                     std::vector<std::string> headerData = split(line, ',');
 
-                    if (headerData.size() != NUMBER_HEADER_FIELDS) {
+                    // An entry is not complete until its newline is written
+                    if (headerData.size() != NUMBER_HEADER_FIELDS || headerStream.eof()) {
                         if (remainingReadAttempts == 0) {
                             remainingReadAttempts = NUMBER_HEADER_READ_ATTEMPTS;
                         } else {
                             --remainingReadAttempts;
                         }
-                        BOOST_LOG_TRIVIAL(info) << "Header not ready: " << headerFile << " -- Remaining attempts: " << remainingReadAttempts << std::endl;
+                        ZLOG_RATE_LIMITED(info, LOG_RATE_LIMIT_INTERVAL) << "Header not ready: " << headerFile << " -- Remaining attempts: " << remainingReadAttempts << std::endl;
                         break; // try again later
                     }
 
                     auto inputSize = static_cast<std::streamsize>(std::stoul(headerData[7]));
                     auto outputSize = static_cast<std::streamsize>(std::stoul(headerData[8]));
                     auto offset = static_cast<std::streamoff>(std::stoul(headerData[9]));
+                    ZLOG_PROBE4(entry_parsed, shard, headerPos, inputSize, outputSize);
 
                     // Check if the corresponding payload data is fully written
                     std::streamoff expectedPayloadSize = offset + inputSize + outputSize;
 
-                    // Get the current payload file size
-                    if (get_filesize(payloadFilePath.string()) >= expectedPayloadSize) {
-                        // Payload data is available. Seek to the last read position in the payload file
-                        payloadStream.clear(); // clears EOF flag if set
-                        payloadStream.seekg(offset);
-
-                        // Process input/output
-                        process_header_and_payload(headerData, inputSize, outputSize, payloadStream, accSize, accCount);
-                        processedEntries++;
+                    if (!filter.empty() && !filter.matches(headerData)) {
+                        // Not of interest -- advance past entry without touching payload file
+                        process_batch();
+                        if (preemptionRequested) {
+                            break;
+                        }
+                        skippedEntries++;
+                        skippedPayloadBytes += inputSize + outputSize;
 
-                        // Update the last read position in both the header and payload files
                         lastPayloadPos = expectedPayloadSize;
-                        lastHeaderPos = headerStream.tellg();
-
-                        // Persist the current read positions
-                        save_state(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
+                        lastHeaderPos = headerPos;
+                        stateChanged = true;
                         remainingReadAttempts = 0;
-                    } else {
+                        continue;
+                    }
+
+                    // Check payload file size only when the last known size does not suffice
+                    if (expectedPayloadSize > knownPayloadSize) {
+                        knownPayloadSize = payload_size();
+                    }
+                    if (expectedPayloadSize > knownPayloadSize) {
+                        ZLOG_PROBE3(payload_not_ready, shard, expectedPayloadSize, knownPayloadSize);
                         break; // try again later
                     }
+                    ZLOG_PROBE3(payload_ready, shard, offset, inputSize + outputSize);
+
+                    // Payload data is available. Large payloads are streamed on their own
+                    const std::streamsize length = inputSize + outputSize;
+                    if (length > streamThreshold) {
+                        process_batch();
+                        if (preemptionRequested) {
+                            break;
+                        }
+                        stream_entry(headerData, offset, inputSize, outputSize, headerPos);
+                        continue;
+                    }
+
+                    // Start a new batch unless adjacent to the current one
+                    if (!batch.empty()
+                        && (offset != batch.back().offset + batch.back().inputSize + batch.back().outputSize
+                            || batchBytes + length > coalesceLimit
+                            || batch.size() >= IO_COALESCE_MAX_ENTRIES)) {
+                        process_batch();
+                        if (preemptionRequested) {
+                            break;
+                        }
+                    }
+                    batch.push_back({ std::move(headerData), offset, inputSize, outputSize, headerPos });
+                    batchBytes += length;
+                }
+                process_batch();
+
+                if (stateChanged) {
+                    save_state(stateDir, shard, lastHeaderPos, lastPayloadPos, accSize, accCount);
+                    headerAdvisor.release(headerBase + lastHeaderPos);
                 }
+                busyTime += std::chrono::steady_clock::now() - busySince;
             }
         } catch (const std::exception& e) {
             std::string info = "Aborting processing of ";
@@ -249,44 +695,88 @@ int process(
             info += payloadFilePath.string();
             info += ": ";
             info += e.what();
-            BOOST_LOG_TRIVIAL(error) << info << std::endl;
+            ZLOG(error) << info << std::endl;
             throw;
         }
 
-        std::this_thread::sleep_for(std::chrono::seconds(10));
+        // State is saved per entry, so we may leave the rest to whoever picks up this pair later.
+        // Reading stops at the next entry, so a pair that is part read is not taken for a torn one
+        if (preemptionRequested && !(sealed && lastHeaderPos >= sealedHeaderSize)) {
+            std::string ioReport = wrap_up();
+
+            std::cout << "Preempted at offset " << lastHeaderPos << " after processing " << processedEntries
+                      << " entries, skipped " << skippedEntries << " entries. " << ioReport << std::endl;
+            return STATUS_PREEMPTED;
+        }
+
+        // Check if the writer has sealed this pair, in which case there will be no more data
+        if (sealed) {
+            if (lastHeaderPos >= sealedHeaderSize) {
+                ZLOG(info) << "Writer sealed " << headerFile << " at " << sealedHeaderSize
+                           << " and all entries are consumed" << std::endl;
+
+                std::string ioReport = wrap_up();
+                write_to_object_store("Sealed by writer, clean flush...");
+
+                std::cout << "Processed " << processedEntries << " entries, skipped " << skippedEntries
+                          << " entries (" << skippedPayloadBytes << " payload bytes). " << ioReport << std::endl;
+                return STATUS_ENDED_SUCCESSFULLY;
+            }
+
+            // Everything the writer will ever write is there, so a torn tail will not mend itself
+            ZLOG(error) << "Writer sealed " << headerFile << " at " << sealedHeaderSize
+                        << ", but entry at offset " << lastHeaderPos << " is incomplete" << std::endl;
+
+            std::string ioReport = wrap_up();
+            write_to_object_store("Sealed by writer, unclean flush...");
+
+            std::cout << "Successfully processed " << processedEntries
+                      << " entries, skipped " << skippedEntries
+                      << " entries (" << skippedPayloadBytes << " payload bytes). Header file " << headerFile
+                      << " is sealed, but incomplete at offset " << lastHeaderPos << " for "
+                      << tm_to_string(date, DATE_FORMAT) << ". " << ioReport << std::endl;
+            return STATUS_ENDED_UNSUCCESSFULLY;
+        }
+
+        // Wait for more, taking entries straight from the writer when possible
+        if (liveTail && (liveRing.attached() || liveRing.attach(livePath.string()))) {
+            tail_live_ring(std::chrono::seconds(10));
+        } else {
+            for (int i = 0; i < 100 && !preemptionRequested; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
 
         // Check if we have rolled over to the next day
         if (differs_from_today(date) && remainingReadAttempts == 0) {
-            BOOST_LOG_TRIVIAL(info) << "Detected date rollover to " << tm_to_string(today(), DATE_FORMAT)
+            ZLOG(info) << "Detected date rollover to " << tm_to_string(today(), DATE_FORMAT)
             << ". Can not read more data from " << tm_to_string(date, DATE_FORMAT) << std::endl;
 
-            headerStream.close();
-            payloadStream.close();
-
+            std::string ioReport = wrap_up();
             write_to_object_store("Date roll over, clean flush...");
 
-            std::cout << "Processed " << processedEntries << " entries" << std::endl;
+            std::cout << "Processed " << processedEntries << " entries, skipped " << skippedEntries
+                      << " entries (" << skippedPayloadBytes << " payload bytes). " << ioReport << std::endl;
             return STATUS_ENDED_SUCCESSFULLY;
         }
 
         if (remainingReadAttempts > 0) {
             if (remainingReadAttempts == 1) {
                 // We have tried many times, but we will give up now
-                BOOST_LOG_TRIVIAL(error) << "Detected date rollover to "
+                ZLOG(error) << "Detected date rollover to "
                          << tm_to_string(today(), DATE_FORMAT)
                          << ". Repeatedly failed to read from header file " << headerFile
                          << " at offset " << lastHeaderPos << " for "
                          << tm_to_string(date, DATE_FORMAT) << std::endl;
 
-                headerStream.close();
-                payloadStream.close();
-
+                std::string ioReport = wrap_up();
                 write_to_object_store("Date roll over, unclean flush...");
 
                 std::cout << "Successfully processed " << processedEntries
-                          << " entries. Repeatedly failed to read header file " << headerFile
+                          << " entries, skipped " << skippedEntries
+                          << " entries (" << skippedPayloadBytes << " payload bytes). Repeatedly failed to read header file " << headerFile
                           << " at offset " << lastHeaderPos << " for "
-                          << tm_to_string(date, DATE_FORMAT) << std::endl;
+                          << tm_to_string(date, DATE_FORMAT) << ". " << ioReport << std::endl;
 
                 return STATUS_ENDED_UNSUCCESSFULLY;
             }
@@ -1,51 +1,288 @@
 //
 // Created by Frode Randers on 2024-09-25.
 //
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <string_view>
+#include <vector>
 
 #include <boost/log/trivial.hpp>
 
 #include "zlog.h"
+#include "logging.h"
+#include "batch.h"
+#include "dedup.h"
+#include "journal.h"
+#include "probes.h"
 
+namespace fs = boost::filesystem;
 namespace logging = boost::log;
 
+// Batch being built, when shipping batches to an outbox (standing in for the object store)
+static std::unique_ptr<batch_builder> batch;
+static fs::path outboxDir;
+static std::string batchPrefix;
+static batch_format batchFormat = batch_format::COLUMNAR;
+static unsigned long batchSequence = 0;
+static int batchShard = 0;
+
+// Payloads seen recently, when deduplicating. Locations refer to batches by index in 'batchNames'
+static std::unique_ptr<payload_dedup> dedup;
+static std::vector<std::string> batchNames;
+
+// Journal of batch being built, so that it is not lost if we end before shipping it
+static std::unique_ptr<batch_journal> journal;
+
+static std::string next_batch_name() {
+    return batchPrefix + "-" + std::to_string(batchSequence + 1) + ".batch";
+}
+
+static void next_batch() {
+    if (dedup) {
+        batchNames.push_back(next_batch_name());
+    }
+}
+
+void open_outbox(const fs::path& outbox, int shard, batch_format format, std::size_t dedupCapacity) {
+    if (dedupCapacity > 0 && format == batch_format::ROWS) {
+        throw std::invalid_argument("Deduplication needs columnar batches");
+    }
+
+    // Pooled workers handle one pair after the other, and may refer to payloads of earlier pairs
+    // -- unless in another outbox, or if batches of earlier pairs were not shipped
+    if (outbox != outboxDir || dedupCapacity == 0 || (batch && batch->entries() > 0)) {
+        dedup.reset();
+        batchNames.clear();
+    }
+    journal.reset();
+    batch.reset();
+    outboxDir = outbox;
+    batchFormat = format;
+    batchSequence = 0;
+    batchShard = shard;
+    if (outbox.empty()) {
+        return;
+    }
+    const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    batchPrefix = "processor-" + std::to_string(shard) + "-" + std::to_string(now.count());
+    batch = std::make_unique<batch_builder>(outboxDir / (batchPrefix + ".spill"));
+
+    if (dedupCapacity > 0) {
+        if (!dedup) {
+            dedup = std::make_unique<payload_dedup>(dedupCapacity);
+        }
+        dedup->reset_statistics();
+        next_batch();
+    }
+}
+
+void open_journal(const fs::path& stateDir, int shard, std::streamoff headerPos, std::streamoff payloadPos, unsigned long& size, unsigned long& count) {
+    journal.reset();
+    if (!batch) {
+        return;
+    }
+    journal = std::make_unique<batch_journal>(stateDir / ("processor-" + std::to_string(shard) + ".journal"));
+
+    const journal_replay replayed = journal->replay(headerPos, payloadPos, outboxDir, next_batch_name(), *batch);
+    switch (replayed.outcome) {
+        case journal_outcome::REPLAYED:
+            ZLOG(info) << "Rebuilt batch of " << replayed.entries << " entries (" << replayed.bytes << " payload bytes) from journal" << std::endl;
+            size = replayed.bytes;
+            count = replayed.entries;
+            break;
+
+        case journal_outcome::SHIPPED:
+            ZLOG(info) << "Batch in journal was already shipped" << std::endl;
+            size = 0L;
+            count = 0L;
+            break;
+
+        case journal_outcome::STALE:
+            // Entries after saved state are read again, but those before it (as counted in state) are lost
+            if (count > 0) {
+                ZLOG(warning) << "Journal does not match saved state, so " << count << " entries of unshipped batch are lost" << std::endl;
+            }
+            break;
+
+        case journal_outcome::EMPTY:
+            break;
+    }
+}
+
+// Called when state is saved, so that batch may be rebuilt up to that point
+void commit_to_journal(std::streamoff headerPos, std::streamoff payloadPos) {
+    if (journal) {
+        journal->checkpoint(headerPos, payloadPos);
+    }
+}
+
+
+// Stores payload part of entry in batch, or a reference to where it was stored before
+static void add_to_batch(std::string_view part) {
+    if (dedup && part.size() >= DEDUP_MIN_SIZE) {
+        const payload_location here = { static_cast<std::uint32_t>(batchNames.size() - 1), batch->payload_bytes() };
+        if (auto earlier = dedup->find_or_remember(part, here)) {
+            batch->add_reference(batchNames[earlier->batch], earlier->offset, part.size());
+            if (journal) {
+                journal->add_reference(batchNames[earlier->batch], earlier->offset, part.size());
+            }
+            return;
+        }
+    }
+    batch->add_payload(part.data(), part.size());
+    if (journal) {
+        journal->add_payload(part.data(), part.size());
+    }
+}
 
 void write_to_object_store(const std::string& reason) {
-        BOOST_LOG_TRIVIAL(debug) << "Wrap up and save to ObjectStore: " << reason << std::endl;
+        ZLOG(debug) << "Wrap up and save to ObjectStore: " << reason << std::endl;
+
+        if (batch && batch->entries() > 0) {
+            const std::size_t entries = batch->entries();
+            const std::uint64_t headerBytes = batch->header_bytes();
+            const std::uint64_t payloadBytes = batch->payload_bytes();
+            const std::size_t references = batch->references();
+            const std::uint64_t referencedBytes = batch->referenced_bytes();
+            fs::path batchPath = outboxDir / (batchPrefix + "-" + std::to_string(++batchSequence) + ".batch");
+
+            const std::uint64_t encodedBytes = batch->write(batchPath, batchFormat);
+            ZLOG_PROBE4(batch_sealed, batchShard, entries, encodedBytes, payloadBytes);
+            std::string referenced;
+            if (references > 0) {
+                referenced = " (and " + std::to_string(references) + " references to " + std::to_string(referencedBytes) + " bytes stored before)";
+            }
+            ZLOG(info) << "Shipped " << entries << " entries to " << batchPath.filename() << " (" << batch_format_name(batchFormat)
+                       << "): header fields " << encodedBytes << " bytes (" << headerBytes << " as rows), and "
+                       << payloadBytes << " payload bytes" << referenced << std::endl;
+            if (dedup) {
+                const double ratio = dedup->lookups() > 0 ? 100.0 * dedup->hits() / dedup->lookups() : 0.0;
+                ZLOG(info) << "Deduplicated " << dedup->hits() << " of " << dedup->lookups() << " payloads of shard so far ("
+                           << ratio << "% hits), saving " << dedup->saved_bytes() << " bytes" << std::endl;
+            }
+            next_batch();
+            if (journal) {
+                journal->start(next_batch_name());
+            }
+        }
+}
+
+// First and last bytes of the payload part being streamed, which may span chunks
+static std::string partHead; // as many bytes as in marker
+static std::string partTail; // one byte less, carried over from previous chunks
+
+void begin_streamed_entry(
+    const std::vector<std::string>& headerData,
+    [[maybe_unused]] const std::streamsize inputSize, [[maybe_unused]] const std::streamsize outputSize
+) {
+    //--------------------------------------------------------------------------
+    // Payloads larger than the stream threshold are not handed over in one
+    // piece, but as a sequence of chunks (each only valid for the duration of
+    // its call). This is called before the first chunk of an entry.
+    //--------------------------------------------------------------------------
+    if (batch) {
+        batch->begin_entry(headerData);
+        if (journal) {
+            journal->begin_entry(headerData);
+        }
+    }
+}
+
+void process_payload_chunk(
+    [[maybe_unused]] const std::vector<std::string>& headerData,
+    const payload_part part,
+    const char* data, const std::streamsize length,
+    const std::streamoff position, const std::streamsize partSize
+) {
+    // Same checks as for whole payloads, spread over the chunks
+    if (batch) {
+        batch->add_payload(data, static_cast<std::size_t>(length));
+        if (journal) {
+            journal->add_payload(data, static_cast<std::size_t>(length));
+        }
+    }
+
+    const bool isInput = part == payload_part::INPUT;
+    const std::string_view marker = isInput ? "Input" : "Output";
+    const auto chunkSize = static_cast<std::size_t>(length);
+
+    if (position == 0) {
+        partHead.clear();
+        partTail.clear();
+    }
+    if (partHead.size() < marker.size()) {
+        partHead.append(data, std::min(chunkSize, marker.size() - partHead.size()));
+    }
+
+    // Last chunk is checked together with what was carried over, in case it is shorter than marker
+    const std::size_t keep = position + length == partSize ? marker.size() : marker.size() - 1;
+    partTail.append(data + (chunkSize > keep ? chunkSize - keep : 0), std::min(chunkSize, keep));
+    if (partTail.size() > keep) {
+        partTail.erase(0, partTail.size() - keep);
+    }
+
+    if (position + length == partSize) {
+        if (!partHead.starts_with(marker) && partTail.ends_with(marker)) {
+            ZLOG(error) << "Corrupt " << (isInput ? "input" : "output") << " of " << partSize << " bytes" << std::endl;
+            throw std::underflow_error("Corrupt " + std::string(isInput ? "input" : "output") + " of " + std::to_string(partSize) + " bytes");
+        }
+    }
+}
+
+void end_streamed_entry(
+    [[maybe_unused]] const std::vector<std::string>& headerData,
+    const std::streamsize inputSize, const std::streamsize outputSize,
+    unsigned long& size, unsigned long& count
+) {
+    size += inputSize + outputSize;
+    ++count;
+
+    if (size > NOMINAL_BATCH_SIZE || count > NOMINAL_BATCH_COUNT) {
+        write_to_object_store("Reached limit: size=" + std::to_string(size) + " count=" + std::to_string(count));
+
+        // Reset accumulators
+        size = 0L;
+        count = 0L;
+    }
 }
 
 void process_header_and_payload(
     const std::vector<std::string>& headerData,
-    const std::streamsize inputSize,
-    const std::streamsize outputSize,
-    std::ifstream& payloadStream,
+    const char* inputData, const std::streamsize inputSize,
+    const char* outputData, const std::streamsize outputSize,
     unsigned long& size, unsigned long& count
 ) {
     //--------------------------------------------------------------------------
     // Here you have the individual header fields (in 'headerData'),
-    // payload data: input (in 'input') and output (in 'output').
+    // payload data: input (in 'inputData') and output (in 'outputData').
+    // Payload data is only valid for the duration of this call.
     //--------------------------------------------------------------------------
 
-    // For debugging purposes, we read the data and makes some checks based on
-    // knowledge of what zloggen (z-log generator, i.e. a test application) is writing...
-    std::vector<char> inputBuffer(inputSize);
-    std::vector<char> outputBuffer(outputSize);
-
-    payloadStream.read(inputBuffer.data(), inputSize);
-    payloadStream.read(outputBuffer.data(), outputSize);
-
-    std::string input = std::string(inputBuffer.begin(), inputBuffer.end());
-    std::string output = std::string(outputBuffer.begin(), outputBuffer.end());
+    // For debugging purposes, we make some checks based on knowledge of
+    // what zloggen (z-log generator, i.e. a test application) is writing...
+    std::string_view input(inputData, inputSize);
+    std::string_view output(outputData, outputSize);
 
     if (!input.starts_with("Input") && input.ends_with("Input")) {
-        BOOST_LOG_TRIVIAL(error) << "Corrupt input: " << input << std::endl;
-        throw std::underflow_error("Corrupt input: " + input);
+        ZLOG(error) << "Corrupt input: " << input << std::endl;
+        throw std::underflow_error("Corrupt input: " + std::string(input));
     }
 
     if (!output.starts_with("Output") && output.ends_with("Output")) {
-        BOOST_LOG_TRIVIAL(error) << "Corrupt output: " << output << std::endl;
-        throw std::underflow_error("Corrupt output: " + output);
+        ZLOG(error) << "Corrupt output: " << output << std::endl;
+        throw std::underflow_error("Corrupt output: " + std::string(output));
+    }
+
+    if (batch) {
+        batch->begin_entry(headerData);
+        if (journal) {
+            journal->begin_entry(headerData);
+        }
+        add_to_batch(input);
+        add_to_batch(output);
     }
 
     size += inputSize + outputSize;
@@ -0,0 +1,193 @@
+//
+// Support for scheduling processors
+//
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "zlog.h"
+#include "logging.h"
+#include "scheduler.h"
+#include "seekable.h"
+
+namespace fs = boost::filesystem;
+
+// Forward declarations
+void load_state(const fs::path& path, unsigned long id, std::streamoff &lastHeaderPos, std::streamoff &lastPayloadPos, unsigned long& size, unsigned long& count);
+
+
+// Archived files are measured by their decompressed size, since positions in state refer to that
+static long long file_size_or_zero(const fs::path& path) {
+    if (path.extension() == ARCHIVE_SUFFIX) {
+        std::unique_ptr<seekable_zstd_file> archive = seekable_zstd_file::open(path.string());
+        return archive ? static_cast<long long>(archive->size()) : 0;
+    }
+    struct stat stat_buf;
+    return stat(path.c_str(), &stat_buf) == 0 ? stat_buf.st_size : 0;
+}
+
+static unsigned long long backlog_of(const fs::path& dirPath, unsigned int shard, long long headerSize, long long payloadSize) {
+    std::streamoff lastHeaderPos = 0;
+    std::streamoff lastPayloadPos = 0;
+    unsigned long size = 0L;
+    unsigned long count = 0L;
+    load_state(dirPath, shard, lastHeaderPos, lastPayloadPos, size, count);
+
+    long long headerBacklog = headerSize - lastHeaderPos;
+    long long payloadBacklog = payloadSize - lastPayloadPos;
+    return static_cast<unsigned long long>(std::max(0LL, headerBacklog) + std::max(0LL, payloadBacklog));
+}
+
+unsigned long long backlog_bytes(const fs::path& dirPath, unsigned int shard, const std::string& headerFile, const std::string& payloadFile) {
+    return backlog_of(dirPath, shard, file_size_or_zero(dirPath / headerFile), file_size_or_zero(dirPath / payloadFile));
+}
+
+unsigned long long backlog_bytes(const fs::path& dirPath, unsigned int shard, std::uint64_t headerLength, std::uint64_t payloadLength) {
+    return backlog_of(dirPath, shard, static_cast<long long>(headerLength), static_cast<long long>(payloadLength));
+}
+
+std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> cpus;
+    std::stringstream ss(text);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        std::string::size_type dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+std::string format_cpu_list(const std::vector<int>& cpus) {
+    std::string text;
+    for (std::size_t i = 0; i < cpus.size();) {
+        std::size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            ++j;
+        }
+        if (!text.empty()) {
+            text += ",";
+        }
+        text += std::to_string(cpus[i]);
+        if (j > i) {
+            text += "-" + std::to_string(cpus[j]);
+        }
+        i = j + 1;
+    }
+    return text;
+}
+
+bool pin_to_cpus(const std::vector<int>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+pin_mode parse_pin_mode(const std::string& name) {
+    if (name.empty() || name == "none") {
+        return pin_mode::NONE;
+    } else if (name == "core") {
+        return pin_mode::CORE;
+    } else if (name == "numa") {
+        return pin_mode::NUMA;
+    }
+    throw std::invalid_argument("Unknown pin mode \"" + name + "\". Use none, core or numa");
+}
+
+std::vector<int> available_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    return cpus;
+}
+
+cpu_allocator::cpu_allocator(pin_mode mode) : pinMode(mode) {
+    if (mode == pin_mode::NONE) {
+        return;
+    }
+
+    const std::vector<int> cpus = available_cpus();
+    if (cpus.empty()) {
+        ZLOG(warning) << "CPU pinning is not supported on this platform" << std::endl;
+        pinMode = pin_mode::NONE;
+        return;
+    }
+
+    if (mode == pin_mode::NUMA) {
+        const std::set<int> allowed(cpus.begin(), cpus.end());
+        for (int node = 0; ; ++node) {
+            std::ifstream nodeFile("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!nodeFile) {
+                break;
+            }
+            std::string line;
+            std::getline(nodeFile, line);
+
+            std::vector<int> nodeCpus;
+            for (int cpu : parse_cpu_list(line)) {
+                if (allowed.count(cpu)) {
+                    nodeCpus.push_back(cpu);
+                }
+            }
+            if (!nodeCpus.empty()) {
+                slots.push_back(nodeCpus);
+            }
+        }
+        if (slots.empty()) {
+            slots.push_back(cpus); // one node, as far as we can tell
+        }
+    } else {
+        for (int cpu : cpus) {
+            slots.push_back({ cpu });
+        }
+    }
+    load.assign(slots.size(), 0);
+
+    ZLOG(info) << "Pinning processors to " << slots.size() << (pinMode == pin_mode::NUMA ? " NUMA nodes" : " cores") << std::endl;
+}
+
+int cpu_allocator::acquire(std::vector<int>& cpus) {
+    if (pinMode == pin_mode::NONE || slots.empty()) {
+        return -1;
+    }
+    auto slot = static_cast<int>(std::min_element(load.begin(), load.end()) - load.begin());
+    ++load[slot];
+    cpus = slots[slot];
+    return slot;
+}
+
+void cpu_allocator::release(int slot) {
+    if (slot >= 0 && slot < static_cast<int>(load.size()) && load[slot] > 0) {
+        --load[slot];
+    }
+}
@@ -0,0 +1,60 @@
+//
+// Support for scheduling processors: backlog estimates (so that the shards
+// furthest behind run first) and CPU placement of processors.
+//
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+// Bytes written but not yet consumed by processor 'shard', according to its checkpoint
+unsigned long long backlog_bytes(
+    const boost::filesystem::path& dirPath, unsigned int shard,
+    const std::string& headerFile, const std::string& payloadFile
+);
+
+// Same, for a pair compacted into a segment (with lengths as found in the segment index)
+unsigned long long backlog_bytes(
+    const boost::filesystem::path& dirPath, unsigned int shard,
+    std::uint64_t headerLength, std::uint64_t payloadLength
+);
+
+// CPU lists on the form "0-3,8,10-11"
+std::vector<int> parse_cpu_list(const std::string& text);
+std::string format_cpu_list(const std::vector<int>& cpus);
+
+// Pin calling thread (and threads it starts thereafter) to CPUs
+bool pin_to_cpus(const std::vector<int>& cpus);
+
+// CPUs the calling thread is allowed to run on
+std::vector<int> available_cpus();
+
+enum class pin_mode { NONE, CORE, NUMA };
+
+// Throws std::invalid_argument on unknown mode names
+pin_mode parse_pin_mode(const std::string& name);
+
+// Hands out CPU placements to processors, either one core each (round robin,
+// least loaded first) or all cores of the least loaded NUMA node
+class cpu_allocator {
+public:
+    explicit cpu_allocator(pin_mode mode);
+
+    // Returns slot number (or -1 if not pinning), with CPUs for slot in 'cpus'
+    int acquire(std::vector<int>& cpus);
+    void release(int slot);
+
+    pin_mode mode() const { return pinMode; }
+
+private:
+    pin_mode pinMode;
+    std::vector<std::vector<int>> slots; // CPUs per slot (core or node)
+    std::vector<unsigned int> load;      // processors per slot
+};
+
+#endif // SCHEDULER_H
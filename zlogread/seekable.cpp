@@ -0,0 +1,240 @@
+//
+// Reading of archived files in seekable zstd format (see seekable.h)
+//
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef ZLOG_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "zlog.h"
+#include "logging.h"
+#include "dedup.h"
+#include "seekable.h"
+
+static constexpr std::uint32_t SKIPPABLE_MAGIC = 0x184D2A5E;
+static constexpr std::uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+static constexpr std::size_t FOOTER_SIZE = 9;
+static constexpr std::size_t SKIPPABLE_HEADER_SIZE = 8;
+
+static std::uint32_t get_u32(const char* p) {
+    const auto* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<std::uint32_t>(b[0]) | static_cast<std::uint32_t>(b[1]) << 8
+           | static_cast<std::uint32_t>(b[2]) << 16 | static_cast<std::uint32_t>(b[3]) << 24;
+}
+
+static void read_fully(int fd, char* buffer, std::size_t length, std::uint64_t offset, const std::string& path) {
+    std::size_t got = 0;
+    while (got < length) {
+        ssize_t n = pread(fd, buffer + got, length - got, static_cast<off_t>(offset + got));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Failed to read " + path + ": " + strerror(errno));
+        }
+        if (n == 0) {
+            throw std::runtime_error("Unexpected end of " + path + " at " + std::to_string(offset + got));
+        }
+        got += static_cast<std::size_t>(n);
+    }
+}
+
+std::unique_ptr<seekable_zstd_file> seekable_zstd_file::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    std::unique_ptr<seekable_zstd_file> file(new seekable_zstd_file(fd, path));
+    try {
+#ifndef ZLOG_HAVE_ZSTD
+        throw std::runtime_error("zlogread was built without zstd");
+#else
+        file->read_seek_table();
+#endif
+    } catch (const std::exception& e) {
+        ZLOG(error) << "Cannot read " << path << ": " << e.what() << std::endl;
+        errno = EINVAL;
+        return nullptr;
+    }
+    return file;
+}
+
+seekable_zstd_file::seekable_zstd_file(int fd, const std::string& path) : fd(fd), path(path) {
+}
+
+seekable_zstd_file::~seekable_zstd_file() {
+#ifdef ZLOG_HAVE_ZSTD
+    ZSTD_freeDCtx(context);
+#endif
+    ::close(fd);
+}
+
+void seekable_zstd_file::read_seek_table() {
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        throw std::runtime_error(strerror(errno));
+    }
+    const auto fileSize = static_cast<std::uint64_t>(stat_buf.st_size);
+    if (fileSize < SKIPPABLE_HEADER_SIZE + FOOTER_SIZE) {
+        throw std::runtime_error("Not in seekable format (too short)");
+    }
+
+    char footer[FOOTER_SIZE];
+    read_fully(fd, footer, FOOTER_SIZE, fileSize - FOOTER_SIZE, path);
+    const std::uint32_t frameCount = get_u32(footer);
+    const auto descriptor = static_cast<std::uint8_t>(footer[4]);
+    if (get_u32(footer + 5) != SEEKABLE_MAGIC) {
+        throw std::runtime_error("Not in seekable format (no seek table)");
+    }
+    if ((descriptor & 0x7C) != 0) {
+        throw std::runtime_error("Unknown seek table descriptor " + std::to_string(descriptor));
+    }
+    const bool hasChecksums = descriptor & 0x80;
+    const std::size_t entrySize = hasChecksums ? 12 : 8;
+
+    const std::uint64_t tableSize = static_cast<std::uint64_t>(frameCount) * entrySize + FOOTER_SIZE;
+    if (tableSize + SKIPPABLE_HEADER_SIZE > fileSize) {
+        throw std::runtime_error("Corrupt seek table (" + std::to_string(frameCount) + " frames)");
+    }
+    std::string table(SKIPPABLE_HEADER_SIZE + tableSize, '\0');
+    const std::uint64_t tableAt = fileSize - table.size();
+    read_fully(fd, table.data(), table.size(), tableAt, path);
+    if (get_u32(table.data()) != SKIPPABLE_MAGIC || get_u32(table.data() + 4) != tableSize) {
+        throw std::runtime_error("Corrupt seek table (no skippable frame)");
+    }
+
+    compressedOffsets.reserve(frameCount + 1);
+    decompressedOffsets.reserve(frameCount + 1);
+    const char* entry = table.data() + SKIPPABLE_HEADER_SIZE;
+    for (std::uint32_t i = 0; i < frameCount; ++i, entry += entrySize) {
+        compressedOffsets.push_back(compressedOffsets.back() + get_u32(entry));
+        decompressedOffsets.push_back(decompressedOffsets.back() + get_u32(entry + 4));
+        if (hasChecksums) {
+            checksums.push_back(get_u32(entry + 8));
+        }
+    }
+    if (compressedOffsets.back() != tableAt) {
+        throw std::runtime_error("Corrupt seek table (frames take " + std::to_string(compressedOffsets.back())
+                                 + " bytes, rather than " + std::to_string(tableAt) + ")");
+    }
+
+#ifdef ZLOG_HAVE_ZSTD
+    context = ZSTD_createDCtx();
+    if (context == nullptr) {
+        throw std::bad_alloc();
+    }
+#endif
+}
+
+std::size_t seekable_zstd_file::frame_at(std::uint64_t offset) const {
+    auto it = std::upper_bound(decompressedOffsets.begin(), decompressedOffsets.end(), offset);
+    return static_cast<std::size_t>(it - decompressedOffsets.begin()) - 1;
+}
+
+std::string_view seekable_zstd_file::frame(std::size_t frame) {
+    if (frame == currentFrame) {
+        return decompressed;
+    }
+    const std::uint64_t compressedSize = compressedOffsets[frame + 1] - compressedOffsets[frame];
+    const std::uint64_t decompressedSize = decompressedOffsets[frame + 1] - decompressedOffsets[frame];
+    compressed.resize(compressedSize);
+    decompressed.resize(decompressedSize);
+    currentFrame = static_cast<std::size_t>(-1); // until decompressed
+    read_fully(fd, compressed.data(), compressed.size(), compressedOffsets[frame], path);
+    compressedBytesRead += compressedSize;
+
+#ifdef ZLOG_HAVE_ZSTD
+    const std::size_t result = ZSTD_decompressDCtx(context, decompressed.data(), decompressed.size(), compressed.data(), compressed.size());
+    if (ZSTD_isError(result)) {
+        throw std::runtime_error("Corrupt frame " + std::to_string(frame) + " of " + path + ": " + ZSTD_getErrorName(result));
+    }
+    if (result != decompressedSize) {
+        throw std::runtime_error("Corrupt frame " + std::to_string(frame) + " of " + path + ": " + std::to_string(result)
+                                 + " bytes rather than " + std::to_string(decompressedSize));
+    }
+#endif
+    if (!checksums.empty() && static_cast<std::uint32_t>(payload_digest(decompressed)) != checksums[frame]) {
+        throw std::runtime_error("Checksum mismatch in frame " + std::to_string(frame) + " of " + path);
+    }
+    ++framesDecompressed;
+    currentFrame = frame;
+    return decompressed;
+}
+
+const char* seekable_zstd_file::read(std::uint64_t offset, std::size_t length) {
+    if (offset + length > size()) {
+        throw std::underflow_error("Archived file " + path + " ends at " + std::to_string(size())
+                                   + ", expected data up to " + std::to_string(offset + length));
+    }
+    if (length == 0) {
+        return assembled.data();
+    }
+    std::size_t index = frame_at(offset);
+    std::string_view data = frame(index);
+    const std::uint64_t within = offset - frame_start(index);
+    if (within + length <= data.size()) {
+        return data.data() + within;
+    }
+
+    // Spans frames
+    assembled.clear();
+    assembled.reserve(length);
+    assembled.append(data.substr(within));
+    while (assembled.size() < length) {
+        data = frame(++index);
+        assembled.append(data.substr(0, std::min<std::size_t>(data.size(), length - assembled.size())));
+    }
+    return assembled.data();
+}
+
+
+seekable_zstd_buffer::int_type seekable_zstd_buffer::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    const std::uint64_t at = position();
+    if (at >= file->size()) {
+        return traits_type::eof();
+    }
+    const std::size_t index = file->frame_at(at);
+    std::string_view data = file->frame(index);
+    char* begin = const_cast<char*>(data.data()); // never written through
+    frameStart = file->frame_start(index);
+    setg(begin, begin + (at - frameStart), begin + data.size());
+    return traits_type::to_int_type(*gptr());
+}
+
+seekable_zstd_buffer::pos_type seekable_zstd_buffer::seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) {
+    off_type base = 0;
+    if (direction == std::ios_base::cur) {
+        base = static_cast<off_type>(position());
+    } else if (direction == std::ios_base::end) {
+        base = static_cast<off_type>(file->size());
+    }
+    return seekpos(pos_type(base + offset), which);
+}
+
+seekable_zstd_buffer::pos_type seekable_zstd_buffer::seekpos(pos_type position, std::ios_base::openmode which) {
+    const auto to = static_cast<off_type>(position);
+    if (!(which & std::ios_base::in) || to < 0 || static_cast<std::uint64_t>(to) > file->size()) {
+        return pos_type(off_type(-1));
+    }
+
+    // Within current frame, just move within get area. Otherwise frame is decompressed when read
+    const auto target = static_cast<std::uint64_t>(to);
+    if (eback() != nullptr && target >= frameStart && target < frameStart + static_cast<std::uint64_t>(egptr() - eback())) {
+        setg(eback(), eback() + (target - frameStart), egptr());
+    } else {
+        setg(nullptr, nullptr, nullptr);
+        frameStart = target;
+    }
+    return position;
+}
@@ -0,0 +1,99 @@
+//
+// Archived header and payload files, compressed in the seekable zstd format (<stem>.header.zst
+// and <stem>.payload.zst). Such a file is a series of independent zstd frames, followed by a
+// seek table in a skippable frame:
+//
+//   frames x { zstd frame }
+//   0x184D2A5E:u32 tableSize:u32
+//   frames x { compressed:u32 decompressed:u32 [checksum:u32] }
+//   frames:u32 descriptor:u8 0x8F92EAB1:u32      descriptor bit 7: entries have checksums
+//
+// All integers are little endian. Checksums are the lower 32 bits of XXH64 of decompressed
+// frames. Offsets (as in header fields and processor state) refer to decompressed data, and are
+// located through the seek table -- so that reading at an offset only decompresses the frames
+// covering it. Reading needs zlogread built with zstd (ZLOG_HAVE_ZSTD).
+//
+
+#ifndef SEEKABLE_H
+#define SEEKABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct ZSTD_DCtx_s;
+
+class seekable_zstd_file {
+public:
+    // Returns nullptr (with errno set) if file could not be opened. Files not in seekable
+    // format, or when built without zstd, are logged and give EINVAL
+    static std::unique_ptr<seekable_zstd_file> open(const std::string& path);
+    ~seekable_zstd_file();
+
+    seekable_zstd_file(const seekable_zstd_file&) = delete;
+    seekable_zstd_file& operator=(const seekable_zstd_file&) = delete;
+
+    // Size of decompressed data
+    std::uint64_t size() const { return decompressedOffsets.back(); }
+    std::size_t frames() const { return decompressedOffsets.size() - 1; }
+
+    // Frame covering decompressed 'offset' (which must be below size()), and where it starts
+    std::size_t frame_at(std::uint64_t offset) const;
+    std::uint64_t frame_start(std::size_t frame) const { return decompressedOffsets[frame]; }
+
+    // Decompressed frame, valid until another frame is decompressed. Throws std::runtime_error
+    // on I/O errors and corrupt frames
+    std::string_view frame(std::size_t frame);
+
+    // Pointer to 'length' decompressed bytes at 'offset', valid until next call. Throws
+    // std::underflow_error if data ends before that
+    const char* read(std::uint64_t offset, std::size_t length);
+
+    // Frames decompressed, and compressed bytes read, so far
+    unsigned long long frames_decompressed() const { return framesDecompressed; }
+    unsigned long long compressed_bytes_read() const { return compressedBytesRead; }
+
+private:
+    seekable_zstd_file(int fd, const std::string& path);
+    void read_seek_table();
+
+    int fd;
+    std::string path;
+    ZSTD_DCtx_s* context = nullptr;
+
+    std::vector<std::uint64_t> compressedOffsets = { 0 };   // of each frame, and end of last
+    std::vector<std::uint64_t> decompressedOffsets = { 0 };
+    std::vector<std::uint32_t> checksums;                   // if any
+
+    std::string compressed;
+    std::string decompressed;  // current frame
+    std::size_t currentFrame = static_cast<std::size_t>(-1);
+    std::string assembled;     // reads spanning frames
+
+    unsigned long long framesDecompressed = 0;
+    unsigned long long compressedBytesRead = 0;
+};
+
+// Stream buffer over an archived file, for reading (and seeking in) headers as if plain
+class seekable_zstd_buffer : public std::streambuf {
+public:
+    explicit seekable_zstd_buffer(std::unique_ptr<seekable_zstd_file> file) : file(std::move(file)) {}
+
+    const seekable_zstd_file& archive() const { return *file; }
+
+protected:
+    int_type underflow() override;
+    pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type position, std::ios_base::openmode which) override;
+
+private:
+    std::uint64_t position() const { return frameStart + static_cast<std::uint64_t>(gptr() - eback()); }
+
+    std::unique_ptr<seekable_zstd_file> file;
+    std::uint64_t frameStart = 0; // decompressed offset of get area
+};
+
+#endif // SEEKABLE_H
@@ -0,0 +1,255 @@
+//
+// Segments of compacted pairs
+//
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "options.h"
+#include "segment.h"
+
+namespace fs = boost::filesystem;
+
+#define SEGMENT_MAGIC   "ZLSG"
+#define SEGMENT_VERSION 1
+#define TRAILER_SIZE    (8 + 8 + 4)
+
+
+static void put_le(std::string& out, std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+static std::uint64_t get_le(const char* data, int bytes) {
+    std::uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= static_cast<std::uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+static void put_varint(std::string& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static std::uint64_t get_varint(const std::string& data, std::size_t& pos) {
+    std::uint64_t value = 0;
+    for (int shift = 0; shift < 64 && pos < data.size(); shift += 7) {
+        auto byte = static_cast<unsigned char>(data[pos++]);
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Corrupt segment index");
+}
+
+void write_segment_index(int fd, std::uint64_t at, const std::vector<segment_pair>& pairs, const std::string& path) {
+    std::string index;
+    put_varint(index, pairs.size());
+    for (const segment_pair& pair : pairs) {
+        put_varint(index, pair.stem.size());
+        index += pair.stem;
+        put_varint(index, pair.finished ? 1 : 0);
+        put_varint(index, pair.entries);
+        put_varint(index, pair.firstEntry);
+        put_varint(index, pair.headerOffset);
+        put_varint(index, pair.headerLength);
+        put_varint(index, pair.payloadOffset);
+        put_varint(index, pair.payloadLength);
+        put_varint(index, static_cast<std::uint64_t>(pair.modifiedSeconds));
+        put_varint(index, static_cast<std::uint64_t>(pair.modifiedNanos));
+        std::uint64_t previous = 0;
+        for (std::uint64_t offset : pair.sparse) {
+            put_varint(index, offset - previous);
+            previous = offset;
+        }
+    }
+    put_le(index, at, 8);
+    put_le(index, index.size() - 8, 8);
+    index += SEGMENT_MAGIC;
+
+    const char* data = index.data();
+    std::size_t length = index.size();
+    off_t offset = static_cast<off_t>(at);
+    while (length > 0) {
+        ssize_t written = ::pwrite(fd, data, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Could not write " + path + ": " + strerror(errno));
+        }
+        data += written;
+        length -= static_cast<std::size_t>(written);
+        offset += written;
+    }
+}
+
+segment_index::segment_index(const fs::path& path) : segmentPath(path) {
+    const auto size = static_cast<std::uint64_t>(fs::file_size(path));
+    if (size < 5 + TRAILER_SIZE) {
+        throw std::runtime_error("Not a segment: " + path.string());
+    }
+    const std::string trailer = read(size - TRAILER_SIZE, TRAILER_SIZE);
+    if (trailer.compare(16, 4, SEGMENT_MAGIC) != 0 || read(0, 4) != SEGMENT_MAGIC) {
+        throw std::runtime_error("Not a segment: " + path.string());
+    }
+    if (static_cast<unsigned char>(read(4, 1)[0]) != SEGMENT_VERSION) {
+        throw std::runtime_error("Unknown segment version: " + path.string());
+    }
+    const std::uint64_t indexOffset = get_le(trailer.data(), 8);
+    const std::uint64_t indexLength = get_le(trailer.data() + 8, 8);
+    if (indexOffset + indexLength + TRAILER_SIZE != size) {
+        throw std::runtime_error("Corrupt segment: " + path.string());
+    }
+
+    const std::string index = read(indexOffset, indexLength);
+    std::size_t pos = 0;
+    for (std::uint64_t count = get_varint(index, pos); count > 0; --count) {
+        segment_pair pair;
+        const std::uint64_t stemLength = get_varint(index, pos);
+        if (pos + stemLength > index.size()) {
+            throw std::runtime_error("Corrupt segment index: " + path.string());
+        }
+        pair.stem = index.substr(pos, stemLength);
+        pos += stemLength;
+        pair.finished = get_varint(index, pos) != 0;
+        pair.entries = get_varint(index, pos);
+        pair.firstEntry = get_varint(index, pos);
+        pair.headerOffset = get_varint(index, pos);
+        pair.headerLength = get_varint(index, pos);
+        pair.payloadOffset = get_varint(index, pos);
+        pair.payloadLength = get_varint(index, pos);
+        pair.modifiedSeconds = static_cast<std::int64_t>(get_varint(index, pos));
+        pair.modifiedNanos = static_cast<std::int64_t>(get_varint(index, pos));
+        if (pair.headerOffset + pair.headerLength > indexOffset || pair.payloadOffset + pair.payloadLength > indexOffset) {
+            throw std::runtime_error("Corrupt segment index: " + path.string());
+        }
+        std::uint64_t offset = 0;
+        for (std::uint64_t i = 0; i < (pair.entries + SEGMENT_INDEX_INTERVAL - 1) / SEGMENT_INDEX_INTERVAL; ++i) {
+            offset += get_varint(index, pos);
+            pair.sparse.push_back(offset);
+        }
+        pairList.push_back(std::move(pair));
+    }
+}
+
+std::string segment_index::read(std::uint64_t offset, std::uint64_t length) const {
+    std::ifstream in(segmentPath.string(), std::ios::binary);
+    std::string data(length, '\0');
+    in.seekg(static_cast<std::streamoff>(offset));
+    if (!in.read(data.data(), static_cast<std::streamsize>(length))) {
+        throw std::runtime_error("Could not read " + std::to_string(length) + " bytes at " + std::to_string(offset)
+                                 + " in " + segmentPath.string());
+    }
+    return data;
+}
+
+const segment_pair* segment_index::find(const std::string& stem) const {
+    for (const segment_pair& pair : pairList) {
+        if (pair.stem == stem) {
+            return &pair;
+        }
+    }
+    return nullptr;
+}
+
+std::string segment_index::header_line(const segment_pair& pair, std::uint64_t entry) const {
+    if (entry >= pair.entries) {
+        throw std::out_of_range("No entry " + std::to_string(entry) + " in " + pair.stem + " (of " + std::to_string(pair.entries) + ")");
+    }
+    // Read from closest indexed entry, at most SEGMENT_INDEX_INTERVAL lines
+    std::uint64_t offset = pair.sparse[entry / SEGMENT_INDEX_INTERVAL];
+    std::ifstream in(segmentPath.string(), std::ios::binary);
+    in.seekg(static_cast<std::streamoff>(pair.headerOffset + offset));
+
+    std::string line;
+    for (std::uint64_t i = entry - entry % SEGMENT_INDEX_INTERVAL; i <= entry; ++i) {
+        if (!std::getline(in, line)) {
+            throw std::runtime_error("Corrupt segment: " + segmentPath.string());
+        }
+    }
+    return line + "\n";
+}
+
+std::string segment_index::payload(const segment_pair& pair, std::uint64_t offset, std::uint64_t length) const {
+    if (offset + length > pair.payloadLength) {
+        throw std::out_of_range("Payload beyond end of " + pair.stem);
+    }
+    return read(pair.payloadOffset + offset, length);
+}
+
+std::vector<fs::path> find_segments(const fs::path& dayDir) {
+    std::vector<fs::path> segments;
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(dayDir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->path().extension() == SEGMENT_SUFFIX) {
+            segments.push_back(it->path());
+        }
+    }
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+bool find_in_segments(const fs::path& dayDir, const std::string& stem, fs::path& segmentPath, segment_pair& pair) {
+    for (const fs::path& path : find_segments(dayDir)) {
+        segment_index index(path);
+        if (const segment_pair* found = index.find(stem)) {
+            segmentPath = path;
+            pair = *found;
+            return true;
+        }
+    }
+    return false;
+}
+
+// zlogread --dump-segment [--stem=S [--entry=N]] <file>
+int dump_segment(const std::string& path, const option_map& options) {
+    segment_index index(path);
+    if (has_option(options, "stem")) {
+        const segment_pair* pair = index.find(get_option(options, "stem"));
+        if (pair == nullptr) {
+            std::cerr << "No pair " << get_option(options, "stem") << " in " << path << std::endl;
+            return STATUS_INVALID_ARGUMENT;
+        }
+        if (!has_option(options, "entry")) {
+            for (std::uint64_t entry = 0; entry < pair->entries; ++entry) {
+                std::cout << index.header_line(*pair, entry);
+            }
+            return STATUS_ENDED_SUCCESSFULLY;
+        }
+        // Header line and payload (input followed by output) of a single entry
+        const std::string line = index.header_line(*pair, get_numeric_option(options, "entry", 0));
+        std::vector<std::string> fields;
+        std::string::size_type start = 0;
+        for (std::string::size_type comma; (comma = line.find(',', start)) != std::string::npos; start = comma + 1) {
+            fields.push_back(line.substr(start, comma - start));
+        }
+        fields.push_back(line.substr(start, line.size() - start - 1));
+        if (fields.size() != NUMBER_HEADER_FIELDS) {
+            throw std::runtime_error("Corrupt header line in " + pair->stem + ": " + line);
+        }
+        std::cout << line << index.payload(*pair, std::stoull(fields[9]), std::stoull(fields[7]) + std::stoull(fields[8])) << std::endl;
+        return STATUS_ENDED_SUCCESSFULLY;
+    }
+
+    std::cout << path << ": " << index.pairs().size() << " pairs" << std::endl;
+    for (const segment_pair& pair : index.pairs()) {
+        std::cout << "  " << pair.stem << ": entries " << pair.firstEntry << "-" << pair.firstEntry + pair.entries
+                  << ", header " << pair.headerLength << " bytes at " << pair.headerOffset
+                  << ", payload " << pair.payloadLength << " bytes at " << pair.payloadOffset
+                  << ", modified " << pair.modifiedSeconds << (pair.finished ? ", finished" : "") << std::endl;
+    }
+    return STATUS_ENDED_SUCCESSFULLY;
+}
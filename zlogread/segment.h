@@ -0,0 +1,77 @@
+//
+// Segments hold the pairs of a day once it is done, compacted into a few large files
+// (<day>/segment-N.zseg) rather than thousands of small ones.
+//
+// Header and payload of each pair are kept verbatim, one after the other, so that offsets in
+// header lines and in processor-N.state remain valid relative to the pair. An index at the end
+// locates pairs, and entries within pairs. All integers are little endian:
+//
+//   "ZLSG" version:u8
+//   per pair: header bytes, payload bytes
+//   index:    varint count, then per pair (varints): stem length, stem, finished, entries, first
+//             entry (number in segment), header offset, header length, payload offset, payload
+//             length, modified (seconds, nanoseconds), and the header offset (in pair) of every
+//             SEGMENT_INDEX_INTERVAL'th entry, as differences
+//   trailer:  index offset:u64 index length:u64 "ZLSG"
+//
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "zlog.h"
+
+struct segment_pair {
+    std::string stem;
+    bool finished = false;      // processed before compaction
+    std::uint64_t entries = 0;
+    std::uint64_t firstEntry = 0;
+    std::uint64_t headerOffset = 0;
+    std::uint64_t headerLength = 0;
+    std::uint64_t payloadOffset = 0;
+    std::uint64_t payloadLength = 0;
+    std::int64_t modifiedSeconds = 0; // of .header, as last written
+    std::int64_t modifiedNanos = 0;
+    std::vector<std::uint64_t> sparse; // header offset (in pair) of entry i * SEGMENT_INDEX_INTERVAL
+};
+
+// Writes index and trailer, for pairs already written to 'fd' (at the offsets given)
+void write_segment_index(int fd, std::uint64_t at, const std::vector<segment_pair>& pairs, const std::string& path);
+
+class segment_index {
+public:
+    // Reads index of segment. Throws std::runtime_error if not a segment
+    explicit segment_index(const boost::filesystem::path& path);
+
+    const boost::filesystem::path& path() const { return segmentPath; }
+    const std::vector<segment_pair>& pairs() const { return pairList; }
+
+    // Pair with 'stem', or nullptr
+    const segment_pair* find(const std::string& stem) const;
+
+    // Header line (with newline) of entry number 'entry' in pair, found through the sparse index
+    std::string header_line(const segment_pair& pair, std::uint64_t entry) const;
+
+    // Bytes at 'offset' in payload of pair
+    std::string payload(const segment_pair& pair, std::uint64_t offset, std::uint64_t length) const;
+
+private:
+    std::string read(std::uint64_t offset, std::uint64_t length) const;
+
+    boost::filesystem::path segmentPath;
+    std::vector<segment_pair> pairList;
+};
+
+// Segments in day directory, in name order
+std::vector<boost::filesystem::path> find_segments(const boost::filesystem::path& dayDir);
+
+// Looks for pair with 'stem' among segments in day directory
+bool find_in_segments(const boost::filesystem::path& dayDir, const std::string& stem,
+                      boost::filesystem::path& segmentPath, segment_pair& pair);
+
+#endif // SEGMENT_H
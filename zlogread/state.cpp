@@ -0,0 +1,79 @@
+//
+// Processor state, i.e. last read positions and batch accumulators, kept in
+// processor-N.state in the day directory
+//
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "zlog.h"
+#include "logging.h"
+#include "probes.h"
+
+namespace fs = boost::filesystem;
+
+// Forward declarations
+void commit_to_journal(std::streamoff headerPos, std::streamoff payloadPos);
+
+static std::vector<std::string> split(const std::string& line, char delimiter) {
+    std::vector<std::string> result;
+    std::stringstream ss(line);
+    std::string item;
+
+    while (std::getline(ss, item, delimiter)) {
+        result.push_back(item);
+    }
+
+    return result;
+}
+
+// Utility function to save the current state (last read positions)
+void save_state(const fs::path& path, unsigned long id, std::streamoff lastHeaderPos, std::streamoff lastPayloadPos, unsigned long size, unsigned long count) {
+    std::string name = "processor-" + std::to_string(id) + ".state";
+    fs::path statePath = path;
+    statePath /= name;
+
+    // Journal first, so that it holds what the batch had at (at least) this point
+    commit_to_journal(lastHeaderPos, lastPayloadPos);
+
+    std::ofstream stateStream(statePath.string(), std::ios::binary | std::ios::out | std::ios::trunc);
+    if (stateStream) {
+        stateStream
+            << std::to_string(lastHeaderPos) << ","
+            << std::to_string(lastPayloadPos) << ","
+            << std::to_string(size) << ","
+            << std::to_string(count) << std::endl;
+        stateStream.close();
+    }
+    ZLOG_PROBE3(checkpoint, id, lastHeaderPos, lastPayloadPos);
+}
+
+// Utility function to load the saved state (last read positions)
+void load_state(const fs::path& path, unsigned long id, std::streamoff &lastHeaderPos, std::streamoff &lastPayloadPos, unsigned long& size, unsigned long& count) {
+    std::string name = "processor-" + std::to_string(id) + ".state";
+    fs::path statePath = path;
+    statePath /= name;
+
+    std::ifstream stateFile(statePath.string(), std::ios::binary | std::ios::in);
+    if (stateFile) {
+        std::string line;
+        if (std::getline(stateFile, line)) {
+            std::vector<std::string> data = split(line, ',');
+            if (data.size() != 4) {
+                ZLOG(error) << "Corrupt state: " << line << " (" << name << ")" << std::endl;
+            } else {
+                lastHeaderPos = static_cast<std::streamoff>(std::stoul(data[0]));
+                lastPayloadPos = static_cast<std::streamoff>(std::stoul(data[1]));
+                size = static_cast<std::streamoff>(std::stoul(data[2]));
+                count = static_cast<std::streamoff>(std::stoul(data[3]));
+                ZLOG(trace) << "Loaded state [" << id <<"]: header=" << lastHeaderPos << ", payload=" << lastPayloadPos << ", size=" << size << ", count=" << count << std::endl;
+            }
+        } else {
+            ZLOG(debug) << "Empty file: " << name << std::endl;
+        }
+        stateFile.close();
+    }
+}
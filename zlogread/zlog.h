@@ -11,6 +11,46 @@
 #define NOMINAL_BATCH_COUNT 5000L
 #define NOMINAL_BATCH_SIZE  1000000L
 
+#define AGGREGATE_CHECKPOINT_INTERVAL 1000L
+#define AGGREGATE_RESULT_FILE "aggregates.result"
+
+#define IO_READAHEAD_WINDOW     (4L * 1024 * 1024)
+#define IO_RELEASE_GRANULARITY  (1L * 1024 * 1024)
+#define IO_DIRECT_ALIGNMENT     4096L
+#define IO_COALESCE_LIMIT       (1L * 1024 * 1024) // payload bytes read in one go, at most
+#define IO_COALESCE_MAX_ENTRIES 4096
+#define IO_STREAM_THRESHOLD     (8L * 1024 * 1024) // larger payloads are handed to action in chunks
+#define IO_STREAM_CHUNK_SIZE    (1L * 1024 * 1024)
+
+#define DEDUP_CAPACITY          65536 // payload digests remembered
+#define DEDUP_MIN_SIZE          32    // smaller payloads are not worth a reference
+
+#define LOG_RATE_LIMIT_INTERVAL 60 // seconds
+
+#define SCHEDULER_SCAN_INTERVAL         std::chrono::seconds(1)
+#define SCHEDULER_PREEMPTION_GRACE      std::chrono::seconds(30)
+#define SCHEDULER_BACKLOG_REFRESH       std::chrono::seconds(10)
+#define SCHEDULER_BACKLOG_ESTIMATES     256 // new pairs estimated per scan (the rest at next refresh)
+#define SCHEDULER_TENANT_REPORT         std::chrono::seconds(60) // metrics per tenant, when serving several
+
+#define POOL_RECYCLE_ASSIGNMENTS        100 // pairs handled by a pooled worker before it is replaced
+
+#define DISCOVERY_BUFFER_SIZE           (1024 * 1024) // for reading directory entries
+#define DISCOVERY_MTIME_MARGIN          2  // seconds, since directory time stamps are coarse
+
+#define COORDINATION_INSTANCES_DIR      ".instances"
+#define COORDINATION_LOCK_FILE          "zlogread.lock"
+#define COORDINATION_SHARD_REGISTRY     "shards.registry"
+#define COORDINATION_LEASE_DURATION     15  // seconds, for leases as well as heartbeats
+#define COORDINATION_VIRTUAL_NODES      64  // points per instance on hash ring
+
+#define SEGMENT_SUFFIX                  ".zseg"
+#define SEGMENT_TARGET_SIZE             (1024L * 1024 * 1024) // compacted pairs per segment, in bytes
+#define SEGMENT_INDEX_INTERVAL          256 // entries between header offsets kept in segment index
+#define COMPACTION_LOCK_FILE            "compaction.lock"
+
+#define ARCHIVE_SUFFIX                  ".zst" // of header and payload files compressed in seekable zstd format
+
 #define DATE_FORMAT "%Y-%m-%d"
 
 #define STATUS_ENDED_SUCCESSFULLY             0
@@ -18,9 +58,13 @@
 #define STATUS_INVALID_ARGUMENT               2
 #define STATUS_GENERAL_FAILURE                3
 #define STATUS_ENDED_UNSUCCESSFULLY          10
+#define STATUS_PREEMPTED                     11
 #define FILE_READ_RELATED_ERRORS            100
 #define STATUS_COULD_NOT_OPEN_HEADER_FILE   101
 #define STATUS_COULD_NOT_OPEN_PAYLOAD_FILE  102
 
 
+// Part of payload, when handed to action in chunks
+enum class payload_part { INPUT, OUTPUT };
+
 #endif // ZLOG_H
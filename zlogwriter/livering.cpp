@@ -0,0 +1,301 @@
+//
+// Live tail of a header/payload pair through shared memory
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <ctime>
+#endif
+
+#include "livering.h"
+
+#define LIVE_RING_MAGIC    0x7a6c6f676c697665ULL // "zloglive"
+#define LIVE_RING_VERSION  1
+#define LIVE_RING_DATA     128 // offset of entries in shared memory object
+
+// Start of shared memory object
+struct live_ring_header {
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t writerPid;
+    std::uint64_t capacity;
+
+    alignas(64) std::atomic<std::uint64_t> reserved; // writer may be writing anywhere below this position
+    std::atomic<std::uint64_t> published;            // end of last complete entry
+    std::atomic<std::uint32_t> sequence;             // bumped for every entry, and waited on by readers
+    std::atomic<std::uint32_t> waiters;
+    std::atomic<std::uint32_t> closed;
+};
+static_assert(sizeof(live_ring_header) <= LIVE_RING_DATA);
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+// Precedes each entry in ring. Positions are logical (ever increasing), and wrap modulo capacity
+struct live_record {
+    std::uint32_t length;       // of record, including this and padding
+    std::uint32_t headerLength; // 0 for filler at end of ring
+    std::uint64_t headerOffset;
+    std::uint64_t payloadOffset;
+    std::uint64_t payloadLength;
+};
+
+static std::size_t align8(std::size_t size) {
+    return (size + 7) & ~static_cast<std::size_t>(7);
+}
+
+static char* data_of(live_ring_header* ring) {
+    return reinterpret_cast<char*>(ring) + LIVE_RING_DATA;
+}
+
+static void wake_readers(live_ring_header* ring) {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&ring->sequence), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+#else
+    (void) ring;
+#endif
+}
+
+live_ring_writer::live_ring_writer(const std::string& sidecarPath, std::size_t capacity) : sidecar(sidecarPath) {
+    static std::atomic<unsigned> rings{0};
+    name = "/zlog-" + std::to_string(getpid()) + "-" + std::to_string(rings++);
+    capacity &= ~static_cast<std::size_t>(7);
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create shared memory " + name + ": " + strerror(errno));
+    }
+    mappedSize = LIVE_RING_DATA + capacity;
+    void* mapped = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(mappedSize)) == 0) {
+        mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Could not map shared memory " + name + ": " + strerror(errno));
+    }
+
+    ring = new (mapped) live_ring_header{};
+    ring->version = LIVE_RING_VERSION;
+    ring->writerPid = static_cast<std::uint32_t>(getpid());
+    ring->capacity = capacity;
+    std::atomic_thread_fence(std::memory_order_release);
+    ring->magic = LIVE_RING_MAGIC;
+
+    // Announced like the seal, so that readers never see it half written
+    {
+        std::ofstream announcement(sidecar + ".tmp", std::ios::out | std::ios::trunc);
+        announcement << name << std::endl;
+    }
+    if (std::rename((sidecar + ".tmp").c_str(), sidecar.c_str()) != 0) {
+        close();
+        throw std::runtime_error("Could not announce live ring in " + sidecar + ": " + strerror(errno));
+    }
+}
+
+live_ring_writer::~live_ring_writer() {
+    close();
+}
+
+bool live_ring_writer::publish(std::string_view headerLine, std::uint64_t headerOffset, std::uint64_t payloadOffset,
+                               std::string_view input, std::string_view output) {
+    if (!ring) {
+        return false;
+    }
+    const std::size_t capacity = ring->capacity;
+    const std::size_t needed = align8(sizeof(live_record) + headerLine.size() + input.size() + output.size());
+    if (needed > capacity / 2) {
+        return false;
+    }
+
+    // Entries are never split, so the end of the ring may be left as filler
+    const std::size_t index = position % capacity;
+    const std::size_t filler = index + needed > capacity ? capacity - index : 0;
+
+    ring->reserved.store(position + filler + needed, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    char* data = data_of(ring);
+    if (filler >= sizeof(live_record)) {
+        live_record record = { static_cast<std::uint32_t>(filler), 0, 0, 0, 0 };
+        std::memcpy(data + index, &record, sizeof(record));
+    }
+    position += filler;
+
+    char* at = data + position % capacity;
+    live_record record = {
+        static_cast<std::uint32_t>(needed), static_cast<std::uint32_t>(headerLine.size()),
+        headerOffset, payloadOffset, input.size() + output.size()
+    };
+    std::memcpy(at, &record, sizeof(record));
+    at += sizeof(record);
+    std::memcpy(at, headerLine.data(), headerLine.size());
+    at += headerLine.size();
+    std::memcpy(at, input.data(), input.size());
+    at += input.size();
+    std::memcpy(at, output.data(), output.size());
+    position += needed;
+
+    ring->published.store(position, std::memory_order_release);
+    ring->sequence.fetch_add(1, std::memory_order_seq_cst);
+    if (ring->waiters.load(std::memory_order_seq_cst) > 0) {
+        wake_readers(ring);
+    }
+    return true;
+}
+
+void live_ring_writer::close() {
+    if (!ring) {
+        return;
+    }
+    ::unlink(sidecar.c_str());
+    shm_unlink(name.c_str());
+
+    ring->closed.store(1, std::memory_order_release);
+    ring->sequence.fetch_add(1, std::memory_order_seq_cst);
+    wake_readers(ring);
+
+    munmap(ring, mappedSize);
+    ring = nullptr;
+}
+
+live_ring_reader::~live_ring_reader() {
+    detach();
+}
+
+bool live_ring_reader::attach(const std::string& sidecarPath) {
+    detach();
+
+    std::ifstream announcement(sidecarPath);
+    std::string name;
+    if (!announcement || !std::getline(announcement, name) || name.empty()) {
+        return false;
+    }
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        return false; // writer has closed ring, or is gone
+    }
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > LIVE_RING_DATA) {
+        mapped = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    auto* candidate = static_cast<live_ring_header*>(mapped);
+    if (candidate->magic != LIVE_RING_MAGIC || candidate->version != LIVE_RING_VERSION
+        || LIVE_RING_DATA + candidate->capacity > static_cast<std::uint64_t>(st.st_size)) {
+        munmap(mapped, static_cast<std::size_t>(st.st_size));
+        return false;
+    }
+    ring = candidate;
+    mappedSize = static_cast<std::size_t>(st.st_size);
+
+    // What was published before we came is read from file
+    seenSequence = ring->sequence.load(std::memory_order_acquire);
+    cursor = nextCursor = ring->published.load(std::memory_order_acquire);
+    return true;
+}
+
+void live_ring_reader::detach() {
+    if (ring) {
+        munmap(ring, mappedSize);
+        ring = nullptr;
+    }
+}
+
+live_ring_reader::result live_ring_reader::peek(live_entry& entry) {
+    if (!ring) {
+        return result::EMPTY;
+    }
+    seenSequence = ring->sequence.load(std::memory_order_acquire);
+    const std::uint64_t published = ring->published.load(std::memory_order_acquire);
+    if (cursor >= published) {
+        return result::EMPTY;
+    }
+
+    const std::size_t capacity = ring->capacity;
+    const char* data = data_of(ring);
+    std::uint64_t at = cursor;
+    live_record record;
+
+    // Step over filler at end of ring
+    if (capacity - at % capacity < sizeof(live_record)) {
+        at += capacity - at % capacity;
+    } else {
+        std::memcpy(&record, data + at % capacity, sizeof(record));
+        if (record.headerLength == 0 && record.length == capacity - at % capacity) {
+            at += record.length;
+        }
+    }
+
+    bool intact = at < published;
+    if (intact) {
+        std::memcpy(&record, data + at % capacity, sizeof(record));
+        intact = record.length >= sizeof(live_record) && record.length <= capacity / 2
+                 && at % capacity + record.length <= capacity && at + record.length <= published
+                 && sizeof(live_record) + record.headerLength + record.payloadLength <= record.length;
+        if (intact) {
+            copy.assign(data + at % capacity, data + at % capacity + record.length);
+        }
+    }
+
+    // Writer may have lapped us while we were copying, in which case the copy is worthless
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!intact || ring->reserved.load(std::memory_order_relaxed) > cursor + capacity) {
+        cursor = nextCursor = ring->published.load(std::memory_order_acquire);
+        return result::OVERRUN;
+    }
+
+    std::memcpy(&record, copy.data(), sizeof(record));
+    entry.headerOffset = record.headerOffset;
+    entry.payloadOffset = record.payloadOffset;
+    entry.headerLine = std::string_view(copy.data() + sizeof(record), record.headerLength);
+    entry.payload = std::string_view(copy.data() + sizeof(record) + record.headerLength, record.payloadLength);
+    nextCursor = at + record.length;
+    return result::ENTRY;
+}
+
+void live_ring_reader::consume() {
+    cursor = nextCursor;
+}
+
+void live_ring_reader::wait(std::chrono::milliseconds timeout) {
+    if (!ring) {
+        std::this_thread::sleep_for(timeout);
+        return;
+    }
+    ring->waiters.fetch_add(1, std::memory_order_seq_cst);
+    if (ring->sequence.load(std::memory_order_seq_cst) == seenSequence) {
+#if defined(__linux__)
+        struct timespec ts;
+        ts.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+        ts.tv_nsec = static_cast<long>(timeout.count() % 1000) * 1000000L;
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&ring->sequence), FUTEX_WAIT, seenSequence, &ts, nullptr, 0);
+#else
+        std::this_thread::sleep_for(std::min(timeout, std::chrono::milliseconds(1)));
+#endif
+    }
+    ring->waiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+bool live_ring_reader::closed() const {
+    return ring && ring->closed.load(std::memory_order_acquire) != 0;
+}
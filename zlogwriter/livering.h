@@ -0,0 +1,100 @@
+//
+// Live tail of a header/payload pair through shared memory, for readers on the same host.
+//
+// A writer that writes entries to .header and .payload also publishes them (header line
+// and payload, along with their offsets in the files) to a ring in shared memory. The ring
+// is announced by a <stem>.live file next to the pair, holding the name of the shared memory
+// object. Readers consume entries from the ring as soon as they are published, without
+// reading the files, and resort to the files for catch-up (e.g. when they have fallen so far
+// behind that the writer has overwritten what they had not read yet). Since entries carry
+// their file offsets, and are only published once written, checkpoints remain file positions
+// that are never beyond the end of the files.
+//
+// The ring never holds the writer back: a single writer overwrites as it goes, and readers
+// detect when that happens. Part of the writer library, but read by zlogread as well, so there
+// are no dependencies beyond POSIX.
+//
+
+#ifndef LIVERING_H
+#define LIVERING_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define LIVE_RING_CAPACITY  (4UL * 1024 * 1024) // bytes of entries, larger entries are not published
+#define LIVE_RING_SUFFIX    ".live"
+
+struct live_ring_header;
+
+// Entry as read from ring, valid until next peek()
+struct live_entry {
+    std::uint64_t headerOffset;  // of header line in .header
+    std::uint64_t payloadOffset; // of input (followed by output) in .payload
+    std::string_view headerLine; // including newline
+    std::string_view payload;
+};
+
+class live_ring_writer {
+public:
+    // Creates ring, and announces it in 'sidecarPath' (<stem>.live). Throws std::runtime_error on failure
+    explicit live_ring_writer(const std::string& sidecarPath, std::size_t capacity = LIVE_RING_CAPACITY);
+    ~live_ring_writer();
+
+    live_ring_writer(const live_ring_writer&) = delete;
+    live_ring_writer& operator=(const live_ring_writer&) = delete;
+
+    // Returns false if entry does not fit in ring, in which case readers read it from file
+    bool publish(std::string_view headerLine, std::uint64_t headerOffset, std::uint64_t payloadOffset,
+                 std::string_view input, std::string_view output);
+
+    // No more entries. Wakes readers and removes the ring (readers keep what they have mapped)
+    void close();
+
+private:
+    std::string sidecar;
+    std::string name;
+    live_ring_header* ring = nullptr;
+    std::size_t mappedSize = 0;
+    std::uint64_t position = 0;
+};
+
+class live_ring_reader {
+public:
+    enum class result { ENTRY, EMPTY, OVERRUN };
+
+    live_ring_reader() = default;
+    ~live_ring_reader();
+
+    live_ring_reader(const live_ring_reader&) = delete;
+    live_ring_reader& operator=(const live_ring_reader&) = delete;
+
+    // Maps ring announced in 'sidecarPath', if any, and starts at its most recent entry
+    bool attach(const std::string& sidecarPath);
+    void detach();
+    bool attached() const { return ring != nullptr; }
+
+    // Copies next entry out of the ring, without moving past it. On OVERRUN, entries have
+    // been lost and reading starts over with the next entry published
+    result peek(live_entry& entry);
+    void consume();
+
+    // Waits (at most 'timeout') for something to be published since last peek()
+    void wait(std::chrono::milliseconds timeout);
+
+    // Writer has closed ring, and there will be nothing more
+    bool closed() const;
+
+private:
+    live_ring_header* ring = nullptr;
+    std::size_t mappedSize = 0;
+    std::uint64_t cursor = 0;
+    std::uint64_t nextCursor = 0;
+    std::uint32_t seenSequence = 0;
+    std::vector<char> copy;
+};
+
+#endif // LIVERING_H
@@ -0,0 +1,216 @@
+//
+// Writer side of a header/payload pair
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "writer.h"
+
+
+static int open_for_appending(const std::string& path, bool appendMode, std::uint64_t& size) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (appendMode ? O_APPEND : 0), 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "Could not open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "Could not stat " + path);
+    }
+    size = static_cast<std::uint64_t>(st.st_size);
+    return fd;
+}
+
+pair_writer::pair_writer(const std::string& dirPath, const std::string& stem, const writer_options& options)
+    : dirPath(dirPath), stem(stem), options(options) {
+    const std::string basePath = dirPath + "/" + stem;
+    payloadFd = open_for_appending(basePath + ".payload", options.appendMode, payloadSize);
+    try {
+        headerFd = open_for_appending(basePath + ".header", options.appendMode, headerSize);
+    } catch (...) {
+        ::close(payloadFd);
+        throw;
+    }
+    bufferedHeaderAt = headerSize;
+    bufferedPayloadAt = payloadSize;
+
+    if (options.live) {
+        liveRing = std::make_unique<live_ring_writer>(basePath + LIVE_RING_SUFFIX, options.liveCapacity);
+    }
+}
+
+pair_writer::~pair_writer() {
+    try {
+        close(false);
+    } catch (...) {
+        // nothing more to be done
+    }
+}
+
+void pair_writer::write_all(int fd, const char* data, std::size_t length, std::uint64_t offset) {
+    while (length > 0) {
+        ssize_t written = options.appendMode
+            ? ::write(fd, data, length)
+            : ::pwrite(fd, data, length, static_cast<off_t>(offset));
+        ++writeCalls;
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "Could not write to " + dirPath + "/" + stem);
+        }
+        data += written;
+        length -= static_cast<std::size_t>(written);
+        offset += static_cast<std::uint64_t>(written);
+    }
+}
+
+void pair_writer::append(std::string_view fields, std::string_view input, std::string_view output) {
+    if (headerFd < 0) {
+        throw std::system_error(EBADF, std::generic_category(), "Appending to closed pair " + stem);
+    }
+
+    std::string line;
+    line.reserve(fields.size() + 64);
+    line.append(fields);
+    line += ',';
+    line += std::to_string(input.size());
+    line += ',';
+    line += std::to_string(output.size());
+    line += ',';
+    line += std::to_string(payloadSize);
+    line += '\n';
+
+    if (options.groupCommitEntries <= 1 && bufferedEntries == 0) {
+        // Payload straight from caller, and then the header line in one go
+        struct iovec parts[2] = {
+            { const_cast<char*>(input.data()), input.size() },
+            { const_cast<char*>(output.data()), output.size() }
+        };
+        const std::size_t length = input.size() + output.size();
+        ssize_t written;
+        do {
+            written = options.appendMode
+                ? ::writev(payloadFd, parts, 2)
+                : ::pwritev(payloadFd, parts, 2, static_cast<off_t>(payloadSize));
+            ++writeCalls;
+        } while (written < 0 && errno == EINTR);
+        if (written < 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not write to " + dirPath + "/" + stem);
+        }
+        if (static_cast<std::size_t>(written) < length) {
+            // Short write, so the rest is written piecewise
+            std::string rest = std::string(input).append(output).substr(static_cast<std::size_t>(written));
+            write_all(payloadFd, rest.data(), rest.size(), payloadSize + static_cast<std::uint64_t>(written));
+        }
+        write_all(headerFd, line.data(), line.size(), headerSize);
+        if (liveRing) {
+            liveRing->publish(line, headerSize, payloadSize, input, output);
+        }
+
+        payloadSize += length;
+        headerSize += line.size();
+        bufferedHeaderAt = headerSize;
+        bufferedPayloadAt = payloadSize;
+        ++entryCount;
+        return;
+    }
+
+    if (bufferedEntries == 0) {
+        oldestBuffered = std::chrono::steady_clock::now();
+    }
+    payloadBuffer.append(input);
+    payloadBuffer.append(output);
+    headerBuffer += line;
+    if (liveRing) {
+        bufferedSizes.push_back({ line.size(), input.size(), output.size() });
+    }
+    payloadSize += input.size() + output.size();
+    headerSize += line.size();
+    ++bufferedEntries;
+    ++entryCount;
+
+    if (bufferedEntries >= options.groupCommitEntries
+        || payloadBuffer.size() + headerBuffer.size() >= options.groupCommitBytes) {
+        flush();
+    } else {
+        flush_if_due();
+    }
+}
+
+void pair_writer::flush_if_due() {
+    if (bufferedEntries > 0 && std::chrono::steady_clock::now() - oldestBuffered >= options.groupCommitDelay) {
+        flush();
+    }
+}
+
+void pair_writer::flush() {
+    if (bufferedEntries == 0) {
+        return;
+    }
+    // Payloads before the header lines referring to them
+    write_all(payloadFd, payloadBuffer.data(), payloadBuffer.size(), bufferedPayloadAt);
+    write_all(headerFd, headerBuffer.data(), headerBuffer.size(), bufferedHeaderAt);
+
+    // Published once written, so that readers never checkpoint beyond what is in the files
+    if (liveRing) {
+        const std::string_view headers(headerBuffer);
+        const std::string_view payloads(payloadBuffer);
+        std::uint64_t headerAt = bufferedHeaderAt;
+        std::uint64_t payloadAt = bufferedPayloadAt;
+        for (const buffered_sizes& sizes : bufferedSizes) {
+            const std::size_t lineAt = headerAt - bufferedHeaderAt;
+            const std::size_t inputAt = payloadAt - bufferedPayloadAt;
+            liveRing->publish(headers.substr(lineAt, sizes.line), headerAt, payloadAt,
+                              payloads.substr(inputAt, sizes.input), payloads.substr(inputAt + sizes.input, sizes.output));
+            headerAt += sizes.line;
+            payloadAt += sizes.input + sizes.output;
+        }
+        bufferedSizes.clear();
+    }
+
+    payloadBuffer.clear();
+    headerBuffer.clear();
+    bufferedHeaderAt = headerSize;
+    bufferedPayloadAt = payloadSize;
+    bufferedEntries = 0;
+}
+
+void pair_writer::close(bool seal) {
+    if (headerFd < 0) {
+        return;
+    }
+    flush();
+    ::close(headerFd);
+    ::close(payloadFd);
+    headerFd = payloadFd = -1;
+
+    if (seal) {
+        seal_pair(dirPath, stem, headerSize, payloadSize);
+    }
+    // Readers of the ring see that it is closed after the seal, and find everything in files
+    liveRing.reset();
+}
+
+void seal_pair(const std::string& dirPath, const std::string& stem, std::uint64_t headerSize, std::uint64_t payloadSize) {
+    const std::string sealPath = dirPath + "/" + stem + ".sealed";
+    {
+        std::ofstream seal(sealPath + ".tmp", std::ios::out | std::ios::trunc);
+        seal << headerSize << "," << payloadSize << std::endl;
+        if (!seal) {
+            throw std::system_error(errno, std::generic_category(), "Could not write " + sealPath);
+        }
+    }
+    if (std::rename((sealPath + ".tmp").c_str(), sealPath.c_str()) != 0) {
+        throw std::system_error(errno, std::generic_category(), "Could not seal " + sealPath);
+    }
+}
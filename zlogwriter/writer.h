@@ -0,0 +1,113 @@
+//
+// Writer side of a header/payload pair, for applications producing logs for zlogread.
+//
+// Entries are appended payload first, and then the header line referring to it -- in one
+// write, so that readers never see a header line in pieces, nor one whose payload is not
+// there yet. Offsets are tracked here rather than asked for, and entries are group committed:
+// buffered and written many at a time, so that a busy writer does not make two system calls
+// per entry. Closing the pair seals it, so that readers know there will be no more data.
+//
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "livering.h"
+
+#define WRITER_GROUP_COMMIT_ENTRIES  64
+#define WRITER_GROUP_COMMIT_BYTES    (1UL * 1024 * 1024)
+#define WRITER_GROUP_COMMIT_DELAY    std::chrono::milliseconds(5) // longest an entry waits in buffer
+
+struct writer_options {
+    // Entries are buffered until this many, or this many bytes, or until the oldest has waited
+    // this long (checked when appending, so writers that go quiet should flush()). 1 writes each
+    // entry right away, payload straight from the caller using writev
+    std::size_t groupCommitEntries = WRITER_GROUP_COMMIT_ENTRIES;
+    std::size_t groupCommitBytes = WRITER_GROUP_COMMIT_BYTES;
+    std::chrono::steady_clock::duration groupCommitDelay = WRITER_GROUP_COMMIT_DELAY;
+
+    // Open files with O_APPEND, instead of writing at tracked offsets (pwrite)
+    bool appendMode = false;
+
+    // Also publish entries to a live ring (<stem>.live), for co-located readers
+    bool live = false;
+    std::size_t liveCapacity = LIVE_RING_CAPACITY;
+};
+
+class pair_writer {
+public:
+    // Opens (or creates) <stem>.header and <stem>.payload in 'dirPath', continuing after what is
+    // already there. Throws std::system_error on failure
+    pair_writer(const std::string& dirPath, const std::string& stem, const writer_options& options = {});
+    ~pair_writer();
+
+    pair_writer(const pair_writer&) = delete;
+    pair_writer& operator=(const pair_writer&) = delete;
+
+    // Appends entry, where 'fields' are the leading header fields (comma separated, without
+    // sizes and offset, which are added here). Throws std::system_error on write failure
+    void append(std::string_view fields, std::string_view input, std::string_view output);
+
+    // Writes what is buffered
+    void flush();
+
+    // Writes what is buffered, if the oldest entry has waited long enough
+    void flush_if_due();
+
+    // Flushes and closes pair, sealing it unless asked not to (e.g. when more is to be appended later)
+    void close(bool seal = true);
+
+    std::uint64_t header_size() const { return headerSize; }
+    std::uint64_t payload_size() const { return payloadSize; }
+
+    // Number of write system calls issued, and entries written, so far
+    unsigned long long writes() const { return writeCalls; }
+    unsigned long long entries() const { return entryCount; }
+
+private:
+    void write_all(int fd, const char* data, std::size_t length, std::uint64_t offset);
+
+    std::string dirPath;
+    std::string stem;
+    writer_options options;
+
+    int headerFd = -1;
+    int payloadFd = -1;
+
+    // Sizes of files, including what is buffered
+    std::uint64_t headerSize = 0;
+    std::uint64_t payloadSize = 0;
+
+    // Buffered (not yet written) entries, starting at these offsets
+    std::string headerBuffer;
+    std::string payloadBuffer;
+    std::uint64_t bufferedHeaderAt = 0;
+    std::uint64_t bufferedPayloadAt = 0;
+    std::size_t bufferedEntries = 0;
+    std::chrono::steady_clock::time_point oldestBuffered;
+
+    // Entries are published to the live ring once written, so buffered ones are kept track of
+    struct buffered_sizes {
+        std::size_t line;
+        std::size_t input;
+        std::size_t output;
+    };
+    std::vector<buffered_sizes> bufferedSizes;
+    std::unique_ptr<live_ring_writer> liveRing;
+
+    unsigned long long writeCalls = 0;
+    unsigned long long entryCount = 0;
+};
+
+// Seals pair, writing final sizes of both files to <stem>.sealed (renamed into place, so it is
+// never seen half written)
+void seal_pair(const std::string& dirPath, const std::string& stem, std::uint64_t headerSize, std::uint64_t payloadSize);
+
+#endif // WRITER_H